@@ -0,0 +1,247 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ *
+ * Process-wide table of interned tag names. The same few dozen names are
+ * repeated in every chunk so each one is stored once and tags refer to
+ * it by a 32bit atom. Atoms are never free'd, so names coming in from
+ * decoded data can only take the first three quarters of the table and
+ * the rest is kept for names the program itself asks for.
+ *
+ * Strings and atom entries never move once created so reading them needs
+ * no locking. Interning takes a mutex, but each thread keeps a small
+ * direct mapped cache in front of the table so that decoding doesn't
+ * touch the lock once the working set of names has been seen.
+ */
+#include <pthread.h>
+
+#include <libmc/minecraft.h>
+#include <libmc/nbt.h>
+
+#include "mpool.h"
+#include "atom.h"
+
+#define ATOM_PAGE_SHIFT		10
+#define ATOM_PAGE_SIZE		(1U << ATOM_PAGE_SHIFT)
+#define ATOM_MAX_PAGES		4096U
+#define ATOM_DECODE_MAX		((ATOM_MAX_PAGES / 4 * 3) << ATOM_PAGE_SHIFT)
+
+#define ATOM_CACHE_SIZE		256U
+
+struct atom {
+	const char *str;
+	uint32_t len;
+	uint32_t hash;
+};
+
+struct atom_cache {
+	uint32_t hash;
+	nbt_atom_t atom;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct atom *pages[ATOM_MAX_PAGES];
+static mpool_t strings;
+static nbt_atom_t *tbl;
+static uint32_t tbl_mask;
+/* atom 0 is NBT_ATOM_NONE */
+static uint32_t num_atoms = 1;
+
+static __thread struct atom_cache cache[ATOM_CACHE_SIZE];
+
+/* FNV-1a */
+static uint32_t str_hash(const char *str, size_t len)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		h ^= (uint8_t)str[i];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static struct atom *atom_get(nbt_atom_t a)
+{
+	return &pages[a >> ATOM_PAGE_SHIFT][a & (ATOM_PAGE_SIZE - 1)];
+}
+
+static int atom_eq(nbt_atom_t a, const char *str, size_t len, uint32_t h)
+{
+	struct atom *e = atom_get(a);
+	return e->hash == h && e->len == len && !memcmp(e->str, str, len);
+}
+
+/* must be called with lock held */
+static nbt_atom_t tbl_find(const char *str, size_t len, uint32_t h)
+{
+	uint32_t i;
+
+	if ( NULL == tbl )
+		return NBT_ATOM_NONE;
+
+	for(i = h & tbl_mask; tbl[i]; i = (i + 1) & tbl_mask) {
+		if ( atom_eq(tbl[i], str, len, h) )
+			return tbl[i];
+	}
+
+	return NBT_ATOM_NONE;
+}
+
+static void tbl_insert(nbt_atom_t *t, uint32_t mask, nbt_atom_t a)
+{
+	uint32_t i;
+
+	for(i = atom_get(a)->hash & mask; t[i]; i = (i + 1) & mask)
+		/* nothing */;
+	t[i] = a;
+}
+
+/* keep the table at most half full */
+static int tbl_grow(void)
+{
+	uint32_t i, sz = (tbl_mask + 1) * 2;
+	nbt_atom_t *new;
+
+	if ( NULL == tbl )
+		sz = 1024;
+
+	new = calloc(sz, sizeof(*new));
+	if ( NULL == new )
+		return 0;
+
+	for(i = 1; i < num_atoms; i++)
+		tbl_insert(new, sz - 1, i);
+
+	free(tbl);
+	tbl = new;
+	tbl_mask = sz - 1;
+	return 1;
+}
+
+/* must be called with lock held */
+static nbt_atom_t tbl_add(const char *str, size_t len, uint32_t h)
+{
+	nbt_atom_t a = num_atoms;
+	struct atom *e;
+	char *copy;
+
+	if ( (a >> ATOM_PAGE_SHIFT) >= ATOM_MAX_PAGES )
+		return NBT_ATOM_NONE;
+
+	if ( NULL == strings ) {
+		strings = mpool_new(0);
+		if ( NULL == strings )
+			return NBT_ATOM_NONE;
+	}
+
+	if ( NULL == tbl || (a + 1) * 2 > tbl_mask + 1 ) {
+		if ( !tbl_grow() )
+			return NBT_ATOM_NONE;
+	}
+
+	if ( NULL == pages[a >> ATOM_PAGE_SHIFT] ) {
+		pages[a >> ATOM_PAGE_SHIFT] = calloc(ATOM_PAGE_SIZE,
+							sizeof(*e));
+		if ( NULL == pages[a >> ATOM_PAGE_SHIFT] )
+			return NBT_ATOM_NONE;
+	}
+
+	copy = mpool_alloc(strings, len + 1);
+	if ( NULL == copy )
+		return NBT_ATOM_NONE;
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+
+	e = atom_get(a);
+	e->str = copy;
+	e->len = len;
+	e->hash = h;
+
+	num_atoms++;
+	tbl_insert(tbl, tbl_mask, a);
+	return a;
+}
+
+/* Create if not found, if create is set. With a budget too, only while
+ * that and the decoders' share of the table last.
+ */
+static nbt_atom_t lookup(const char *str, size_t len, int create,
+			unsigned int *budget)
+{
+	struct atom_cache *c;
+	nbt_atom_t a;
+	uint32_t h;
+
+	h = str_hash(str, len);
+	c = &cache[h % ATOM_CACHE_SIZE];
+	if ( c->atom && c->hash == h && atom_eq(c->atom, str, len, h) )
+		return c->atom;
+
+	pthread_mutex_lock(&lock);
+	a = tbl_find(str, len, h);
+	if ( NBT_ATOM_NONE == a && budget ) {
+		if ( !*budget || num_atoms >= ATOM_DECODE_MAX )
+			create = 0;
+	}
+	if ( NBT_ATOM_NONE == a && create ) {
+		a = tbl_add(str, len, h);
+		if ( a && budget )
+			(*budget)--;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if ( a ) {
+		c->hash = h;
+		c->atom = a;
+	}
+
+	return a;
+}
+
+nbt_atom_t atom_intern(const char *str, size_t len)
+{
+	return lookup(str, len, 1, NULL);
+}
+
+/* for names from decoded data, which can add at most *budget new ones */
+nbt_atom_t atom_intern_budget(const char *str, size_t len,
+				unsigned int *budget)
+{
+	return lookup(str, len, 1, budget);
+}
+
+/* Like atom_intern() but never creates, a name which was never interned
+ * can't be the name of any tag.
+ */
+nbt_atom_t atom_find(const char *str, size_t len)
+{
+	return lookup(str, len, 0, NULL);
+}
+
+const char *atom_str(nbt_atom_t a)
+{
+	if ( NBT_ATOM_NONE == a )
+		return NULL;
+	return atom_get(a)->str;
+}
+
+size_t atom_len(nbt_atom_t a)
+{
+	if ( NBT_ATOM_NONE == a )
+		return 0;
+	return atom_get(a)->len;
+}
+
+nbt_atom_t nbt_atom(const char *name)
+{
+	return atom_intern(name, strlen(name));
+}
+
+const char *nbt_atom_str(nbt_atom_t a)
+{
+	return atom_str(a);
+}
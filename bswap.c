@@ -0,0 +1,178 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ *
+ * Bulk byte swapping for converting Int_Array and Long_Array payloads
+ * between wire order and native order. There's a vector kernel for each
+ * of SSE2, AVX2 and NEON, chosen by simd_run(). The scalar loop mops up
+ * the tails.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <simd.h>
+#include <bswap.h>
+
+static void swap32_scalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	uint32_t v;
+	size_t i;
+
+	for(i = 0; i < n; i++) {
+		memcpy(&v, src + i * sizeof(v), sizeof(v));
+		v = __builtin_bswap32(v);
+		memcpy(dst + i * sizeof(v), &v, sizeof(v));
+	}
+}
+
+static void swap64_scalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	uint64_t v;
+	size_t i;
+
+	for(i = 0; i < n; i++) {
+		memcpy(&v, src + i * sizeof(v), sizeof(v));
+		v = __builtin_bswap64(v);
+		memcpy(dst + i * sizeof(v), &v, sizeof(v));
+	}
+}
+
+#if defined(__SSE2__)
+/* no pshufb without SSSE3, so swap the bytes in each 16bit word and then
+ * shuffle the words around
+ */
+static __m128i swap16_sse2(__m128i x)
+{
+	return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+static size_t swap32_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i;
+
+	for(i = 0; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		x = swap16_sse2(x);
+		x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+		x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+		_mm_storeu_si128((__m128i *)(dst + i * 4), x);
+	}
+
+	return i;
+}
+
+static size_t swap64_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i;
+
+	for(i = 0; i + 2 <= n; i += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i * 8));
+		x = swap16_sse2(x);
+		x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+		x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+		_mm_storeu_si128((__m128i *)(dst + i * 8), x);
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t swap32_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m256i mask = _mm256_setr_epi8(
+			3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+			3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	size_t i;
+
+	for(i = 0; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+		x = _mm256_shuffle_epi8(x, mask);
+		_mm256_storeu_si256((__m256i *)(dst + i * 4), x);
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t swap64_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m256i mask = _mm256_setr_epi8(
+			7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+			7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	size_t i;
+
+	for(i = 0; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + i * 8));
+		x = _mm256_shuffle_epi8(x, mask);
+		_mm256_storeu_si256((__m256i *)(dst + i * 8), x);
+	}
+
+	return i;
+}
+#elif defined(__ARM_NEON)
+static size_t swap32_neon(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i;
+
+	for(i = 0; i + 4 <= n; i += 4)
+		vst1q_u8(dst + i * 4, vrev32q_u8(vld1q_u8(src + i * 4)));
+
+	return i;
+}
+
+static size_t swap64_neon(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i;
+
+	for(i = 0; i + 2 <= n; i += 2)
+		vst1q_u8(dst + i * 8, vrev64q_u8(vld1q_u8(src + i * 8)));
+
+	return i;
+}
+#endif
+
+#if defined(__SSE2__)
+static const struct simd_kernels kern32 = {
+	.sse2 = swap32_sse2,
+	.avx2 = swap32_avx2,
+};
+static const struct simd_kernels kern64 = {
+	.sse2 = swap64_sse2,
+	.avx2 = swap64_avx2,
+};
+#elif defined(__ARM_NEON)
+static const struct simd_kernels kern32 = {
+	.neon = swap32_neon,
+};
+static const struct simd_kernels kern64 = {
+	.neon = swap64_neon,
+};
+#else
+static const struct simd_kernels kern32, kern64;
+#endif
+
+void bswap32_array(void *dst, const void *src, size_t n)
+{
+	size_t done;
+
+	done = simd_run(&kern32, dst, src, n);
+	swap32_scalar((uint8_t *)dst + done * 4,
+			(const uint8_t *)src + done * 4, n - done);
+}
+
+void bswap64_array(void *dst, const void *src, size_t n)
+{
+	size_t done;
+
+	done = simd_run(&kern64, dst, src, n);
+	swap64_scalar((uint8_t *)dst + done * 8,
+			(const uint8_t *)src + done * 8, n - done);
+}
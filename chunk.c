@@ -3,6 +3,7 @@
  *
  * Load each chunk. Chunks contain the actual level data encoded in NBT format
 */
+#include <pthread.h>
 #include <zlib.h>
 
 #include <libmc/minecraft.h>
@@ -10,6 +11,8 @@
 #include <libmc/chunk.h>
 #include <libmc/nbt.h>
 
+#include "nibble.h"
+
 #define CHUNK_BLOCKS_SIZE (CHUNK_X * CHUNK_Y * CHUNK_Z)
 #define CHUNK_DATA_SIZE (CHUNK_BLOCKS_SIZE / 2)
 
@@ -19,39 +22,139 @@
 #define SEC_FLOOR(y) (y / CHUNK_SECTION_Y)
 #define SEC_CEIL(y) ((y + (CHUNK_SECTION_Y - 1)) / CHUNK_SECTION_Y)
 
+/* blocks are in y, z, x order both in sections and in struct chunk_vox */
+#define SEC_BLOCKS	(CHUNK_SECTION_Y * CHUNK_Z * CHUNK_X)
+#define BLOCK_IDX(x, y, z) (((y) * CHUNK_Z + (z)) * CHUNK_X + (x))
+
 struct chunk_enc {
 	uint8_t *buf;
 	size_t sz;
 };
 
+/* Dense copy of the section arrays with a byte for each block, each
+ * array covering the whole chunk so that section n is the n'th run of
+ * SEC_BLOCKS. Absent sections are air with full skylight. Made the first
+ * time that blocks are edited and written back to the tree, for sections
+ * in vox_dirty, by chunk_encode().
+ */
+struct chunk_vox {
+	uint8_t blocks[CHUNK_BLOCKS_SIZE];
+	uint8_t data[CHUNK_BLOCKS_SIZE];
+	uint8_t sky[CHUNK_BLOCKS_SIZE];
+	uint8_t light[CHUNK_BLOCKS_SIZE];
+};
+
 struct _chunk {
 	nbt_t nbt;
 	nbt_tag_t level;
 	nbt_tag_t seclist;
 	nbt_tag_t section[CHUNK_NUM_SECTIONS];
+	struct chunk_vox *vox;
+	unsigned int vox_dirty;
+	/* sections with block edits that chunk_light_window() hasn't seen */
+	unsigned int light_dirty;
 	struct chunk_enc zlib;
 	struct chunk_enc raw;
+	/* nbt_hash_bytes() of the raw encoding, or 0. Known from the
+	 * buffer we were decoded from until we're changed, and from the
+	 * zlib encode after that.
+	 */
+	uint64_t hash;
+	/* decoded buffer which nbt borrows from, if any */
+	uint8_t *src;
 	unsigned int dirty_mask;
 	unsigned int ref;
 };
 
+/* tag names we look up, resolved to atoms once by chunk_keys() */
+enum {
+	KEY_LEVEL,
+	KEY_SECTIONS,
+	KEY_Y,
+	KEY_BLOCKS,
+	KEY_DATA,
+	KEY_SKYLIGHT,
+	KEY_BLOCKLIGHT,
+	KEY_HEIGHTMAP,
+	KEY_BIOMES,
+	KEY_ENTITIES,
+	KEY_TILEENTITIES,
+	KEY_XPOS,
+	KEY_ZPOS,
+	KEY_LASTUPDATE,
+	KEY_TERRAINPOPULATED,
+	KEY_MAX,
+};
+
+static const char * const key_names[KEY_MAX] = {
+	[KEY_LEVEL] = "Level",
+	[KEY_SECTIONS] = "Sections",
+	[KEY_Y] = "Y",
+	[KEY_BLOCKS] = "Blocks",
+	[KEY_DATA] = "Data",
+	[KEY_SKYLIGHT] = "SkyLight",
+	[KEY_BLOCKLIGHT] = "BlockLight",
+	[KEY_HEIGHTMAP] = "HeightMap",
+	[KEY_BIOMES] = "Biomes",
+	[KEY_ENTITIES] = "Entities",
+	[KEY_TILEENTITIES] = "TileEntities",
+	[KEY_XPOS] = "xPos",
+	[KEY_ZPOS] = "zPos",
+	[KEY_LASTUPDATE] = "LastUpdate",
+	[KEY_TERRAINPOPULATED] = "TerrainPopulated",
+};
+
+static nbt_atom_t keys[KEY_MAX];
+static int keys_ok;
+
+static void resolve_keys(void)
+{
+	unsigned int i;
+
+	for(i = 0; i < KEY_MAX; i++) {
+		keys[i] = nbt_atom(key_names[i]);
+		if ( NBT_ATOM_NONE == keys[i] )
+			return;
+	}
+
+	keys_ok = 1;
+}
+
+static int chunk_keys(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, resolve_keys);
+	return keys_ok;
+}
+
+static nbt_tag_t get_key(nbt_tag_t t, unsigned int key)
+{
+	return nbt_compound_get_atom(t, keys[key]);
+}
+
+static int set_key(nbt_tag_t t, unsigned int key, nbt_tag_t val)
+{
+	return nbt_compound_set_atom(t, keys[key], val);
+}
+
 static void set_dirty(struct _chunk *c, unsigned int mask)
 {
 	free(c->zlib.buf);
 	c->zlib.buf = NULL;
 	free(c->raw.buf);
 	c->raw.buf = NULL;
+	c->hash = 0;
 
 	c->dirty_mask |= mask;
 }
 
 static int create_section_blobs(nbt_t nbt, nbt_tag_t sec)
 {
-	static const char * const names[] = {
-		"Data",
-		"SkyLight",
-		"BlockLight",
-		"Blocks",
+	static const unsigned int names[] = {
+		KEY_DATA,
+		KEY_SKYLIGHT,
+		KEY_BLOCKLIGHT,
+		KEY_BLOCKS,
 	};
 	static const size_t sizes[] = {
 		2048U,
@@ -75,7 +178,7 @@ static int create_section_blobs(nbt_t nbt, nbt_tag_t sec)
 			goto out;
 		if ( !nbt_bytearray_set(tag, buf, sizes[i]) )
 			goto out;
-		if ( !nbt_compound_set(sec, names[i], tag) )
+		if ( !set_key(sec, names[i], tag) )
 			goto out;
 	}
 
@@ -94,7 +197,7 @@ static nbt_tag_t get_add_section(chunk_t c, uint8_t secno)
 		if ( NULL == list )
 			return NULL;
 
-		if ( !nbt_compound_set(c->level, "Sections", list) )
+		if ( !set_key(c->level, KEY_SECTIONS, list) )
 			return NULL;
 
 		c->seclist = list;
@@ -118,7 +221,7 @@ static nbt_tag_t get_add_section(chunk_t c, uint8_t secno)
 			return NULL;
 		if ( !nbt_byte_set(ytag, secno) )
 			return NULL;
-		if ( !nbt_compound_set(sec, "Y", ytag) )
+		if ( !set_key(sec, KEY_Y, ytag) )
 			return NULL;
 
 		c->section[secno] = sec;
@@ -129,143 +232,881 @@ static nbt_tag_t get_add_section(chunk_t c, uint8_t secno)
 	return c->section[secno];
 }
 
-static void clear_dirty_section(nbt_tag_t s)
+/* fill n blocks from a section array, which had better be the right size */
+static void vox_load(uint8_t *dst, nbt_tag_t arr, size_t n, int nibbles,
+			uint8_t dflt)
 {
-	uint8_t *buf;
+	const uint8_t *src;
 	size_t len;
 
-	if ( nbt_bytearray_get(nbt_compound_get(s, "SkyLight"),
-						&buf, &len) )
-		memset(buf, 0xff, len);
-	if ( nbt_bytearray_get(nbt_compound_get(s, "BlockLight"),
-						&buf, &len) )
-		memset(buf, 0xff, len);
+	if ( !nbt_bytearray_peek(arr, &src, &len) ||
+			len != ((nibbles) ? n / 2 : n) ) {
+		memset(dst, dflt, n);
+		return;
+	}
+
+	if ( nibbles )
+		nibble_unpack(dst, src, n);
+	else
+		memcpy(dst, src, n);
 }
 
+/* dense block storage, made from the tree if need be */
+static struct chunk_vox *get_vox(struct _chunk *c)
+{
+	struct chunk_vox *v;
+	unsigned int i;
+	nbt_tag_t sec;
+	size_t off;
+
+	if ( c->vox )
+		return c->vox;
+
+	v = malloc(sizeof(*v));
+	if ( NULL == v )
+		return NULL;
+
+	for(i = 0; i < CHUNK_NUM_SECTIONS; i++) {
+		sec = c->section[i];
+		off = i * SEC_BLOCKS;
+		vox_load(v->blocks + off, get_key(sec, KEY_BLOCKS),
+				SEC_BLOCKS, 0, 0);
+		vox_load(v->data + off, get_key(sec, KEY_DATA),
+				SEC_BLOCKS, 1, 0);
+		vox_load(v->sky + off, get_key(sec, KEY_SKYLIGHT),
+				SEC_BLOCKS, 1, (sec) ? 0 : 0x0f);
+		vox_load(v->light + off, get_key(sec, KEY_BLOCKLIGHT),
+				SEC_BLOCKS, 1, 0);
+	}
+
+	c->vox = v;
+	c->vox_dirty = 0;
+	return v;
+}
 
-static void clear_dirty(struct _chunk *c)
+/* copy n blocks back in to a section array */
+static int vox_store(nbt_tag_t arr, const uint8_t *src, size_t n, int nibbles)
 {
-	unsigned int i, num;
-	int32_t *hm;
+	uint8_t *dst;
+	size_t len;
 
-	if ( nbt_intarray_get(nbt_compound_get(c->level, "HeightMap"),
-						&hm, &num) ) {
-		for(i = 0; i < num; i++) {
-			hm[i] = htobe32(0xff);
-		}
+	if ( !nbt_bytearray_get(arr, &dst, &len) ||
+			len != ((nibbles) ? n / 2 : n) )
+		return 0;
+
+	if ( nibbles )
+		nibble_pack(dst, src, n);
+	else
+		memcpy(dst, src, n);
+	return 1;
+}
+
+static int all_zero(const uint8_t *buf)
+{
+	unsigned int i;
+
+	for(i = 0; i < SEC_BLOCKS; i++) {
+		if ( buf[i] )
+			return 0;
 	}
+	return 1;
+}
 
-	for(i = 0; i < CHUNK_NUM_SECTIONS; i++) {
-		if ( c->section[i] ) {
-			clear_dirty_section(c->section[i]);
+/* Bring the tree up to date with the dense blocks. Sections are only
+ * added for blocks which aren't air, or air with block light in it.
+ */
+static int sync_vox(struct _chunk *c)
+{
+	struct chunk_vox *v = c->vox;
+	unsigned int i, mask;
+	nbt_tag_t sec;
+	size_t off;
+
+	for(i = 0, mask = c->vox_dirty; mask; i++, mask >>= 1) {
+		if ( !(mask & 1) )
+			continue;
+
+		off = i * SEC_BLOCKS;
+		sec = c->section[i];
+		if ( NULL == sec ) {
+			if ( all_zero(v->blocks + off) &&
+					all_zero(v->light + off) )
+				continue;
+			sec = get_add_section(c, i);
+			if ( NULL == sec )
+				return 0;
 		}
+
+		if ( !vox_store(get_key(sec, KEY_BLOCKS),
+				v->blocks + off, SEC_BLOCKS, 0) )
+			return 0;
+		if ( !vox_store(get_key(sec, KEY_DATA),
+				v->data + off, SEC_BLOCKS, 1) )
+			return 0;
+		if ( !vox_store(get_key(sec, KEY_SKYLIGHT),
+				v->sky + off, SEC_BLOCKS, 1) )
+			return 0;
+		if ( !vox_store(get_key(sec, KEY_BLOCKLIGHT),
+				v->light + off, SEC_BLOCKS, 1) )
+			return 0;
 	}
 
-	c->dirty_mask = 0;
+	c->vox_dirty = 0;
+	return 1;
 }
 
-int chunk_floor(chunk_t c, uint8_t y, unsigned int blk)
+/* blocks in sections lo to hi (exclusive) are about to change */
+static void vox_touch(struct _chunk *c, unsigned int lo, unsigned int hi)
 {
-	unsigned int x, z;
-	uint8_t *buf, secno, ty;
-	nbt_tag_t s;
+	unsigned int mask;
+
+	mask = ((1U << hi) - 1) & ~((1U << lo) - 1);
+	c->vox_dirty |= mask;
+	c->light_dirty |= mask;
+	set_dirty(c, mask);
+}
+
+int chunk_get_block(chunk_t c, uint8_t x, uint8_t y, uint8_t z,
+			uint8_t *id, uint8_t *data)
+{
+	const uint8_t *buf;
+	unsigned int idx;
+	nbt_tag_t sec;
 	size_t len;
 
-	secno = y / CHUNK_NUM_SECTIONS;
+	if ( x >= CHUNK_X || z >= CHUNK_Z )
+		return 0;
 
-	s = get_add_section(c, secno);
-	if ( NULL == s )
+	if ( c->vox ) {
+		idx = BLOCK_IDX(x, y, z);
+		*id = c->vox->blocks[idx];
+		*data = c->vox->data[idx];
+		return 1;
+	}
+
+	/* no need to unpack the whole chunk for one block */
+	sec = c->section[SEC_FLOOR(y)];
+	idx = BLOCK_IDX(x, y % CHUNK_SECTION_Y, z);
+	*id = 0;
+	*data = 0;
+
+	if ( nbt_bytearray_peek(get_key(sec, KEY_BLOCKS), &buf, &len) &&
+			len == SEC_BLOCKS )
+		*id = buf[idx];
+	if ( nbt_bytearray_peek(get_key(sec, KEY_DATA), &buf, &len) &&
+			len == SEC_BLOCKS / 2 )
+		*data = (buf[idx / 2] >> ((idx & 1) * 4)) & 0x0f;
+
+	return 1;
+}
+
+int chunk_set_block(chunk_t c, uint8_t x, uint8_t y, uint8_t z,
+			uint8_t id, uint8_t data)
+{
+	struct chunk_block b = {
+		.x = x,
+		.y = y,
+		.z = z,
+		.id = id,
+		.data = data,
+	};
+
+	return chunk_set_blocks(c, &b, 1);
+}
+
+int chunk_get_blocks(chunk_t c, struct chunk_block *b, unsigned int n)
+{
+	struct chunk_vox *v;
+	unsigned int i, idx;
+
+	v = get_vox(c);
+	if ( NULL == v )
 		return 0;
 
-	ty = y - secno * CHUNK_SECTION_Y;
+	for(i = 0; i < n; i++) {
+		if ( b[i].x >= CHUNK_X || b[i].z >= CHUNK_Z )
+			return 0;
+		idx = BLOCK_IDX(b[i].x, b[i].y, b[i].z);
+		b[i].id = v->blocks[idx];
+		b[i].data = v->data[idx];
+	}
+
+	return 1;
+}
+
+/* All or nothing, and the chunk is only marked dirty once for each run
+ * of blocks in the same section.
+ */
+int chunk_set_blocks(chunk_t c, const struct chunk_block *b, unsigned int n)
+{
+	struct chunk_vox *v;
+	unsigned int i, idx, secno, last;
+
+	for(i = 0; i < n; i++) {
+		if ( b[i].x >= CHUNK_X || b[i].z >= CHUNK_Z )
+			return 0;
+	}
 
-	if ( !nbt_bytearray_get(nbt_compound_get(s, "Blocks"),
-				&buf, &len) )
+	v = get_vox(c);
+	if ( NULL == v )
 		return 0;
 
-	for(x = 0; x < CHUNK_X; x++) {
-		for(z = 0; z < CHUNK_Z; z++) {
-			buf[(ty * CHUNK_Z * CHUNK_X) + (z * CHUNK_X) + x] = blk;
+	for(i = 0, last = CHUNK_NUM_SECTIONS; i < n; i++) {
+		secno = SEC_FLOOR(b[i].y);
+		if ( secno != last ) {
+			vox_touch(c, secno, secno + 1);
+			last = secno;
 		}
+		idx = BLOCK_IDX(b[i].x, b[i].y, b[i].z);
+		v->blocks[idx] = b[i].id;
+		v->data[idx] = b[i].data & 0x0f;
+	}
+
+	return 1;
+}
+
+/* How much each block id dims skylight passing down through it */
+static const uint8_t opacity[256] = {
+	[0 ... 255] = 15,
+	[0] = 0,	/* air */
+	[6] = 0,	/* sapling */
+	[8] = 3,	/* water */
+	[9] = 3,
+	[18] = 1,	/* leaves */
+	[20] = 0,	/* glass */
+	[26] = 0,	/* bed */
+	[27] = 0,	/* rails */
+	[28] = 0,
+	[30] = 1,	/* web */
+	[31] = 0,	/* plants */
+	[32] = 0,
+	[37] = 0,
+	[38] = 0,
+	[39] = 0,
+	[40] = 0,
+	[50] = 0,	/* torch */
+	[51] = 0,	/* fire */
+	[52] = 0,	/* spawner */
+	[55] = 0,	/* redstone */
+	[59] = 0,	/* crops */
+	[63] = 0,	/* signs, doors, ladders and levers */
+	[64] = 0,
+	[65] = 0,
+	[66] = 0,
+	[68] = 0,
+	[69] = 0,
+	[70] = 0,
+	[71] = 0,
+	[72] = 0,
+	[75] = 0,
+	[76] = 0,
+	[77] = 0,
+	[78] = 0,	/* snow */
+	[79] = 3,	/* ice */
+	[81] = 0,	/* cactus */
+	[83] = 0,	/* reeds */
+	[85] = 0,	/* fence */
+	[90] = 0,	/* portal */
+	[92] = 0,	/* cake */
+	[93] = 0,	/* repeaters */
+	[94] = 0,
+	[96] = 0,	/* trapdoor */
+	[101] = 0,	/* bars and panes */
+	[102] = 0,
+	[104] = 0,	/* stems */
+	[105] = 0,
+	[106] = 0,	/* vines */
+	[107] = 0,	/* fence gate */
+	[111] = 0,	/* lily pad */
+	[113] = 0,	/* nether fence */
+	[115] = 0,	/* nether wart */
+	[117] = 0,	/* brewing stand */
+	[119] = 0,	/* end portal */
+	[122] = 0,	/* dragon egg */
+	[127] = 0,	/* cocoa */
+	[131] = 0,	/* tripwire */
+	[132] = 0,
+	[139] = 0,	/* wall */
+	[140] = 0,	/* flower pot */
+	[141] = 0,	/* carrots, potatoes */
+	[142] = 0,
+	[143] = 0,	/* button */
+	[144] = 0,	/* skull */
+	[147] = 0,	/* pressure plates */
+	[148] = 0,
+	[149] = 0,	/* comparators */
+	[150] = 0,
+	[157] = 0,	/* activator rail */
+	[160] = 0,	/* stained pane */
+	[171] = 0,	/* carpet */
+	[175] = 0,	/* double plants */
+};
+
+#define LAYER	(CHUNK_Z * CHUNK_X)
+
+static void layer_opacity(uint8_t *op, const uint8_t *blocks)
+{
+	unsigned int i;
+
+	for(i = 0; i < LAYER; i++)
+		op[i] = opacity[blocks[i]];
+}
+
+/* Take the skylight coming down from the layer above, sky, to this layer,
+ * out, for every column at once. Once light has been dimmed even
+ * transparent blocks take one off. In a clean section (!all) a column
+ * keeps its stored light unless what comes down differs from the stored
+ * light above it, old, so light which the client spread sideways isn't
+ * lost. old and sky are updated for the next layer down. Returns non-zero
+ * if out changed. Masks rather than branches, and no aliasing, so that
+ * gcc vectorizes it at -O2.
+ */
+static unsigned int sky_layer(uint8_t *restrict out, uint8_t *restrict sky,
+				uint8_t *restrict old,
+				const uint8_t *restrict op, uint8_t all)
+{
+	unsigned int i;
+	uint8_t diff = 0;
+
+	for(i = 0; i < LAYER; i++) {
+		uint8_t l = sky[i], o = op[i], prev = out[i], lit, next;
+
+		o = ((o == 0) & (l < 15)) ? 1 : o;
+		lit = (l > o) ? l - o : 0;
+		next = (all | (l != old[i])) ? lit : prev;
+		diff |= next ^ prev;
+		old[i] = prev;
+		out[i] = next;
+		sky[i] = next;
+	}
+
+	return diff;
+}
+
+/* Set the height of columns which haven't met an opaque block yet, if
+ * they meet one in layer y, and return how many still haven't. Vectorizes
+ * like sky_layer().
+ */
+static unsigned int height_layer(int32_t *restrict hm,
+				const uint8_t *restrict op, int32_t y)
+{
+	unsigned int i, left = 0;
+
+	for(i = 0; i < LAYER; i++) {
+		int32_t h = hm[i], m;
+
+		m = (h >> 31) & -(int32_t)(op[i] != 0);
+		h = (h & ~m) | ((y + 1) & m);
+		hm[i] = h;
+		left += (uint32_t)h >> 31;
+	}
+
+	return left;
+}
+
+/* Recompute the heightmap, and vertical skylight for the sections in
+ * dirty_mask. Below those, clean sections keep their stored light except
+ * in columns where the light coming down has changed, and once nothing
+ * has changed and nothing further down is dirty we stop.
+ */
+static int relight(struct _chunk *c)
+{
+	int32_t height[LAYER], *hm;
+	uint8_t op[LAYER], sky[LAYER], old[LAYER];
+	unsigned int mask, num, i, left = LAYER;
+	struct chunk_vox *v;
+	int y, top, dtop;
+	uint8_t changed = 0;
+
+	v = get_vox(c);
+	if ( NULL == v )
+		return 0;
+
+	mask = c->dirty_mask & ((1U << CHUNK_NUM_SECTIONS) - 1);
+	for(top = CHUNK_NUM_SECTIONS - 1; top >= 0; top--) {
+		if ( c->section[top] || (c->vox_dirty & (1U << top)) )
+			break;
+	}
+	for(dtop = CHUNK_NUM_SECTIONS - 1; dtop >= 0; dtop--) {
+		if ( mask & (1U << dtop) )
+			break;
+	}
+
+	for(i = 0; i < LAYER; i++)
+		height[i] = -1;
+
+	/* above the dirty sections only the heightmap needs doing */
+	for(y = (top + 1) * CHUNK_SECTION_Y - 1;
+			left && y >= (dtop + 1) * CHUNK_SECTION_Y; y--) {
+		layer_opacity(op, v->blocks + BLOCK_IDX(0, y, 0));
+		left = height_layer(height, op, y);
+	}
+
+	y = (dtop + 1) * CHUNK_SECTION_Y;
+	if ( y < CHUNK_Y )
+		memcpy(sky, v->sky + BLOCK_IDX(0, y, 0), LAYER);
+	else
+		memset(sky, 0x0f, LAYER);
+	memcpy(old, sky, LAYER);
+
+	for(y = y - 1; y >= 0; y--) {
+		unsigned int sec = 1U << SEC_FLOOR(y);
+
+		if ( !(mask & (sec | (sec - 1))) && !memcmp(sky, old, LAYER) )
+			break;
+
+		layer_opacity(op, v->blocks + BLOCK_IDX(0, y, 0));
+		if ( left )
+			left = height_layer(height, op, y);
+		changed |= sky_layer(v->sky + BLOCK_IDX(0, y, 0), sky, old,
+					op, !!(mask & sec));
+
+		if ( y % CHUNK_SECTION_Y )
+			continue;
+
+		if ( changed || (mask & sec) )
+			c->vox_dirty |= sec;
+		changed = 0;
+	}
+
+	/* stopped part way through a section */
+	if ( y >= 0 && changed )
+		c->vox_dirty |= 1U << SEC_FLOOR(y);
+
+	for(; left && y >= 0; y--) {
+		layer_opacity(op, v->blocks + BLOCK_IDX(0, y, 0));
+		left = height_layer(height, op, y);
+	}
+
+	if ( nbt_intarray_get(get_key(c->level, KEY_HEIGHTMAP),
+				&hm, &num) && num == LAYER ) {
+		for(i = 0; i < LAYER; i++)
+			hm[i] = (height[i] < 0) ? 0 : height[i];
 	}
 
 	return 1;
 }
 
+/* How bright each block id glows */
+static const uint8_t emission[256] = {
+	[10] = 15,	/* lava */
+	[11] = 15,
+	[39] = 1,	/* brown mushroom */
+	[50] = 14,	/* torch */
+	[51] = 15,	/* fire */
+	[62] = 13,	/* lit furnace */
+	[74] = 9,	/* glowing redstone ore */
+	[76] = 7,	/* redstone torch */
+	[89] = 15,	/* glowstone */
+	[90] = 11,	/* portal */
+	[91] = 15,	/* jack o'lantern */
+	[94] = 9,	/* powered repeater */
+	[117] = 1,	/* brewing stand */
+	[119] = 15,	/* end portal */
+	[120] = 1,	/* end portal frame */
+	[122] = 1,	/* dragon egg */
+	[124] = 15,	/* lit redstone lamp */
+	[130] = 7,	/* ender chest */
+	[138] = 15,	/* beacon */
+	[169] = 15,	/* sea lantern */
+};
+
+/* a block in the window, and for removals the light it used to have */
+struct light_node {
+	uint32_t chunk;
+	uint16_t idx;
+	uint8_t level;
+};
+
+struct light_queue {
+	struct light_node *node;
+	size_t head, tail, size;
+};
+
+struct light_win {
+	struct _chunk **c;
+	unsigned int w, h;
+	unsigned int *changed;
+	struct light_queue inc;
+	struct light_queue dec;
+};
+
+static int lq_push(struct light_queue *q, unsigned int ci,
+			unsigned int idx, uint8_t level)
+{
+	if ( q->tail == q->size ) {
+		struct light_node *new;
+		size_t sz = (q->size) ? q->size * 2 : 4096;
+
+		new = realloc(q->node, sz * sizeof(*new));
+		if ( NULL == new )
+			return 0;
+		q->node = new;
+		q->size = sz;
+	}
+
+	q->node[q->tail].chunk = ci;
+	q->node[q->tail].idx = idx;
+	q->node[q->tail].level = level;
+	q->tail++;
+	return 1;
+}
+
+static int lq_pop(struct light_queue *q, struct light_node *n)
+{
+	if ( q->head == q->tail ) {
+		q->head = q->tail = 0;
+		return 0;
+	}
+	*n = q->node[q->head++];
+	return 1;
+}
+
+/* find the i'th of the six blocks next to n, which may be over the border
+ * in to a neighbouring chunk, or missing altogether
+ */
+static int light_next(struct light_win *lw, const struct light_node *n,
+			unsigned int i, struct light_node *out)
+{
+	unsigned int x, y, z, cx, cz;
+
+	x = n->idx % CHUNK_X;
+	z = (n->idx / CHUNK_X) % CHUNK_Z;
+	y = n->idx / (CHUNK_X * CHUNK_Z);
+	cx = n->chunk % lw->w;
+	cz = n->chunk / lw->w;
+
+	switch(i) {
+	case 0:
+		if ( y + 1 >= CHUNK_Y )
+			return 0;
+		y++;
+		break;
+	case 1:
+		if ( y == 0 )
+			return 0;
+		y--;
+		break;
+	case 2:
+		if ( x + 1 == CHUNK_X ) {
+			if ( cx + 1 == lw->w )
+				return 0;
+			cx++;
+		}
+		x = (x + 1) % CHUNK_X;
+		break;
+	case 3:
+		if ( x == 0 ) {
+			if ( cx == 0 )
+				return 0;
+			cx--;
+		}
+		x = (x + CHUNK_X - 1) % CHUNK_X;
+		break;
+	case 4:
+		if ( z + 1 == CHUNK_Z ) {
+			if ( cz + 1 == lw->h )
+				return 0;
+			cz++;
+		}
+		z = (z + 1) % CHUNK_Z;
+		break;
+	case 5:
+		if ( z == 0 ) {
+			if ( cz == 0 )
+				return 0;
+			cz--;
+		}
+		z = (z + CHUNK_Z - 1) % CHUNK_Z;
+		break;
+	}
+
+	out->chunk = cz * lw->w + cx;
+	out->idx = BLOCK_IDX(x, y, z);
+	return NULL != lw->c[out->chunk];
+}
+
+static void light_set(struct light_win *lw, const struct light_node *n,
+			uint8_t level)
+{
+	lw->c[n->chunk]->vox->light[n->idx] = level;
+	lw->changed[n->chunk] |= 1U << SEC_FLOOR(n->idx / LAYER);
+}
+
+/* Darken everything lit by the blocks in the removal queue. Anything
+ * brighter than what's being removed must have its own source, so it
+ * goes on the increase queue to fill back in, as do any light sources
+ * that got caught up in it.
+ */
+static int light_decrease(struct light_win *lw)
+{
+	struct light_node n, m;
+	unsigned int i;
+	uint8_t l, blk;
+
+	while( lq_pop(&lw->dec, &n) ) {
+		for(i = 0; i < 6; i++) {
+			if ( !light_next(lw, &n, i, &m) )
+				continue;
+
+			l = lw->c[m.chunk]->vox->light[m.idx];
+			if ( 0 == l )
+				continue;
+
+			if ( l >= n.level ) {
+				if ( !lq_push(&lw->inc, m.chunk, m.idx, 0) )
+					return 0;
+				continue;
+			}
+
+			light_set(lw, &m, 0);
+			if ( !lq_push(&lw->dec, m.chunk, m.idx, l) )
+				return 0;
+
+			blk = lw->c[m.chunk]->vox->blocks[m.idx];
+			if ( emission[blk] ) {
+				light_set(lw, &m, emission[blk]);
+				if ( !lq_push(&lw->inc, m.chunk, m.idx, 0) )
+					return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/* flood outwards from the increase queue, losing at least one level for
+ * each step and more through blocks which dim light
+ */
+static int light_increase(struct light_win *lw)
+{
+	struct light_node n, m;
+	unsigned int i;
+	int l, o;
+
+	while( lq_pop(&lw->inc, &n) ) {
+		l = lw->c[n.chunk]->vox->light[n.idx];
+		if ( l <= 1 )
+			continue;
+
+		for(i = 0; i < 6; i++) {
+			if ( !light_next(lw, &n, i, &m) )
+				continue;
+
+			o = opacity[lw->c[m.chunk]->vox->blocks[m.idx]];
+			o = l - ((o > 1) ? o : 1);
+			if ( o <= lw->c[m.chunk]->vox->light[m.idx] )
+				continue;
+
+			light_set(lw, &m, o);
+			if ( !lq_push(&lw->inc, m.chunk, m.idx, 0) )
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* clear out the old light in edited sections and relight their sources */
+static int light_seed(struct light_win *lw, unsigned int ci)
+{
+	struct _chunk *c = lw->c[ci];
+	struct chunk_vox *v = c->vox;
+	struct light_node n;
+	unsigned int s, i;
+
+	n.chunk = ci;
+	for(s = 0; s < CHUNK_NUM_SECTIONS; s++) {
+		if ( !(c->light_dirty & (1U << s)) )
+			continue;
+
+		for(i = s * SEC_BLOCKS; i < (s + 1) * SEC_BLOCKS; i++) {
+			n.idx = i;
+			if ( v->light[i] ) {
+				if ( !lq_push(&lw->dec, ci, i, v->light[i]) )
+					return 0;
+				light_set(lw, &n, 0);
+			}
+			if ( emission[v->blocks[i]] ) {
+				light_set(lw, &n, emission[v->blocks[i]]);
+				if ( !lq_push(&lw->inc, ci, i, 0) )
+					return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+int chunk_light_window(chunk_t *win, unsigned int w, unsigned int h,
+			uint8_t *changed)
+{
+	struct light_win lw;
+	uint8_t *loaded = NULL;
+	unsigned int i;
+	int ret = 0;
+
+	/* chunks are indexed by a uint32_t in the queues */
+	if ( w == 0 || h == 0 || w > UINT32_MAX / h )
+		return 0;
+
+	memset(&lw, 0, sizeof(lw));
+	lw.c = win;
+	lw.w = w;
+	lw.h = h;
+
+	lw.changed = calloc(w * h, sizeof(*lw.changed));
+	if ( NULL == lw.changed )
+		return 0;
+
+	loaded = calloc(w * h, sizeof(*loaded));
+	if ( NULL == loaded )
+		goto out;
+
+	for(i = 0; i < w * h; i++) {
+		if ( NULL == win[i] || win[i]->vox )
+			continue;
+		if ( NULL == get_vox(win[i]) )
+			goto out;
+		loaded[i] = 1;
+	}
+
+	/* all the removals have to be done before any relighting, or a
+	 * source could be relit only to be removed again
+	 */
+	for(i = 0; i < w * h; i++) {
+		if ( win[i] && !light_seed(&lw, i) )
+			goto out;
+	}
+
+	if ( !light_decrease(&lw) )
+		goto out;
+	if ( !light_increase(&lw) )
+		goto out;
+
+	for(i = 0; i < w * h; i++) {
+		if ( changed )
+			changed[i] = !!lw.changed[i];
+		if ( NULL == win[i] )
+			continue;
+		win[i]->light_dirty = 0;
+		if ( lw.changed[i] ) {
+			win[i]->vox_dirty |= lw.changed[i];
+			set_dirty(win[i], 0);
+		}
+	}
+
+	ret = 1;
+out:
+	/* the border is mostly untouched, don't leave it all unpacked */
+	for(i = 0; loaded && i < w * h; i++) {
+		if ( loaded[i] && !win[i]->vox_dirty ) {
+			free(win[i]->vox);
+			win[i]->vox = NULL;
+		}
+	}
+	free(loaded);
+	free(lw.inc.node);
+	free(lw.dec.node);
+	free(lw.changed);
+	return ret;
+}
+
+int chunk_floor(chunk_t c, uint8_t y, unsigned int blk)
+{
+	struct chunk_vox *v;
+
+	v = get_vox(c);
+	if ( NULL == v )
+		return 0;
+
+	vox_touch(c, SEC_FLOOR(y), SEC_FLOOR(y) + 1);
+	memset(v->blocks + BLOCK_IDX(0, y, 0), blk, CHUNK_Z * CHUNK_X);
+	return 1;
+}
+
 int chunk_solid(chunk_t c, unsigned int blk)
 {
-	uint8_t *buf;
-	size_t len;
+	struct chunk_vox *v;
 
-	if ( !nbt_bytearray_get(nbt_compound_get(c->level, "Blocks"),
-				&buf, &len) )
+	v = get_vox(c);
+	if ( NULL == v )
 		return 0;
-	memset(buf, blk, len);
 
+	vox_touch(c, 0, CHUNK_NUM_SECTIONS);
+	memset(v->blocks, blk, sizeof(v->blocks));
 	return 1;
 }
 
 static const uint8_t *chunk_enc_raw(chunk_t c, size_t *sz)
 {
 	uint8_t *buf;
+	size_t len;
 
 	if ( c->raw.buf ) {
 		*sz = c->raw.sz;
 		return c->raw.buf;
 	}
 
-	*sz = nbt_size_in_bytes(c->nbt);
-	buf = malloc(*sz);
+	/* cached, so this is cheap */
+	len = nbt_size_in_bytes(c->nbt);
+	buf = malloc(len);
 	if ( NULL == buf )
 		return NULL;
 
-	if ( !nbt_get_bytes(c->nbt, buf, *sz) ) {
+	if ( !nbt_get_bytes(c->nbt, buf, len) ) {
 		free(buf);
 		return NULL;
 	}
 
 	c->raw.buf = buf;
-	c->raw.sz = *sz;
+	c->raw.sz = len;
+	*sz = len;
 	return buf;
 }
 
+/* deflate straight from the tree, no intermediate raw buffer */
 static const uint8_t *chunk_enc_zlib(chunk_t c, size_t *sz)
 {
-	size_t dlen, clen;
-	const uint8_t *dbuf;
-	uint8_t *cbuf = NULL;
+	struct nbt_sink *s;
 
 	if ( c->zlib.buf ) {
 		*sz = c->zlib.sz;
 		return c->zlib.buf;
 	}
 
-	dbuf = chunk_enc_raw(c, &dlen);
-	if ( NULL == dbuf )
-		goto out;
-
-	clen = dlen + 1024;
-	cbuf = malloc(clen);
-	if ( NULL == cbuf )
-		goto out;
+	s = libmc_deflate_sink(LIBMC_DEFLATE_ZLIB, -1);
+	if ( NULL == s )
+		return NULL;
 
-	if ( compress(cbuf, &clen, dbuf, dlen) == Z_OK ) {
-		*sz = clen;
-	}else{
-		free(cbuf);
-		cbuf = NULL;
+	if ( !nbt_encode(c->nbt, s) ) {
+		libmc_deflate_abort(s);
+		return NULL;
 	}
 
-	c->zlib.buf = cbuf;
-	c->zlib.sz = clen;
+	c->hash = libmc_deflate_hash(s);
+	if ( !libmc_deflate_finish(s, &c->zlib.buf, &c->zlib.sz) )
+		return NULL;
 
-out:
-	return cbuf;
+	*sz = c->zlib.sz;
+	return c->zlib.buf;
+}
+
+/* relight and bring the tree up to date, ready for encoding */
+static int settle(struct _chunk *c)
+{
+	if ( c->dirty_mask && !relight(c) )
+		return 0;
+	if ( c->vox_dirty && !sync_vox(c) )
+		return 0;
+	c->dirty_mask = 0;
+	return 1;
 }
 
 const uint8_t *chunk_encode(chunk_t c, int enc, size_t *sz)
 {
-	clear_dirty(c);
+	if ( !settle(c) )
+		return NULL;
 
 	switch(enc) {
 	case CHUNK_ENC_ZLIB:
@@ -277,53 +1118,96 @@ const uint8_t *chunk_encode(chunk_t c, int enc, size_t *sz)
 	}
 }
 
+/* Hash of the raw encoding, comparable with nbt_hash_bytes() of a
+ * decompressed chunk. 0 on error. If it isn't already known then it
+ * comes from the zlib encode, which will be wanted anyway.
+ */
+uint64_t chunk_hash(chunk_t c)
+{
+	size_t sz;
+
+	if ( c->hash )
+		return c->hash;
+
+	if ( NULL == chunk_encode(c, CHUNK_ENC_ZLIB, &sz) )
+		return 0;
+
+	return c->hash;
+}
+
+/* whether buf, a decompressed chunk, holds the same tree as c */
+int chunk_same(chunk_t c, const uint8_t *buf, size_t len)
+{
+	nbt_t old;
+	int ret;
+
+	if ( !settle(c) )
+		return 0;
+
+	old = nbt_decode_borrowed(buf, len);
+	if ( NULL == old )
+		return 0;
+
+	ret = nbt_equal(c->nbt, old);
+	nbt_free(old);
+	return ret;
+}
+
 int chunk_strip_entities(chunk_t c)
 {
 	nbt_tag_t ents;
 
-	ents = nbt_compound_get(c->level, "Entities");
+	ents = get_key(c->level, KEY_ENTITIES);
 	if ( !nbt_list_nuke(ents) )
 		return 0;
 
-	set_dirty(c, ~0);
+	set_dirty(c, 0);
 	return 1;
 }
 
 int chunk_set_pos(chunk_t c, int32_t x, int32_t z)
 {
-	if ( !nbt_int_set(nbt_compound_get(c->level, "xPos"), x) )
+	int32_t ox, oz;
+
+	/* region_save() sets it every time, don't lose the hash for that */
+	if ( nbt_int_get(get_key(c->level, KEY_XPOS), &ox) &&
+			nbt_int_get(get_key(c->level, KEY_ZPOS), &oz) &&
+			ox == x && oz == z )
+		return 1;
+
+	if ( !nbt_int_set(get_key(c->level, KEY_XPOS), x) )
 		return 0;
-	if ( !nbt_int_set(nbt_compound_get(c->level, "zPos"), z) )
+	if ( !nbt_int_set(get_key(c->level, KEY_ZPOS), z) )
 		return 0;
 
-	set_dirty(c, ~0);
+	set_dirty(c, 0);
 	return 1;
 }
 
 int chunk_set_terrain_populated(chunk_t c, uint8_t p)
 {
 	nbt_tag_t tag;
-	tag = nbt_compound_get(c->level, "TerrainPopulated");
+	tag = get_key(c->level, KEY_TERRAINPOPULATED);
 	if ( NULL == tag ) {
 		tag = nbt_tag_new(c->nbt, NBT_TAG_Byte);
 		if ( NULL == tag )
 			return 0;
-		if ( !nbt_compound_set(c->level, "TerrainPopulated", tag) )
+		if ( !set_key(c->level, KEY_TERRAINPOPULATED, tag) )
 			return 0;
 	}
 	if ( !nbt_byte_set(tag, p) )
 		return 0;
 
-	set_dirty(c, ~0);
+	set_dirty(c, 0);
 	return 1;
 }
 
 static int create_int_keys(nbt_t nbt, nbt_tag_t level)
 {
-	static const char * const names[] = {
-		"LastUpdate",
-		"xPos",
-		"zPos",
+	static const unsigned int names[] = {
+		KEY_LASTUPDATE,
+		KEY_XPOS,
+		KEY_ZPOS,
 	};
 	static const uint8_t types[] = {
 		NBT_TAG_Long,
@@ -337,7 +1221,7 @@ static int create_int_keys(nbt_t nbt, nbt_tag_t level)
 		tag = nbt_tag_new(nbt, types[i]);
 		if ( NULL == tag )
 			return 0;
-		if ( !nbt_compound_set(level, names[i], tag) )
+		if ( !set_key(level, names[i], tag) )
 			return 0;
 	}
 	return 1;
@@ -345,8 +1229,8 @@ static int create_int_keys(nbt_t nbt, nbt_tag_t level)
 
 static int create_blob_keys(nbt_t nbt, nbt_tag_t level)
 {
-	static const char * const names[] = {
-		"Biomes",
+	static const unsigned int names[] = {
+		KEY_BIOMES,
 	};
 	static const size_t sizes[] = {
 		256U,
@@ -360,7 +1244,7 @@ static int create_blob_keys(nbt_t nbt, nbt_tag_t level)
 			return 0;
 		if ( !nbt_bytearray_set(tag, NULL, sizes[i]) )
 			return 0;
-		if ( !nbt_compound_set(level, names[i], tag) )
+		if ( !set_key(level, names[i], tag) )
 			return 0;
 	}
 
@@ -369,8 +1253,8 @@ static int create_blob_keys(nbt_t nbt, nbt_tag_t level)
 
 static int create_int_array_keys(nbt_t nbt, nbt_tag_t level)
 {
-	static const char * const names[] = {
-		"HeightMap",
+	static const unsigned int names[] = {
+		KEY_HEIGHTMAP,
 	};
 	static const size_t sizes[] = {
 		256U,
@@ -384,7 +1268,7 @@ static int create_int_array_keys(nbt_t nbt, nbt_tag_t level)
 			return 0;
 		if ( !nbt_intarray_set(tag, NULL, sizes[i]) )
 			return 0;
-		if ( !nbt_compound_set(level, names[i], tag) )
+		if ( !set_key(level, names[i], tag) )
 			return 0;
 	}
 
@@ -393,9 +1277,9 @@ static int create_int_array_keys(nbt_t nbt, nbt_tag_t level)
 
 static int create_list_keys(nbt_t nbt, nbt_tag_t level)
 {
-	static const char * const names[] = {
-		"TileEntities",
-		"Entities",
+	static const unsigned int names[] = {
+		KEY_TILEENTITIES,
+		KEY_ENTITIES,
 	};
 	static const uint8_t types[] = {
 		NBT_TAG_Byte,
@@ -408,7 +1292,7 @@ static int create_list_keys(nbt_t nbt, nbt_tag_t level)
 		tag = nbt_tag_new_list(nbt, types[i]);
 		if ( NULL == tag )
 			return 0;
-		if ( !nbt_compound_set(level, names[i], tag) )
+		if ( !set_key(level, names[i], tag) )
 			return 0;
 	}
 	return 1;
@@ -427,7 +1311,7 @@ static nbt_tag_t create_chunk_keys(nbt_t nbt)
 	if ( NULL == level )
 		return NULL;
 
-	if ( !nbt_compound_set(root, "Level", level) )
+	if ( !set_key(root, KEY_LEVEL, level) )
 		return NULL;
 
 	if ( !create_int_keys(nbt, level) )
@@ -446,6 +1330,9 @@ chunk_t chunk_new(void)
 {
 	struct _chunk *c;
 
+	if ( !chunk_keys() )
+		return NULL;
+
 	c = calloc(1, sizeof(*c));
 	if ( NULL == c )
 		goto out;
@@ -470,29 +1357,21 @@ out:
 	return c;
 }
 
-chunk_t chunk_from_bytes(uint8_t *buf, size_t sz)
+/* point level, seclist and section[] at the right bits of c->nbt */
+static int find_sections(struct _chunk *c)
 {
 	nbt_tag_t s, tag;
-	struct _chunk *c;
 	nbt_tag_t root;
 
-	c = calloc(1, sizeof(*c));
-	if ( NULL == c )
-		goto out;
-
-	c->nbt = nbt_decode(buf, sz);
-	if ( NULL == c->nbt )
-		goto out_free;
-
 	root = nbt_root_tag(c->nbt);
 	if ( NULL == root )
-		goto out_free_nbt;
+		return 0;
 
-	c->level = nbt_compound_get(root, "Level");
+	c->level = get_key(root, KEY_LEVEL);
 	if ( NULL == c->level )
-		goto out_free_nbt;
+		return 0;
 
-	c->seclist = nbt_compound_get(c->level, "Sections");
+	c->seclist = get_key(c->level, KEY_SECTIONS);
 	if ( c->seclist ) {
 		int i, num = nbt_list_get_size(c->seclist);
 		for(i = 0; i < num; i++) {
@@ -501,7 +1380,7 @@ chunk_t chunk_from_bytes(uint8_t *buf, size_t sz)
 			if ( NULL == s )
 				continue;
 
-			tag = nbt_compound_get(s, "Y");
+			tag = get_key(s, KEY_Y);
 			if ( !nbt_byte_get(tag, &val) ) {
 				abort();
 			}
@@ -511,6 +1390,33 @@ chunk_t chunk_from_bytes(uint8_t *buf, size_t sz)
 		}
 	}
 
+	return 1;
+}
+
+static struct _chunk *chunk_decode(uint8_t *buf, size_t sz, int own)
+{
+	struct _chunk *c = NULL;
+
+	if ( !chunk_keys() )
+		goto out;
+
+	c = calloc(1, sizeof(*c));
+	if ( NULL == c )
+		goto out;
+
+	if ( own ) {
+		c->nbt = nbt_decode_lazy(buf, sz);
+		c->src = buf;
+		c->hash = nbt_hash_bytes(buf, sz);
+	}else{
+		c->nbt = nbt_decode(buf, sz);
+	}
+	if ( NULL == c->nbt )
+		goto out_free;
+
+	if ( !find_sections(c) )
+		goto out_free_nbt;
+
 	//nbt_dump(c->nbt);
 	//printf("decoded %zu bytes of chunk data\n", sz);
 
@@ -523,12 +1429,60 @@ out_free:
 	free(c);
 	c = NULL;
 out:
+	if ( NULL == c && own )
+		free(buf);
 	return c;
 }
 
+chunk_t chunk_from_bytes(uint8_t *buf, size_t sz)
+{
+	return chunk_decode(buf, sz, 0);
+}
+
+chunk_t chunk_from_buffer(uint8_t *buf, size_t sz)
+{
+	return chunk_decode(buf, sz, 1);
+}
+
+/* Copy-on-write copy, see nbt_clone(). Stamping out a template chunk
+ * costs only what's changed in each copy.
+ */
+chunk_t chunk_clone(chunk_t c)
+{
+	struct _chunk *n;
+
+	/* do the template's relighting once, rather than in every clone */
+	if ( !settle(c) )
+		return NULL;
+
+	n = calloc(1, sizeof(*n));
+	if ( NULL == n )
+		goto out;
+
+	n->nbt = nbt_clone(c->nbt);
+	if ( NULL == n->nbt )
+		goto out_free;
+
+	if ( !find_sections(n) )
+		goto out_free_nbt;
+
+	n->ref = 1;
+	goto out;
+
+out_free_nbt:
+	nbt_free(n->nbt);
+out_free:
+	free(n);
+	n = NULL;
+out:
+	return n;
+}
+
 static void chunk_free(chunk_t c)
 {
+	free(c->vox);
 	nbt_free(c->nbt);
+	free(c->src);
 	free(c->raw.buf);
 	free(c->zlib.buf);
 	free(c);
@@ -553,8 +1507,9 @@ int chunk_paste_schematic(chunk_t c, schematic_t s, int x, int y, int z)
 	int xmax, ymax, zmax;
 	int tx, ty, tz;
 	int cx, cy, cz;
-	int smin, smax, i, ci = 0;
+	struct chunk_vox *v;
 	uint8_t *sb, *sd;
+	int ci = 0;
 
 	schematic_get_size(s, &sx, &sy, &sz);
 	tx = x + sx;
@@ -574,61 +1529,24 @@ int chunk_paste_schematic(chunk_t c, schematic_t s, int x, int y, int z)
 	assert(xmin >= 0 && ymin >= 0 && zmin >= 0);
 	assert(xmax < CHUNK_X && ymax < CHUNK_Y && zmax < CHUNK_Z);
 
-	smin = SEC_FLOOR(ymin);
-	smax = SEC_CEIL(ymax);
+	v = get_vox(c);
+	if ( NULL == v )
+		return 0;
+
+	vox_touch(c, SEC_FLOOR(ymin), SEC_CEIL(ymax));
 
 	sb = schematic_get_blocks(s);
 	sd = schematic_get_data(s);
 
-	for(i = smin; i < smax; i++, y -= CHUNK_SECTION_Y) {
-		int tmin, tmax, co;
-		nbt_tag_t sec;
-		uint8_t *cb, *cd;
-		size_t len;
-
-		tmin = i * CHUNK_SECTION_Y;
-		tmax = (i + 1) * CHUNK_SECTION_Y;
-		tmin = s_max(tmin, ymin);
-		tmax = s_min(tmax, ymax);
-		co = tmin % CHUNK_SECTION_Y;
-
-		sec = get_add_section(c, i);
-		if ( NULL == sec )
-			return 0;
-
-		if ( !nbt_bytearray_get(nbt_compound_get(sec, "Blocks"),
-					&cb, &len) )
-			return 0;
-		if ( !nbt_bytearray_get(nbt_compound_get(sec, "Data"),
-					&cd, &len) )
-			return 0;
-
-		for(cy = 0; cy < (tmax - tmin); cy++, ci++, co++) {
+	for(cy = ymin; cy < ymax; cy++, ci++) {
+		for(cz = 0; cz < sz; cz++) {
 			for(cx = 0; cx < sx; cx++) {
-				for(cz = 0; cz < sz; cz++) {
-					uint8_t in, *out;
-					unsigned int didx;
-					uint8_t din;
-
-					in = sb[(ci * sz * sx) +
-						(cz * sx) + cx];
-					out = &cb[(co * CHUNK_Z * CHUNK_X) +
-						(cz * CHUNK_X) + cx];
-					*out = in;
-
-					didx = (ci * sz * sx) +
-						(cz * sx) + cx;
-					din = sd[didx];
-					didx = (co * CHUNK_Z * CHUNK_X) +
-						(cz * CHUNK_X) + cx;
-					if ( didx % 2 ) {
-						cd[didx / 2] = (din << 4) |
-							(cd[didx/2] & 0x0f);
-					}else{
-						cd[didx / 2] = (cd[didx/2] &
-								0xf0) | din;
-					}
-				}
+				unsigned int sidx, didx;
+
+				sidx = (ci * sz * sx) + (cz * sx) + cx;
+				didx = BLOCK_IDX(cx, cy, cz);
+				v->blocks[didx] = sb[sidx];
+				v->data[didx] = sd[sidx] & 0x0f;
 			}
 		}
 	}
@@ -4,6 +4,7 @@
  * Handle level.dat files
 */
 #include <libmc/minecraft.h>
+#include <libmc/nbt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -60,3 +61,247 @@ out_close:
 out:
 	return rc;
 }
+
+#define DEFLATE_CHUNK	16384U
+
+/* nbt sink which deflates what's written in to it. The window is the
+ * input buffer, output goes to either a growable buffer or an fd. The
+ * input is hashed on the way through, see libmc_deflate_hash().
+ */
+struct deflate_sink {
+	struct nbt_sink sink;
+	struct nbt_hasher hash;
+	z_stream z;
+	int fd;
+	uint8_t *out;
+	size_t out_cap;
+	uint8_t in[DEFLATE_CHUNK];
+	uint8_t obuf[DEFLATE_CHUNK];
+};
+
+/* write(2) the lot, retrying short writes and EINTR */
+int libmc_write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t ret;
+
+	while( len ) {
+		ret = write(fd, buf, len);
+		if ( ret < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			return 0;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 1;
+}
+
+static int deflate_run(struct deflate_sink *d, int flush)
+{
+	uint8_t *new;
+	int ret, end = 0;
+
+	d->z.next_in = d->in;
+	d->z.avail_in = d->sink.ptr - d->in;
+	nbt_hasher_update(&d->hash, d->in, d->z.avail_in);
+
+	do {
+		if ( d->fd < 0 ) {
+			if ( d->z.total_out == d->out_cap ) {
+				new = realloc(d->out, d->out_cap * 2);
+				if ( NULL == new )
+					return 0;
+				d->out = new;
+				d->out_cap *= 2;
+			}
+			d->z.next_out = d->out + d->z.total_out;
+			d->z.avail_out = d->out_cap - d->z.total_out;
+		}else{
+			d->z.next_out = d->obuf;
+			d->z.avail_out = sizeof(d->obuf);
+		}
+
+		ret = deflate(&d->z, flush);
+		if ( ret == Z_STREAM_ERROR )
+			return 0;
+		if ( ret == Z_STREAM_END )
+			end = 1;
+
+		if ( d->fd >= 0 && !libmc_write_all(d->fd, d->obuf,
+					sizeof(d->obuf) - d->z.avail_out) )
+			return 0;
+
+		/* last call filled the output exactly, nothing more to do */
+		if ( ret == Z_BUF_ERROR )
+			break;
+	}while( d->z.avail_out == 0 );
+
+	if ( flush == Z_FINISH && !end )
+		return 0;
+
+	d->sink.ptr = d->in;
+	return 1;
+}
+
+static int deflate_flush(struct nbt_sink *s)
+{
+	return deflate_run((struct deflate_sink *)s, Z_NO_FLUSH);
+}
+
+/* format is LIBMC_DEFLATE_ZLIB or LIBMC_DEFLATE_GZIP, if fd is -1 then
+ * output is collected in memory and returned by libmc_deflate_finish()
+ */
+struct nbt_sink *libmc_deflate_sink(int format, int fd)
+{
+	struct deflate_sink *d;
+	int wbits;
+
+	d = calloc(1, sizeof(*d));
+	if ( NULL == d )
+		goto out;
+
+	wbits = (format == LIBMC_DEFLATE_GZIP) ? 15 + 16 : 15;
+	if ( deflateInit2(&d->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				wbits, 8, Z_DEFAULT_STRATEGY) != Z_OK )
+		goto out_free;
+
+	nbt_hasher_init(&d->hash);
+	d->fd = fd;
+	if ( fd < 0 ) {
+		d->out_cap = DEFLATE_CHUNK;
+		d->out = malloc(d->out_cap);
+		if ( NULL == d->out )
+			goto out_end;
+	}
+
+	d->sink.ptr = d->in;
+	d->sink.end = d->in + sizeof(d->in);
+	d->sink.flush = deflate_flush;
+	return &d->sink;
+
+out_end:
+	deflateEnd(&d->z);
+out_free:
+	free(d);
+out:
+	return NULL;
+}
+
+static void deflate_free(struct deflate_sink *d)
+{
+	deflateEnd(&d->z);
+	free(d->out);
+	free(d);
+}
+
+/* nbt_hash_bytes() of everything written to the sink so far, so that
+ * what was compressed can be hashed without a copy of it.
+ */
+uint64_t libmc_deflate_hash(const struct nbt_sink *s)
+{
+	const struct deflate_sink *d = (const struct deflate_sink *)s;
+	struct nbt_hasher h = d->hash;
+
+	nbt_hasher_update(&h, d->in, s->ptr - d->in);
+	return nbt_hasher_final(&h);
+}
+
+/* Finish the stream and free the sink. For in-memory sinks the output is
+ * returned in buf and belongs to the caller, otherwise buf and len are
+ * ignored.
+ */
+int libmc_deflate_finish(struct nbt_sink *s, uint8_t **buf, size_t *len)
+{
+	struct deflate_sink *d = (struct deflate_sink *)s;
+	int rc;
+
+	rc = deflate_run(d, Z_FINISH);
+	if ( rc && d->fd < 0 ) {
+		*buf = d->out;
+		*len = d->z.total_out;
+		d->out = NULL;
+	}
+
+	deflate_free(d);
+	return rc;
+}
+
+/* Free the sink without finishing the stream, eg. if encoding failed */
+void libmc_deflate_abort(struct nbt_sink *s)
+{
+	deflate_free((struct deflate_sink *)s);
+}
+
+#define INFLATE_CHUNK	32768U
+
+/* Inflate buf and feed it to the streaming parser a window at a time, so
+ * the document is never decompressed in full. format is one of the
+ * LIBMC_DEFLATE_* constants.
+ */
+int libmc_inflate_parse(int format, const uint8_t *buf, size_t len,
+			const struct nbt_visitor *v, void *priv)
+{
+	uint8_t win[INFLATE_CHUNK];
+	nbt_parser_t p;
+	int wbits, ret;
+	z_stream z;
+
+	p = nbt_parser_new(v, priv);
+	if ( NULL == p )
+		return 0;
+
+	memset(&z, 0, sizeof(z));
+	wbits = (format == LIBMC_DEFLATE_GZIP) ? 15 + 16 : 15;
+	if ( inflateInit2(&z, wbits) != Z_OK ) {
+		nbt_parser_finish(p);
+		return 0;
+	}
+
+	z.next_in = (uint8_t *)buf;
+	z.avail_in = len;
+
+	do {
+		z.next_out = win;
+		z.avail_out = sizeof(win);
+		ret = inflate(&z, Z_NO_FLUSH);
+		if ( ret != Z_OK && ret != Z_STREAM_END )
+			break;
+		if ( !nbt_parser_feed(p, win, sizeof(win) - z.avail_out) )
+			break;
+	}while( ret != Z_STREAM_END );
+
+	inflateEnd(&z);
+	return nbt_parser_finish(p) && ret == Z_STREAM_END;
+}
+
+/* As libmc_gunzip() but the file is parsed as it's read */
+int libmc_gunzip_parse(const char *path, const struct nbt_visitor *v,
+			void *priv)
+{
+	uint8_t win[INFLATE_CHUNK];
+	nbt_parser_t p;
+	int ret, rc;
+	gzFile gz;
+
+	gz = gzopen(path, "r");
+	if ( NULL == gz ) {
+		fprintf(stderr, "level: %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	p = nbt_parser_new(v, priv);
+	if ( NULL == p ) {
+		gzclose(gz);
+		return 0;
+	}
+
+	do {
+		ret = gzread(gz, win, sizeof(win));
+		rc = (ret >= 0) && nbt_parser_feed(p, win, ret);
+	}while( rc && ret > 0 );
+
+	gzclose(gz);
+	return nbt_parser_finish(p) && rc;
+}
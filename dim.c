@@ -235,16 +235,143 @@ void dim_close(dim_t d)
 #define XCEIL(x) ((x + (RX-1)) / RX)
 #define ZCEIL(z) ((z + (RZ-1)) / RZ)
 
+/* round towards negative infinity, unlike '/' */
+static int div_floor(int v, int n)
+{
+	return (v < 0) ? -((n - 1 - v) / n) : v / n;
+}
+
+/* chunk at absolute chunk coordinates cx,cz, or NULL */
+static chunk_t dim_chunk(dim_t d, int cx, int cz)
+{
+	region_t r;
+	chunk_t c;
+	int rx, rz;
+
+	rx = div_floor(cx, REGION_X);
+	rz = div_floor(cz, REGION_Z);
+	r = dim_get_region(d, rx, rz);
+	if ( NULL == r )
+		return NULL;
+
+	c = region_get_chunk(r, cx - rx * REGION_X, cz - rz * REGION_Z);
+	region_put(r);
+	return c;
+}
+
+/* put c back in its region at absolute chunk coordinates cx,cz */
+static int dim_set_chunk(dim_t d, int cx, int cz, chunk_t c)
+{
+	region_t r;
+	int rx, rz, ret;
+
+	rx = div_floor(cx, REGION_X);
+	rz = div_floor(cz, REGION_Z);
+	r = dim_get_region(d, rx, rz);
+	if ( NULL == r )
+		return 0;
+
+	ret = region_set_chunk(r, cx - rx * REGION_X, cz - rz * REGION_Z, c);
+	region_put(r);
+	return ret;
+}
+
+/* Gather the chunks from cx0,cz0 to cx1,cz1 inclusive, across however
+ * many regions, into a window and relight it. Chunks whose light changed
+ * are put back in their region so that the light gets saved, the rest
+ * are left alone so their regions aren't rewritten for nothing.
+ */
+static int light_chunks(dim_t d, int cx0, int cz0, int cx1, int cz1)
+{
+	unsigned int w, h, i, j;
+	uint8_t *changed = NULL;
+	chunk_t *win;
+	int ret = 0;
+
+	if ( cx1 < cx0 || cz1 < cz0 )
+		return 0;
+
+	w = cx1 - cx0 + 1;
+	h = cz1 - cz0 + 1;
+	if ( w == 0 || h == 0 || w > UINT32_MAX / h )
+		return 0;
+
+	win = calloc(w * h, sizeof(*win));
+	if ( NULL == win )
+		return 0;
+
+	changed = calloc(w * h, sizeof(*changed));
+	if ( NULL == changed )
+		goto out;
+
+	for(j = 0; j < h; j++) {
+		for(i = 0; i < w; i++)
+			win[j * w + i] = dim_chunk(d, cx0 + i, cz0 + j);
+	}
+
+	if ( !chunk_light_window(win, w, h, changed) )
+		goto out;
+
+	for(j = 0; j < h; j++) {
+		for(i = 0; i < w; i++) {
+			if ( !changed[j * w + i] )
+				continue;
+			if ( !dim_set_chunk(d, cx0 + i, cz0 + j,
+						win[j * w + i]) )
+				goto out;
+		}
+	}
+
+	ret = 1;
+out:
+	for(i = 0; i < w * h; i++) {
+		if ( win[i] )
+			chunk_put(win[i]);
+	}
+	free(changed);
+	free(win);
+	return ret;
+}
+
+static int save_regions(dim_t d, int rx0, int rz0, int rx1, int rz1)
+{
+	int rx, rz;
+
+	for(rx = rx0; rx <= rx1; rx++) {
+		for(rz = rz0; rz <= rz1; rz++) {
+			region_t r;
+			int ret;
+
+			r = dim_get_region(d, rx, rz);
+			if ( NULL == r )
+				continue;
+			ret = region_save(r);
+			region_put(r);
+			if ( !ret )
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
 int dim_paste_schematic(dim_t d, schematic_t s, int x, int y, int z)
 {
 	int16_t sx, sz;
 	int tx, tz, xmin, zmin, xmax, zmax;
+	int cx0, cz0, cx1, cz1;
 
 	schematic_get_size(s, &sx, NULL, &sz);
 
 	tx = x + sx;
 	tz = z + sz;
 
+	/* chunks to relight, with a border for light spilling out */
+	cx0 = div_floor(s_min(x, tx), CHUNK_X) - 1;
+	cz0 = div_floor(s_min(z, tz), CHUNK_Z) - 1;
+	cx1 = div_floor(s_max(x, tx) - 1, CHUNK_X) + 1;
+	cz1 = div_floor(s_max(z, tz) - 1, CHUNK_Z) + 1;
+
 	xmin = XFLOOR(s_min(x, tx));
 	zmin = ZFLOOR(s_min(z, tz));
 	xmax = XCEIL(s_max(x, tx));
@@ -268,13 +395,17 @@ int dim_paste_schematic(dim_t d, schematic_t s, int x, int y, int z)
 				return 0;
 			/* TODO: get sub-schematic */
 			ret = region_paste_schematic(r, s, x, y, z);
-			if ( ret )
-				ret = region_save(r);
 			region_put(r);
 			if ( !ret )
 				return 0;
 		}
 	}
 
-	return 1;
+	if ( !light_chunks(d, cx0, cz0, cx1, cz1) )
+		return 0;
+
+	return save_regions(d, div_floor(cx0, REGION_X),
+				div_floor(cz0, REGION_Z),
+				div_floor(cx1, REGION_X),
+				div_floor(cz1, REGION_Z));
 }
@@ -11,6 +11,8 @@
 
 #include "hgang.h"
 
+#define HGANG_TBL_INLINE	8
+
 #if MPOOL_POISON
 #define POISON(ptr, len) memset(ptr, MPOOL_POISON_PATTERN, len)
 #else
@@ -29,8 +31,24 @@ struct _hgang {
 	size_t slab_size;
 	/** List of blocks. */
 	struct _hgang_hdr *slabs;
+	/** Blocks kept by hgang_reset() for reuse */
+	struct _hgang_hdr *spare;
 	/** List of free'd objects. */
 	void *free;
+	/** User data, see hgang_priv() */
+	void *priv;
+	/** Slabs by number, for hgang_at() */
+	struct _hgang_hdr **tbl;
+	/** Initial tbl, so that small hgangs don't need another malloc */
+	struct _hgang_hdr *tbl_inl[HGANG_TBL_INLINE];
+	/** Number of slabs in tbl */
+	unsigned int nslabs;
+	/** Slots in tbl */
+	unsigned int tbl_cap;
+	/** log2 of the index space given to each slab */
+	unsigned int idx_shift;
+	/** log2 of obj_size if it's a power of two, else 0 */
+	unsigned int obj_shift;
 };
 
 
@@ -45,8 +63,12 @@ size_t hgang_object_size(hgang_t h)
 struct _hgang_hdr {
 	/** Pointer to next item in the list */
 	struct _hgang_hdr *next;
-	/** Data up to the slab_size */
-	uint8_t data[0];
+	/** The hgang which this slab belongs to */
+	struct _hgang *owner;
+	/** Slab number, see hgang_index() */
+	unsigned int num;
+	/** Data up to the slab_size, cache line aligned */
+	uint8_t data[0] __attribute__((aligned(64)));
 };
 
 static uint8_t *first_byte(struct _hgang_hdr *hdr)
@@ -68,23 +90,24 @@ static int obj_in_slab(struct _hgang *h, struct _hgang_hdr *hdr, void *obj)
 /** Initialise an hgang.
  * \ingroup g_hgang
  *
- * @param h an hgang structure to use
  * @param obj_size size of objects to allocate
- * @param slab_size size of slabs in number of objects (set to zero for auto)
  *
  * Creates a new empty memory pool descriptor with the passed values
- * set. The resultant hgang has no alignment requirement set.
+ * set. Slabs are HGANG_SLAB_SIZE bytes and aligned to their size, this
+ * is what allows hgang_of() to work.
  *
- * @return zero on error, non-zero for success
- * (may only return 0 if the obj_size is 0).
+ * @return NULL on error, new hgang otherwise
+ * (may only fail if the obj_size is 0 or won't fit in a slab).
  */
-hgang_t hgang_new(size_t obj_size, unsigned slab_size)
+hgang_t hgang_new(size_t obj_size)
 {
 	struct _hgang *h;
 
 	/* quick sanity checks */
 	if ( obj_size == 0 )
 		return NULL;
+	if ( obj_size > HGANG_SLAB_SIZE - sizeof(struct _hgang_hdr) )
+		return NULL;
 
 	h = malloc(sizeof(*h));
 	if ( NULL == h )
@@ -94,27 +117,97 @@ hgang_t hgang_new(size_t obj_size, unsigned slab_size)
 		obj_size = sizeof(void *);
 
 	h->obj_size = obj_size;
-
-	if ( slab_size ) {
-		h->slab_size = sizeof(struct _hgang_hdr) + 
-				(slab_size * obj_size);
-	}else{
-		/* XXX: totally arbitrary... */
-		if ( h->obj_size < 8192 ) {
-			h->slab_size = sizeof(struct _hgang_hdr) +
-				(8192 - (8192 % h->obj_size));
-		}else{
-			h->slab_size = sizeof(struct _hgang_hdr) +
-				(4 * h->obj_size);
-		}
-	}
-
+	h->slab_size = HGANG_SLAB_SIZE;
 	h->slabs = NULL;
+	h->spare = NULL;
 	h->free = NULL;
+	h->priv = NULL;
+	h->tbl = h->tbl_inl;
+	h->nslabs = 0;
+	h->tbl_cap = HGANG_TBL_INLINE;
+
+	/* saves a divide in hgang_index() */
+	for(h->obj_shift = 0; (1U << h->obj_shift) < obj_size; h->obj_shift++)
+		/* nothing */;
+	if ( (1U << h->obj_shift) != obj_size )
+		h->obj_shift = 0;
+
+	/* enough index bits for every object in a slab */
+	for(h->idx_shift = 0;
+		(1U << h->idx_shift) < (h->slab_size -
+				sizeof(struct _hgang_hdr)) / obj_size;
+		h->idx_shift++)
+		/* nothing */;
 
 	return h;
 }
 
+/** Find the hgang that an object was allocated from.
+ * \ingroup g_hgang
+ * @param obj an object returned from hgang_alloc()
+ *
+ * @return the owning hgang
+ */
+hgang_t hgang_of(const void *obj)
+{
+	struct _hgang_hdr *hdr;
+
+	hdr = (struct _hgang_hdr *)((uintptr_t)obj &
+				~(uintptr_t)(HGANG_SLAB_SIZE - 1));
+	return hdr->owner;
+}
+
+/** Get a compact index for an object.
+ * \ingroup g_hgang
+ * @param h the hgang obj was allocated from
+ * @param obj an object returned from hgang_alloc()
+ *
+ * Indices are never zero so callers may use 0 to mean no object.
+ *
+ * @return an index which hgang_at() maps back to obj
+ */
+uint32_t hgang_index(hgang_t h, const void *obj)
+{
+	struct _hgang_hdr *hdr;
+	uint32_t slot;
+
+	hdr = (struct _hgang_hdr *)((uintptr_t)obj &
+				~(uintptr_t)(HGANG_SLAB_SIZE - 1));
+	slot = (const uint8_t *)obj - first_byte(hdr);
+	slot = (h->obj_shift) ? slot >> h->obj_shift : slot / h->obj_size;
+	return ((hdr->num << h->idx_shift) | slot) + 1;
+}
+
+/** Find an object by index.
+ * \ingroup g_hgang
+ * @param h the hgang the index came from
+ * @param idx a non-zero index returned from hgang_index()
+ *
+ * @return the object
+ */
+void *hgang_at(hgang_t h, uint32_t idx)
+{
+	idx--;
+	return first_byte(h->tbl[idx >> h->idx_shift]) +
+		(idx & ((1U << h->idx_shift) - 1)) * h->obj_size;
+}
+
+/** Attach user data to an hgang.
+ * \ingroup g_hgang
+ */
+void hgang_set_priv(hgang_t h, void *priv)
+{
+	h->priv = priv;
+}
+
+/** Retrieve user data set with hgang_set_priv().
+ * \ingroup g_hgang
+ */
+void *hgang_priv(hgang_t h)
+{
+	return h->priv;
+}
+
 /** Slow path for hgang allocations.
  * \ingroup g_hgang
  * @param h a valid hgang structure returned from hgang_init()
@@ -129,13 +222,44 @@ static void *hgang_alloc_slow(struct _hgang *h)
 {
 	struct _hgang_hdr *hdr;
 	void *ptr, *ret;
-	
-	hdr = ptr = malloc(h->slab_size);
-	if ( hdr == NULL )
+
+	/* a slab from before hgang_reset() keeps its number */
+	if ( h->spare ) {
+		hdr = h->spare;
+		h->spare = hdr->next;
+		ptr = hdr;
+		POISON(first_byte(hdr), h->slab_size - sizeof(*hdr));
+		goto link;
+	}
+
+	/* slab numbers must leave room in a 32bit index */
+	if ( h->nslabs >= (UINT32_MAX >> h->idx_shift) )
+		return NULL;
+
+	if ( h->nslabs == h->tbl_cap ) {
+		unsigned int cap = h->tbl_cap * 2;
+		struct _hgang_hdr **tbl;
+
+		tbl = malloc(cap * sizeof(*tbl));
+		if ( NULL == tbl )
+			return NULL;
+		memcpy(tbl, h->tbl, h->nslabs * sizeof(*tbl));
+		if ( h->tbl != h->tbl_inl )
+			free(h->tbl);
+		h->tbl = tbl;
+		h->tbl_cap = cap;
+	}
+
+	if ( posix_memalign(&ptr, h->slab_size, h->slab_size) )
 		return NULL;
 
 	POISON(ptr, h->slab_size);
+	hdr = ptr;
+	hdr->owner = h;
+	hdr->num = h->nslabs++;
+	h->tbl[hdr->num] = hdr;
 
+link:
 	/* Set first object */
 	ret = ptr + sizeof(*hdr);
 	h->next_obj = ret + h->obj_size;
@@ -197,11 +321,41 @@ void hgang_free(hgang_t h)
 		hdr = hdr->next;
 		POISON(f, h->slab_size);
 	}
+	for(hdr = h->spare; (f = hdr); free(f)) {
+		hdr = hdr->next;
+		POISON(f, h->slab_size);
+	}
 
+	if ( h->tbl != h->tbl_inl )
+		free(h->tbl);
 	POISON(h, sizeof(*h));
 	free(h);
 }
 
+/** Empty an hgang but keep its memory.
+ * \ingroup g_hgang
+ * @param h a valid hgang structure returned from hgang_new()
+ *
+ * All objects are forgotten at once and the slabs are kept to be handed
+ * out again, in place of fresh ones from malloc. Indices of later objects
+ * may collide with ones handed out before the reset.
+ */
+void hgang_reset(hgang_t h)
+{
+	struct _hgang_hdr *hdr;
+
+	if ( h->slabs ) {
+		for(hdr = h->slabs; hdr->next; hdr = hdr->next)
+			/* nothing */;
+		hdr->next = h->spare;
+		h->spare = h->slabs;
+	}
+
+	h->slabs = NULL;
+	h->next_obj = NULL;
+	h->free = NULL;
+}
+
 /** Free an individual object.
  * \ingroup g_hgang
  * @param h hgang object that obj was allocated from.
@@ -0,0 +1,16 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ */
+#ifndef _ATOM_HEADER_INCLUDED_
+#define _ATOM_HEADER_INCLUDED_
+
+nbt_atom_t atom_intern(const char *str, size_t len);
+nbt_atom_t atom_intern_budget(const char *str, size_t len,
+				unsigned int *budget);
+nbt_atom_t atom_find(const char *str, size_t len);
+const char *atom_str(nbt_atom_t a);
+size_t atom_len(nbt_atom_t a);
+
+#endif /* _ATOM_HEADER_INCLUDED_ */
@@ -0,0 +1,15 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ */
+#ifndef _BSWAP_HEADER_INCLUDED_
+#define _BSWAP_HEADER_INCLUDED_
+
+/* Byte swap n elements from src to dst. Neither needs to be aligned and
+ * they may be the same buffer, but must not otherwise overlap.
+ */
+void bswap32_array(void *dst, const void *src, size_t n);
+void bswap64_array(void *dst, const void *src, size_t n);
+
+#endif /* _BSWAP_HEADER_INCLUDED_ */
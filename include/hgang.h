@@ -11,10 +11,19 @@ typedef struct _hgang *hgang_t;
 #define HGANG_POISON 		1
 #define HGANG_POISON_PATTERN 	0xa5
 
+#define HGANG_SLAB_SHIFT	14
+#define HGANG_SLAB_SIZE		(1U << HGANG_SLAB_SHIFT)
+
 typedef int(*hgang_cb_t)(void *priv, void *obj);
 
-hgang_t hgang_new(size_t obj_size, unsigned slab_size);
+hgang_t hgang_new(size_t obj_size);
 void hgang_free(hgang_t h);
+void hgang_reset(hgang_t h);
+hgang_t hgang_of(const void *obj);
+uint32_t hgang_index(hgang_t h, const void *obj);
+void *hgang_at(hgang_t h, uint32_t idx);
+void hgang_set_priv(hgang_t h, void *priv);
+void *hgang_priv(hgang_t h);
 void * hgang_alloc(hgang_t h);
 void *hgang_alloc0(hgang_t h);
 void hgang_return(hgang_t h, void *obj);
@@ -10,8 +10,18 @@
 
 typedef struct _chunk *chunk_t;
 
+/* a block at local coordinates, for the batched get/set */
+struct chunk_block {
+	uint8_t x, y, z;
+	uint8_t id;
+	uint8_t data;
+};
+
 chunk_t chunk_from_bytes(uint8_t *buf, size_t sz);
+/* takes ownership of malloc'd buf, which is always free'd */
+chunk_t chunk_from_buffer(uint8_t *buf, size_t sz);
 chunk_t chunk_new(void);
+chunk_t chunk_clone(chunk_t c);
 
 int chunk_set_pos(chunk_t c, int32_t x, int32_t  z);
 int chunk_set_terrain_populated(chunk_t c, uint8_t p);
@@ -20,6 +30,27 @@ chunk_t chunk_get(chunk_t c);
 void chunk_put(chunk_t c);
 
 const uint8_t *chunk_encode(chunk_t c, int enc, size_t *sz);
+uint64_t chunk_hash(chunk_t c);
+int chunk_same(chunk_t c, const uint8_t *buf, size_t len);
+
+/* single blocks, x and z must be less than 16 */
+int chunk_get_block(chunk_t c, uint8_t x, uint8_t y, uint8_t z,
+			uint8_t *id, uint8_t *data);
+int chunk_set_block(chunk_t c, uint8_t x, uint8_t y, uint8_t z,
+			uint8_t id, uint8_t data);
+
+/* batches are fastest sorted by section, ie. by y / 16 */
+int chunk_get_blocks(chunk_t c, struct chunk_block *b, unsigned int n);
+int chunk_set_blocks(chunk_t c, const struct chunk_block *b, unsigned int n);
+
+/* Relight block light around edited blocks in a w by h window of
+ * neighbouring chunks, win[z * w + x], NULL where there's no chunk.
+ * Light only reaches 15 blocks, so a border of one chunk around the
+ * edits is enough. If changed isn't NULL, changed[z * w + x] is set to
+ * whether that chunk's light was altered.
+ */
+int chunk_light_window(chunk_t *win, unsigned int w, unsigned int h,
+			uint8_t *changed);
 
 /* higher-level operations */
 int chunk_strip_entities(chunk_t c);
@@ -24,5 +24,21 @@ static inline int s_max(int a, int b)
 }
 
 int libmc_gunzip(const char *path, uint8_t **begin, size_t *osz);
+int libmc_write_all(int fd, const uint8_t *buf, size_t len);
+
+struct nbt_sink;
+struct nbt_visitor;
+
+#define LIBMC_DEFLATE_ZLIB	0
+#define LIBMC_DEFLATE_GZIP	1
+struct nbt_sink *libmc_deflate_sink(int format, int fd);
+int libmc_deflate_finish(struct nbt_sink *s, uint8_t **buf, size_t *len);
+uint64_t libmc_deflate_hash(const struct nbt_sink *s);
+void libmc_deflate_abort(struct nbt_sink *s);
+
+int libmc_inflate_parse(int format, const uint8_t *buf, size_t len,
+			const struct nbt_visitor *v, void *priv);
+int libmc_gunzip_parse(const char *path, const struct nbt_visitor *v,
+			void *priv);
 
 #endif /* _MINECRAFT_H */
@@ -13,15 +13,106 @@
 #define NBT_TAG_List		9U
 #define NBT_TAG_Compound	10U
 #define NBT_TAG_Int_Array	11U
-#define NBT_TAG_MAX		12U
+#define NBT_TAG_Long_Array	12U
+#define NBT_TAG_MAX		13U
 
 typedef struct _nbt *nbt_t;
 typedef struct nbt_tag *nbt_tag_t;
 
+/* Tag names are interned in a process-wide table, an atom stands for a
+ * name and two tags have the same name iff they have the same atom.
+ * Resolve keys once up front with nbt_atom() to avoid hashing the string
+ * on every lookup. Atoms are never free'd.
+ *
+ * So that hostile or corrupt input can't fill the table, a decode only
+ * interns the first NBT_NEW_NAMES names that haven't been seen before,
+ * and decoding as a whole can only use three quarters of the table's four
+ * million or so atoms. Names past that are kept in the document itself,
+ * they work the same but cost a string compare on lookup and are interned
+ * if nbt_tag_atom() is asked for them. Names from nbt_atom() always work.
+ */
+typedef uint32_t nbt_atom_t;
+#define NBT_ATOM_NONE		0U
+#define NBT_NEW_NAMES		4096U
+
+nbt_atom_t nbt_atom(const char *name);
+const char *nbt_atom_str(nbt_atom_t a);
+
+/* Deepest nesting of lists and compounds which will be decoded, encoded
+ * or walked. Deeper documents fail to decode, 0 restores the default.
+ */
+#define NBT_DEFAULT_MAX_DEPTH	512U
+void nbt_set_max_depth(unsigned int depth);
+
 nbt_t nbt_decode(const uint8_t *buf, size_t len);
+nbt_t nbt_decode_borrowed(const uint8_t *buf, size_t len);
+nbt_t nbt_decode_lazy(const uint8_t *buf, size_t len);
 nbt_t nbt_new(void);
+nbt_t nbt_clone(nbt_t nbt);
+
+/* reuse the memory of an existing document, see there */
+int nbt_decode_into(nbt_t nbt, const uint8_t *buf, size_t len);
+int nbt_decode_lazy_into(nbt_t nbt, const uint8_t *buf, size_t len);
+
 size_t nbt_size_in_bytes(nbt_t nbt);
 int nbt_get_bytes(nbt_t nbt, uint8_t *buf, size_t len);
+
+/* Little-endian NBT, as written by bedrock edition. Documents decoded
+ * from either byte order can be encoded in either, the size is the same.
+ */
+nbt_t nbt_decode_le(const uint8_t *buf, size_t len);
+int nbt_get_bytes_le(nbt_t nbt, uint8_t *buf, size_t len);
+
+/* nbt_hash() and nbt_equal() go by value, not by how the tree happens to
+ * be stored and not by the order of compound members. nbt_hash_bytes()
+ * is for encoded documents, for example to spot unchanged chunks without
+ * decoding them. Hashes are never 0.
+ */
+uint64_t nbt_hash(nbt_t nbt);
+int nbt_equal(nbt_t a, nbt_t b);
+uint64_t nbt_hash_bytes(const uint8_t *buf, size_t len);
+
+/* nbt_hash_bytes() of data which arrives a piece at a time */
+struct nbt_hasher {
+	uint64_t h[4];
+	uint64_t len;
+	uint8_t buf[32];
+};
+void nbt_hasher_init(struct nbt_hasher *h);
+void nbt_hasher_update(struct nbt_hasher *h, const uint8_t *buf, size_t len);
+uint64_t nbt_hasher_final(const struct nbt_hasher *h);
+
+/* Output for nbt_encode(). The encoder writes at ptr and calls flush()
+ * when it runs out of room before end. flush() must consume or keep what
+ * was written and leave at least NBT_SINK_MIN bytes of room, or return 0
+ * to fail the encode.
+ */
+#define NBT_SINK_MIN		16U
+struct nbt_sink {
+	uint8_t *ptr;
+	uint8_t *end;
+	int (*flush)(struct nbt_sink *s);
+};
+int nbt_encode(nbt_t nbt, struct nbt_sink *s);
+int nbt_encode_le(nbt_t nbt, struct nbt_sink *s);
+
+/* Growable buffer, base is malloc'd and belongs to the caller */
+#define NBT_BUF_INITIAL		16384U
+struct nbt_buf {
+	struct nbt_sink sink;
+	uint8_t *base;
+};
+void nbt_buf_init(struct nbt_buf *b);
+size_t nbt_buf_len(const struct nbt_buf *b);
+
+/* Buffered writes to a file descriptor */
+struct nbt_fd_sink {
+	struct nbt_sink sink;
+	int fd;
+	uint8_t buf[16384];
+};
+void nbt_fd_sink_init(struct nbt_fd_sink *f, int fd);
+int nbt_fd_sink_finish(struct nbt_fd_sink *f);
 void nbt_free(nbt_t nbt);
 
 nbt_tag_t nbt_root_tag(nbt_t nbt);
@@ -30,7 +121,8 @@ nbt_tag_t nbt_tag_new(nbt_t nbt, uint8_t type);
 nbt_tag_t nbt_tag_new_list(nbt_t nbt, uint8_t type);
 
 uint8_t nbt_tag_type(nbt_tag_t t);
-char *nbt_tag_name(nbt_tag_t t);
+const char *nbt_tag_name(nbt_tag_t t);
+nbt_atom_t nbt_tag_atom(nbt_tag_t t);
 
 /* Get values from tags */
 int nbt_byte_get(nbt_tag_t t, uint8_t *val);
@@ -39,10 +131,21 @@ int nbt_int_get(nbt_tag_t t, int32_t *val);
 int nbt_long_get(nbt_tag_t t, int64_t *val);
 int nbt_bytearray_get(nbt_tag_t t, uint8_t **bytes, size_t *sz);
 int nbt_intarray_get(nbt_tag_t t, int32_t **bytes, unsigned int *num);
+int nbt_longarray_get(nbt_tag_t t, int64_t **longs, unsigned int *num);
 int nbt_string_get(nbt_tag_t t, char **val);
 nbt_tag_t nbt_list_get(nbt_tag_t t, unsigned idx);
 int nbt_list_get_size(nbt_tag_t t);
 nbt_tag_t nbt_compound_get(nbt_tag_t t, const char *key);
+nbt_tag_t nbt_compound_get_atom(nbt_tag_t t, nbt_atom_t key);
+
+/* Read-only access, never copies data borrowed from the decode buffer
+ * except int and long arrays which are always handed out in native byte
+ * order. Strings are not NUL terminated.
+ */
+int nbt_bytearray_peek(nbt_tag_t t, const uint8_t **bytes, size_t *sz);
+int nbt_intarray_peek(nbt_tag_t t, const int32_t **ints, unsigned int *num);
+int nbt_longarray_peek(nbt_tag_t t, const int64_t **longs, unsigned int *num);
+int nbt_string_peek(nbt_tag_t t, const char **val, size_t *len);
 
 /* Set values in to tags */
 int nbt_byte_set(nbt_tag_t t, uint8_t val);
@@ -51,17 +154,124 @@ int nbt_int_set(nbt_tag_t t, int32_t val);
 int nbt_long_set(nbt_tag_t t, int64_t val);
 int nbt_bytearray_set(nbt_tag_t t, const uint8_t *bytes, unsigned int num);
 int nbt_intarray_set(nbt_tag_t t, const int32_t *arr, unsigned int num);
+int nbt_longarray_set(nbt_tag_t t, const int64_t *arr, unsigned int num);
 int nbt_string_set(nbt_tag_t t, const char *val);
+/* Tags which are overwritten, deleted or fall off the end of a list are
+ * free'd along with everything under them.
+ */
 int nbt_list_set(nbt_tag_t t, unsigned idx, nbt_tag_t val);
+/* New slots are empty until nbt_list_set(), and a document with empty
+ * slots fails to encode. nbt_size_in_bytes() doesn't count them.
+ */
 int nbt_list_set_size(nbt_tag_t t, unsigned sz);
 int nbt_list_append(nbt_tag_t t, nbt_tag_t val);
 int nbt_compound_delete(nbt_tag_t t, const char *key);
 int nbt_compound_set(nbt_tag_t t, const char *key, nbt_tag_t val);
+int nbt_compound_set_atom(nbt_tag_t t, nbt_atom_t key, nbt_tag_t val);
+
+/* Lists of primitives are kept as one native array rather than a tag per
+ * element. These get at it directly, packing the list first if need be,
+ * which frees any element tags from nbt_list_get(). Likewise the per
+ * element calls unpack the list again, invalidating the array.
+ */
+int nbt_list_get_bytes(nbt_tag_t t, uint8_t **vals, unsigned int *num);
+int nbt_list_get_shorts(nbt_tag_t t, int16_t **vals, unsigned int *num);
+int nbt_list_get_ints(nbt_tag_t t, int32_t **vals, unsigned int *num);
+int nbt_list_get_longs(nbt_tag_t t, int64_t **vals, unsigned int *num);
+int nbt_list_get_floats(nbt_tag_t t, float **vals, unsigned int *num);
+int nbt_list_get_doubles(nbt_tag_t t, double **vals, unsigned int *num);
+int nbt_list_set_bytes(nbt_tag_t t, const uint8_t *vals, unsigned int num);
+int nbt_list_set_shorts(nbt_tag_t t, const int16_t *vals, unsigned int num);
+int nbt_list_set_ints(nbt_tag_t t, const int32_t *vals, unsigned int num);
+int nbt_list_set_longs(nbt_tag_t t, const int64_t *vals, unsigned int num);
+int nbt_list_set_floats(nbt_tag_t t, const float *vals, unsigned int num);
+int nbt_list_set_doubles(nbt_tag_t t, const double *vals, unsigned int num);
 
 /* delete all items in lists/compounds */
 int nbt_list_nuke(nbt_tag_t t);
 int nbt_compound_nuke(nbt_tag_t t);
 
+/* A frozen document is a read-only copy of a whole tree in one malloc'd
+ * buffer which is free'd with free(). It holds no pointers, so it can be
+ * written out and mapped back in on the same architecture, and it's never
+ * modified so threads can share it without locking. Compound members are
+ * kept sorted and looked up by binary search. The getters above all work
+ * on frozen tags but the setters fail, elements of lists of numbers are
+ * only available through nbt_list_get_ints() and friends. Arrays handed
+ * out point in to the buffer and mustn't be written to. buf must be 8
+ * byte aligned. nbt_frozen_root() walks the whole document first and
+ * refuses it if any name, payload or child lies outside of buf, so it's
+ * safe on files that can't be trusted. Compound members that aren't in
+ * order just won't be found.
+ */
+void *nbt_freeze(nbt_t nbt, size_t *len);
+nbt_tag_t nbt_frozen_root(const void *buf, size_t len);
+
 void nbt_dump(nbt_t nbt);
+const char *nbt_type_name(uint8_t type);
+
+/* Streaming parser, nbt_parse() fires callbacks as tags go by without
+ * building a tree. Any callback may be NULL. Names are NULL for list
+ * elements and, like strings, not NUL terminated. Array data points in
+ * to the callers buffer as raw big-endian elements, len is the number of
+ * elements (bytes for strings). Returning NBT_VISIT_SKIP from a begin
+ * callback skips the contents and the matching end callback.
+ */
+#define NBT_VISIT_ABORT		0
+#define NBT_VISIT_OK		1
+#define NBT_VISIT_SKIP		2
+
+union nbt_value {
+	uint8_t b;
+	int16_t s;
+	int32_t i;
+	int64_t l;
+	float f;
+	double d;
+};
+
+struct nbt_visitor {
+	int (*begin_compound)(void *priv, const char *name, size_t nlen);
+	int (*end_compound)(void *priv);
+	int (*begin_list)(void *priv, const char *name, size_t nlen,
+				uint8_t type, int32_t len);
+	int (*end_list)(void *priv);
+	int (*scalar)(void *priv, const char *name, size_t nlen,
+				uint8_t type, const union nbt_value *val);
+	int (*array)(void *priv, const char *name, size_t nlen,
+				uint8_t type, const void *data, int32_t len);
+};
+
+int nbt_parse(const uint8_t *buf, size_t len,
+		const struct nbt_visitor *v, void *priv);
+
+/* The same, but resumable, for documents which arrive in pieces. Data
+ * passed to callbacks is only valid until they return. finish frees the
+ * parser and returns 1 if nbt_parse() would have accepted all that was
+ * fed, which like it lets compounds end with the data.
+ */
+typedef struct _nbt_parser *nbt_parser_t;
+nbt_parser_t nbt_parser_new(const struct nbt_visitor *v, void *priv);
+int nbt_parser_feed(nbt_parser_t p, const uint8_t *buf, size_t len);
+int nbt_parser_finish(nbt_parser_t p);
+
+/* Compiled queries over encoded documents. A path is compound member
+ * names separated by dots, each optionally followed by list indexes, [n]
+ * or [*] for every element, eg. "Level.Sections[*].Blocks". The first
+ * name is looked up in the root compound. Matches point in to the callers
+ * buffer: at the elements of arrays and strings, at the big-endian value
+ * of scalars and at the whole encoding of lists and compounds, len is in
+ * bytes. Returning 0 from the callback ends the query early.
+ */
+typedef struct _nbt_path *nbt_path_t;
+typedef int (*nbt_match_t)(void *priv, uint8_t type,
+				const uint8_t *data, size_t len);
+
+nbt_path_t nbt_path_compile(const char *path);
+void nbt_path_free(nbt_path_t p);
+int nbt_path_eval(nbt_path_t p, const uint8_t *buf, size_t len,
+			nbt_match_t cb, void *priv);
+int nbt_path_first(nbt_path_t p, const uint8_t *buf, size_t len,
+			uint8_t *type, const uint8_t **data, size_t *dlen);
 
 #endif /* _NBT_H */
@@ -11,9 +11,20 @@ region_t region_new(const char *fn);
 
 void region_set_pos(region_t r, int32_t x, int32_t z);
 
-/* load chunk and return reference */
+/* Return a reference to chunk x,z. A chunk given to region_set_chunk()
+ * and not saved yet is newer than what's on disk, so that's the one
+ * returned, edits and all. Otherwise it's loaded from disk. NULL if
+ * there's no such chunk.
+ */
 chunk_t region_get_chunk(region_t r, uint8_t x, uint8_t z);
 
+/* parse chunk with nbt_parser_feed() as it's inflated, without keeping
+ * the decompressed data or building a tree
+ */
+struct nbt_visitor;
+int region_parse_chunk(region_t r, uint8_t x, uint8_t z,
+			const struct nbt_visitor *v, void *priv);
+
 /* set updated chunk, marks chunk as dirty and to be written out,
  * chunk refcount is incremented
 */
@@ -23,6 +34,9 @@ void region_set_timestamp(region_t r, uint8_t x, uint8_t z, uint32_t ts);
 
 uint32_t region_get_timestamp(region_t r, uint8_t x, uint8_t z);
 
+/* Chunks that aren't populated are created. Fails, possibly part way
+ * through, if a chunk that is stored can't be loaded.
+ */
 int region_paste_schematic(region_t r, schematic_t s, int x, int y, int z);
 
 /* dirty chunks reference counts are dropped */
@@ -0,0 +1,20 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ */
+#ifndef _MPOOL_HEADER_INCLUDED_
+#define _MPOOL_HEADER_INCLUDED_
+
+typedef struct _mpool *mpool_t;
+
+#define MPOOL_ALIGN		sizeof(uint64_t)
+
+mpool_t mpool_new(size_t slab_size);
+void mpool_free(mpool_t m);
+void mpool_reset(mpool_t m);
+void *mpool_alloc(mpool_t m, size_t sz);
+void *mpool_alloc0(mpool_t m, size_t sz);
+void mpool_return(mpool_t m, void *ptr, size_t sz);
+
+#endif /* _MPOOL_HEADER_INCLUDED_ */
@@ -0,0 +1,16 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ */
+#ifndef _NIBBLE_HEADER_INCLUDED_
+#define _NIBBLE_HEADER_INCLUDED_
+
+/* Convert between n nibbles packed two to a byte, even ones in the low
+ * half, and n bytes of one nibble each. n must be even. Buffers needn't
+ * be aligned but mustn't overlap.
+ */
+void nibble_unpack(uint8_t *dst, const uint8_t *src, size_t n);
+void nibble_pack(uint8_t *dst, const uint8_t *src, size_t n);
+
+#endif /* _NIBBLE_HEADER_INCLUDED_ */
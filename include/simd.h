@@ -0,0 +1,28 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ */
+#ifndef _SIMD_HEADER_INCLUDED_
+#define _SIMD_HEADER_INCLUDED_
+
+/* A vector kernel runs over as much of an n element array as fits in
+ * whole vectors and returns how many elements that was, the caller does
+ * the rest with a scalar loop.
+ */
+typedef size_t (*simd_kernel_t)(uint8_t *dst, const uint8_t *src, size_t n);
+
+/* the kernels for one operation, NULL for any that weren't built */
+struct simd_kernels {
+	simd_kernel_t sse2;
+	simd_kernel_t avx2;
+	simd_kernel_t neon;
+};
+
+/* Run the best of k that this CPU can do, the CPU is only probed once.
+ * Returns how many elements were done, 0 if there's no usable kernel.
+ */
+size_t simd_run(const struct simd_kernels *k, uint8_t *dst,
+		const uint8_t *src, size_t n);
+
+#endif /* _SIMD_HEADER_INCLUDED_ */
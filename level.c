@@ -3,13 +3,14 @@
  *
  * Handle level.dat files
 */
+#include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <libmc/minecraft.h>
 #include <libmc/nbt.h>
 #include <libmc/level.h>
 
-#include <zlib.h>
 
 struct _level {
 	nbt_t nbt;
@@ -17,6 +18,52 @@ struct _level {
 	unsigned ref;
 };
 
+/* tag names we look up, resolved to atoms once by level_keys() */
+enum {
+	KEY_DATA,
+	KEY_LEVELNAME,
+	KEY_SPAWNX,
+	KEY_SPAWNY,
+	KEY_SPAWNZ,
+	KEY_MAX,
+};
+
+static const char * const key_names[KEY_MAX] = {
+	[KEY_DATA] = "Data",
+	[KEY_LEVELNAME] = "LevelName",
+	[KEY_SPAWNX] = "SpawnX",
+	[KEY_SPAWNY] = "SpawnY",
+	[KEY_SPAWNZ] = "SpawnZ",
+};
+
+static nbt_atom_t keys[KEY_MAX];
+static int keys_ok;
+
+static void resolve_keys(void)
+{
+	unsigned int i;
+
+	for(i = 0; i < KEY_MAX; i++) {
+		keys[i] = nbt_atom(key_names[i]);
+		if ( NBT_ATOM_NONE == keys[i] )
+			return;
+	}
+
+	keys_ok = 1;
+}
+
+static int level_keys(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, resolve_keys);
+	return keys_ok;
+}
+
+static nbt_tag_t get_key(nbt_tag_t t, unsigned int key)
+{
+	return nbt_compound_get_atom(t, keys[key]);
+}
+
 level_t level_load(const char *path)
 {
 	struct _level *l;
@@ -24,6 +71,9 @@ level_t level_load(const char *path)
 	uint8_t *buf;
 	size_t sz;
 
+	if ( !level_keys() )
+		return NULL;
+
 	l = calloc(1, sizeof(*l));
 	if ( NULL == l )
 		goto out;
@@ -46,7 +96,7 @@ level_t level_load(const char *path)
 	if ( NULL == root )
 		goto out_free;
 
-	l->data = nbt_compound_get(root, "Data");
+	l->data = get_key(root, KEY_DATA);
 	if ( NULL == l->data )
 		goto out_free;
 
@@ -165,6 +215,9 @@ level_t level_new(void)
 {
 	struct _level *l;
 
+	if ( !level_keys() )
+		return NULL;
+
 	l = calloc(1, sizeof(*l));
 	if ( NULL == l )
 		goto out;
@@ -210,7 +263,7 @@ int level_set_name(level_t l, const char *name)
 {
 	nbt_tag_t t;
 
-	t = nbt_compound_get(l->data, "LevelName");
+	t = get_key(l->data, KEY_LEVELNAME);
 	if ( !nbt_string_set(t, name) )
 		return 0;
 
@@ -221,15 +274,15 @@ int level_set_spawn(level_t l, int x, int y, int z)
 {
 	nbt_tag_t t;
 
-	t = nbt_compound_get(l->data, "SpawnX");
+	t = get_key(l->data, KEY_SPAWNX);
 	if ( !nbt_int_set(t, x) )
 		return 0;
 
-	t = nbt_compound_get(l->data, "SpawnY");
+	t = get_key(l->data, KEY_SPAWNY);
 	if ( !nbt_int_set(t, y) )
 		return 0;
 
-	t = nbt_compound_get(l->data, "SpawnZ");
+	t = get_key(l->data, KEY_SPAWNZ);
 	if ( !nbt_int_set(t, z) )
 		return 0;
 
@@ -238,10 +291,8 @@ int level_set_spawn(level_t l, int x, int y, int z)
 
 int level_save(level_t l, const char *path)
 {
-	size_t sz;
-	uint8_t *buf;
-	gzFile gz;
-	int ret, fd, rc = 0;
+	struct nbt_sink *s;
+	int fd, rc = 0;
 
 //	nbt_dump(l->nbt);
 
@@ -249,30 +300,23 @@ int level_save(level_t l, const char *path)
 	if ( fd < 0 )
 		goto out;
 
-	gz = gzdopen(fd, "w");
-	if ( NULL == gz )
+	s = libmc_deflate_sink(LIBMC_DEFLATE_GZIP, fd);
+	if ( NULL == s )
 		goto out_close;
 
-	sz = nbt_size_in_bytes(l->nbt);
-	buf = malloc(sz);
-	if ( NULL == buf )
-		goto out_gz;
-
-	if ( !nbt_get_bytes(l->nbt, buf, sz) )
-		goto out_free;
+	if ( !nbt_encode(l->nbt, s) ) {
+		libmc_deflate_abort(s);
+		goto out_close;
+	}
 
-	ret = gzwrite(gz, buf, sz);
-	if ( ret < 0 || (size_t)ret != sz )
-		goto out_free;
+	if ( !libmc_deflate_finish(s, NULL, NULL) )
+		goto out_close;
 
 	rc = 1;
 
-out_free:
-	free(buf);
-out_gz:
-	gzclose(gz);
 out_close:
-	close(fd);
+	if ( close(fd) < 0 )
+		rc = 0;
 out:
 	return rc;
 }
@@ -30,6 +30,7 @@ static chunk_t floor_chunk(void)
 	return c;
 }
 
+/* stamp out copies of c, region_save() gives each its position */
 static int region_init(region_t dst, chunk_t c)
 {
 	unsigned int i, j;
@@ -37,7 +38,16 @@ static int region_init(region_t dst, chunk_t c)
 
 	for(i = 0; i < REGION_X; i++) {
 		for(j = 0; j < REGION_Z; j++) {
-			if ( !region_set_chunk(dst, i, j, c) )
+			chunk_t cc;
+			int rc;
+
+			cc = chunk_clone(c);
+			if ( NULL == cc )
+				return 0;
+
+			rc = region_set_chunk(dst, i, j, cc);
+			chunk_put(cc);
+			if ( !rc )
 				return 0;
 
 			region_set_timestamp(dst, i, j, ts);
@@ -0,0 +1,306 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mpool.h"
+
+#define MPOOL_DEFAULT_SLAB	(64U << 10)
+
+/* Returned blocks are only reused for allocations of exactly the same
+ * size. Edit loops tend to allocate the same sizes over and over and since
+ * blocks are never split there's nothing to coalesce. Small sizes each have
+ * a bin, bigger ones share a bin per power of two.
+ */
+#define MPOOL_SMALL	512U
+#define MPOOL_BINS	(MPOOL_SMALL / MPOOL_ALIGN + sizeof(size_t) * 8)
+/* how far down a shared bin to look for a block of the right size */
+#define MPOOL_SCAN	16
+
+/** A block handed back by mpool_return().
+ * \ingroup g_mpool
+ *
+ * Small blocks may only have room for the next pointer, but their size
+ * is implied by which bin they're in.
+ */
+struct mpool_free {
+	struct mpool_free *next;
+	size_t sz;
+};
+
+/** mpool descriptor.
+ * \ingroup g_mpool
+ *
+ * A bump allocator for variable sized objects. The whole lot is released
+ * by mpool_free(), but objects may also be handed back with mpool_return()
+ * to be recycled by later allocations.
+*/
+struct _mpool {
+	/** Next free byte in current slab */
+	uint8_t *ptr;
+	/** End of current slab */
+	uint8_t *end;
+	/** Size of each slab including mpool_hdr overhead. */
+	size_t slab_size;
+	/** List of slabs, current slab first. */
+	struct _mpool_hdr *slabs;
+	/** Slabs kept by mpool_reset() for reuse */
+	struct _mpool_hdr *spare;
+	/** Number of returned blocks waiting in bins */
+	size_t nfree;
+	/** Returned blocks */
+	struct mpool_free *bin[MPOOL_BINS];
+};
+
+/** mpool memory area descriptor.
+ * \ingroup g_mpool
+*/
+struct _mpool_hdr {
+	/** Pointer to next item in the list */
+	struct _mpool_hdr *next;
+	/** Size of a dedicated slab from alloc_big(), else 0. Also keeps
+	 * data MPOOL_ALIGN aligned.
+	 */
+	uint64_t big;
+	/** Data up to the slab_size */
+	uint8_t data[0];
+};
+
+static size_t align_up(size_t sz)
+{
+	return (sz + (MPOOL_ALIGN - 1)) & ~(MPOOL_ALIGN - 1);
+}
+
+/** Create an mpool.
+ * \ingroup g_mpool
+ *
+ * @param slab_size size of each slab in bytes (set to zero for auto)
+ *
+ * @return NULL on error, new mpool otherwise.
+ */
+mpool_t mpool_new(size_t slab_size)
+{
+	struct _mpool *m;
+
+	m = calloc(1, sizeof(*m));
+	if ( NULL == m )
+		return NULL;
+
+	if ( !slab_size )
+		slab_size = MPOOL_DEFAULT_SLAB;
+
+	m->slab_size = slab_size;
+	return m;
+}
+
+/** Allocate a dedicated slab for an object.
+ * \ingroup g_mpool
+ *
+ * Large objects would waste most of a slab so they get a block to
+ * themselves. It is linked in behind the current slab so that the bump
+ * region isn't lost.
+ */
+static void *alloc_big(struct _mpool *m, size_t sz)
+{
+	struct _mpool_hdr *hdr;
+
+	hdr = malloc(sizeof(*hdr) + sz);
+	if ( NULL == hdr )
+		return NULL;
+
+	hdr->big = sz;
+	if ( m->slabs ) {
+		hdr->next = m->slabs->next;
+		m->slabs->next = hdr;
+	}else{
+		hdr->next = NULL;
+		m->slabs = hdr;
+	}
+
+	return hdr->data;
+}
+
+/** Slow path for mpool allocations.
+ * \ingroup g_mpool
+ */
+static void *mpool_alloc_slow(struct _mpool *m, size_t sz)
+{
+	struct _mpool_hdr *hdr;
+
+	if ( sz > (m->slab_size >> 2) )
+		return alloc_big(m, sz);
+
+	if ( m->spare ) {
+		hdr = m->spare;
+		m->spare = hdr->next;
+	}else{
+		hdr = malloc(sizeof(*hdr) + m->slab_size);
+		if ( NULL == hdr )
+			return NULL;
+		hdr->big = 0;
+	}
+
+	hdr->next = m->slabs;
+	m->slabs = hdr;
+
+	m->ptr = hdr->data + sz;
+	m->end = hdr->data + m->slab_size;
+	return hdr->data;
+}
+
+static unsigned int bin_of(size_t sz)
+{
+	if ( sz <= MPOOL_SMALL )
+		return sz / MPOOL_ALIGN - 1;
+	return MPOOL_SMALL / MPOOL_ALIGN +
+		((sizeof(sz) * 8 - 1) - __builtin_clzl(sz));
+}
+
+static void put_free(struct _mpool *m, void *ptr, size_t sz)
+{
+	struct mpool_free *f = ptr;
+	unsigned int b;
+
+	b = bin_of(sz);
+	if ( sz > MPOOL_SMALL )
+		f->sz = sz;
+	f->next = m->bin[b];
+	m->bin[b] = f;
+	m->nfree++;
+}
+
+/** Recycle a returned block of exactly sz bytes.
+ * \ingroup g_mpool
+ */
+static void *get_free(struct _mpool *m, size_t sz)
+{
+	struct mpool_free *f, **pp;
+	unsigned int n;
+
+	pp = &m->bin[bin_of(sz)];
+	if ( sz <= MPOOL_SMALL ) {
+		f = *pp;
+		if ( NULL == f )
+			return NULL;
+		goto found;
+	}
+
+	for(n = 0; (f = *pp) && n < MPOOL_SCAN; pp = &f->next, n++) {
+		if ( f->sz == sz )
+			goto found;
+	}
+
+	return NULL;
+found:
+	*pp = f->next;
+	m->nfree--;
+	return f;
+}
+
+/** Allocate memory from an mpool.
+ * \ingroup g_mpool
+ * @param m a valid mpool returned from mpool_new()
+ * @param sz number of bytes required
+ *
+ * The returned memory is aligned to MPOOL_ALIGN and lives until the
+ * mpool is free'd.
+ *
+ * @return pointer to new memory or NULL if out of memory
+ */
+void *mpool_alloc(mpool_t m, size_t sz)
+{
+	void *ret;
+
+	sz = align_up(sz ? sz : 1);
+	if ( m->nfree && (ret = get_free(m, sz)) )
+		return ret;
+	if ( (size_t)(m->end - m->ptr) < sz )
+		return mpool_alloc_slow(m, sz);
+
+	ret = m->ptr;
+	m->ptr += sz;
+	return ret;
+}
+
+/** Allocate zeroed memory from an mpool.
+ * \ingroup g_mpool
+ */
+void *mpool_alloc0(mpool_t m, size_t sz)
+{
+	void *ret;
+
+	ret = mpool_alloc(m, sz);
+	if ( ret )
+		memset(ret, 0, sz);
+
+	return ret;
+}
+
+/** Hand an object back to an mpool.
+ * \ingroup g_mpool
+ * @param m the mpool that ptr came from
+ * @param ptr object returned by mpool_alloc() or NULL
+ * @param sz size that was asked for, or less
+ *
+ * The memory is reused by later allocations from m.
+ */
+void mpool_return(mpool_t m, void *ptr, size_t sz)
+{
+	if ( NULL == ptr || !sz )
+		return;
+	put_free(m, ptr, align_up(sz));
+}
+
+/** Empty an mpool but keep its memory.
+ * \ingroup g_mpool
+ * @param m a valid mpool returned from mpool_new()
+ *
+ * Everything allocated from m is released at once. Slabs are kept for
+ * later allocations, dedicated ones for big objects go back to malloc.
+ */
+void mpool_reset(mpool_t m)
+{
+	struct _mpool_hdr *hdr, *next;
+
+	for(hdr = m->slabs; hdr; hdr = next) {
+		next = hdr->next;
+		if ( hdr->big ) {
+			free(hdr);
+			continue;
+		}
+		hdr->next = m->spare;
+		m->spare = hdr;
+	}
+
+	m->slabs = NULL;
+	m->ptr = m->end = NULL;
+	m->nfree = 0;
+	memset(m->bin, 0, sizeof(m->bin));
+}
+
+/** Destroy an mpool.
+ * \ingroup g_mpool
+ * @param m an mpool returned from mpool_new() or NULL
+ *
+ * Frees all memory allocated from the mpool in one go.
+ */
+void mpool_free(mpool_t m)
+{
+	struct _mpool_hdr *hdr, *f;
+
+	if ( NULL == m )
+		return;
+
+	for(hdr = m->slabs; (f = hdr); free(f))
+		hdr = hdr->next;
+	for(hdr = m->spare; (f = hdr); free(f))
+		hdr = hdr->next;
+
+	free(m);
+}
@@ -11,30 +11,106 @@
 #include <libmc/nbt.h>
 
 #include "hgang.h"
-#include "list.h"
+#include "mpool.h"
+#include "atom.h"
+#include "bswap.h"
 
 #define TAG_NAMED	0
 #define TAG_ANON	1
 
-struct nbt_byte_array {
-	int32_t len;
-	uint8_t *array;
+/* Byte order of an encoding, the java edition is big-endian and bedrock
+ * is little-endian. The codec takes the order as an argument and its
+ * entry points are specialised for each order by DECODER() and ENCODER(),
+ * so that it's a constant and all of the tests on it fold away. Borrowed
+ * and lazy documents are always big-endian.
+ */
+#define ORDER_BE	0
+#define ORDER_LE	1
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define ORDER_HOST	ORDER_LE
+#else
+#define ORDER_HOST	ORDER_BE
+#endif
+
+/* for the order-generic parts of the codec */
+#define ALWAYS_INLINE	inline __attribute__((always_inline))
+
+/* payload points in to memory we don't own, for example the callers
+ * buffer in nbt_decode_borrowed(). Must be copied before any mutable
+ * access. Int and long arrays are held in native byte order unless they
+ * are borrowed, in which case they are still big-endian.
+ */
+#define TAG_DATA_BORROWED	(1U << 0)
+/* list or compound whose children have not been decoded yet, t_lazy
+ * holds the encoded payload
+ */
+#define TAG_LAZY		(1U << 1)
+/* list of a fixed size primitive type, the elements are in t_cont.vals
+ * as a native array rather than a tag each
+ */
+#define TAG_PACKED		(1U << 2)
+/* part of a frozen document from nbt_freeze(), read-only and laid out
+ * differently, see there
+ */
+#define TAG_FROZEN		(1U << 3)
+/* root of a document whose nbt->snap is still a faithful encoding of
+ * it, cleared by anything which changes the tree
+ */
+#define TAG_SNAPSHOT		(1U << 4)
+
+/* Compounds with more than CINDEX_MIN children get a hash index the
+ * first time that they are searched. It's open addressing with linear
+ * probing on the name atom and kept at most half full.
+ */
+#define CINDEX_MIN	8
+
+struct nbt_cindex {
+	uint32_t mask;
+	uint32_t cnt;
+	struct nbt_tag *slot[0];
 };
 
-struct nbt_int_array {
-	int32_t len;
-	int32_t *array;
+/* children of a list or compound in order, with room for list_cap() of
+ * them. Only compounds have an index.
+ */
+struct nbt_kids {
+	struct nbt_cindex *idx;
+	struct nbt_tag *tag[0];
 };
 
-struct nbt_list {
-	struct nbt_tag **array;
-	int32_t len;
-	uint8_t type;
+struct nbt_cont {
+	union {
+		struct nbt_kids *kids;
+		void *vals;
+	};
+	uint32_t size;
+	uint32_t src;
+};
+
+struct nbt_lazy {
+	const uint8_t *ptr;
+	uint32_t len;
 };
 
+/* Tags are 32 bytes, two to a cache line. t_len is the length of an array
+ * or string or the number of children of a list or compound, t_ltype is
+ * the element type of a list. Lists and compounds cache t_cont.size, the
+ * encoded size of their value including any children but not their own
+ * name, everything else is cheap to size from its value. Setters keep the
+ * sizes of ancestors up to date through t_parent, the hgang index of the
+ * parent, so a tag can only be linked in one place at a time and only in
+ * the document it was created in. While a list or compound decoded from a
+ * borrowed buffer is unmodified, t_cont.src is one more than its offset
+ * in there and the encoder copies it out wholesale. This limits borrowed
+ * documents to 4GB.
+ */
 struct nbt_tag {
-	struct list_head t_list;
-	char *t_name;
+	uint32_t t_parent;
+	nbt_atom_t t_name;
+	int32_t t_len;
+	uint8_t t_type;
+	uint8_t t_flags;
+	uint8_t t_ltype;
 	union {
 		uint8_t t_byte;
 		int16_t t_short;
@@ -42,20 +118,592 @@ struct nbt_tag {
 		int64_t t_long;
 		float t_float;
 		double t_double;
-		struct nbt_byte_array t_blob;
+		uint8_t *t_blob;
 		char *t_str;
-		struct nbt_list t_list;
-		struct list_head t_compound;
-		struct nbt_int_array t_ints;
+		int32_t *t_ints;
+		int64_t *t_longs;
+		struct nbt_cont t_cont;
+		struct nbt_lazy t_lazy;
+		uint32_t t_off;
 	}t_u;
-	uint8_t t_type;
+};
+
+/* All of the memory for a document comes from two pools: tag nodes from
+ * an hgang and everything else (strings, arrays) from an mpool. Names are
+ * atoms and live in the global atom table. A
+ * tag finds its document via hgang_of(). Tags which are removed from the
+ * tree and payloads which are replaced go back to the pools to be reused.
+ */
+/* An encoded document shared between nbt_clone()s, which borrow from it */
+struct nbt_snap {
+	unsigned int ref;
+	uint32_t len;
+	uint8_t buf[0];
 };
 
 struct _nbt {
 	hgang_t nodes;
-	struct nbt_tag root;
+	mpool_t mem;
+	struct nbt_tag *root;
+	const uint8_t *src;
+	/* what src belongs to if we're a clone, and our own encoding for
+	 * further clones, valid while the root has TAG_SNAPSHOT
+	 */
+	struct nbt_snap *share;
+	struct nbt_snap *snap;
+	/* how many names not seen before decoding may still intern */
+	unsigned int new_names;
+	/* names kept here when that runs out, see local_intern() */
+	struct local_name *names;
+	uint32_t num_names;
+	uint32_t names_cap;
+	uint32_t *name_idx;
+	uint32_t name_mask;
+	int borrow;
+	int lazy;
+};
+
+static struct _nbt *tag_nbt(const struct nbt_tag *t)
+{
+	return hgang_priv(hgang_of(t));
+}
+
+/* Names which a decode meets once its share of the atom table is used up
+ * are kept in the document instead, and their tags get a local atom with
+ * LOCAL_NAME set. Each string gets one local atom per document, and once
+ * a document has one it's used for that name from then on even if the
+ * name is interned later, so that names still match by atom within the
+ * document. Local atoms never get out, nbt_tag_atom() interns the name.
+ */
+#define LOCAL_NAME	(1U << 31)
+
+struct local_name {
+	const char *str;
+	uint32_t len;
+};
+
+static const char *local_str(const struct _nbt *nbt, nbt_atom_t a,
+				size_t *len)
+{
+	const struct local_name *n = &nbt->names[a & ~LOCAL_NAME];
+
+	*len = n->len;
+	return n->str;
+}
+
+/* local atom of str, or NBT_ATOM_NONE */
+static nbt_atom_t local_find(const struct _nbt *nbt, const char *str,
+				size_t len)
+{
+	const struct local_name *n;
+	uint32_t i;
+
+	if ( !nbt->num_names )
+		return NBT_ATOM_NONE;
+
+	i = nbt_hash_bytes((const uint8_t *)str, len) & nbt->name_mask;
+	for(; nbt->name_idx[i]; i = (i + 1) & nbt->name_mask) {
+		n = &nbt->names[nbt->name_idx[i] - 1];
+		if ( n->len == len && !memcmp(n->str, str, len) )
+			return LOCAL_NAME | (nbt->name_idx[i] - 1);
+	}
+
+	return NBT_ATOM_NONE;
+}
+
+static int local_grow(struct _nbt *nbt)
+{
+	struct local_name *names;
+	uint32_t *idx, mask, i, j;
+
+	if ( nbt->num_names == nbt->names_cap ) {
+		if ( nbt->names_cap >= LOCAL_NAME / 2 )
+			return 0;
+		i = (nbt->names_cap) ? nbt->names_cap * 2 : 64;
+		names = realloc(nbt->names, i * sizeof(*names));
+		if ( NULL == names )
+			return 0;
+		nbt->names = names;
+		nbt->names_cap = i;
+	}
+
+	/* keep the index no more than half full */
+	if ( nbt->name_idx && (nbt->num_names + 1) * 2 <= nbt->name_mask + 1 )
+		return 1;
+
+	mask = (nbt->name_idx) ? nbt->name_mask * 2 + 1 : 127;
+	idx = calloc(mask + 1, sizeof(*idx));
+	if ( NULL == idx )
+		return 0;
+
+	for(j = 0; j < nbt->num_names; j++) {
+		const struct local_name *n = &nbt->names[j];
+
+		i = nbt_hash_bytes((const uint8_t *)n->str, n->len) & mask;
+		while( idx[i] )
+			i = (i + 1) & mask;
+		idx[i] = j + 1;
+	}
+
+	free(nbt->name_idx);
+	nbt->name_idx = idx;
+	nbt->name_mask = mask;
+	return 1;
+}
+
+static nbt_atom_t local_intern(struct _nbt *nbt, const char *str, size_t len)
+{
+	struct local_name *n;
+	nbt_atom_t a;
+	char *copy;
+	uint32_t i;
+
+	a = local_find(nbt, str, len);
+	if ( NBT_ATOM_NONE != a )
+		return a;
+
+	if ( !local_grow(nbt) )
+		return NBT_ATOM_NONE;
+
+	copy = mpool_alloc(nbt->mem, len + 1);
+	if ( NULL == copy )
+		return NBT_ATOM_NONE;
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+
+	n = &nbt->names[nbt->num_names];
+	n->str = copy;
+	n->len = len;
+
+	i = nbt_hash_bytes((const uint8_t *)str, len) & nbt->name_mask;
+	while( nbt->name_idx[i] )
+		i = (i + 1) & nbt->name_mask;
+	nbt->name_idx[i] = ++nbt->num_names;
+
+	return LOCAL_NAME | (nbt->num_names - 1);
+}
+
+/* atom for a name met while decoding */
+static nbt_atom_t decode_name(struct _nbt *nbt, const char *str, size_t len)
+{
+	nbt_atom_t a;
+
+	a = local_find(nbt, str, len);
+	if ( NBT_ATOM_NONE != a )
+		return a;
+
+	a = atom_intern_budget(str, len, &nbt->new_names);
+	if ( NBT_ATOM_NONE != a )
+		return a;
+
+	return local_intern(nbt, str, len);
+}
+
+/* atom which stands for name in nbt, NBT_ATOM_NONE if it can't be there */
+static nbt_atom_t doc_atom(const struct _nbt *nbt, const char *str,
+				size_t len)
+{
+	nbt_atom_t a;
+
+	a = local_find(nbt, str, len);
+	if ( NBT_ATOM_NONE != a )
+		return a;
+
+	return atom_find(str, len);
+}
+
+/* an atom from outside, as it's known in nbt */
+static nbt_atom_t doc_key(const struct _nbt *nbt, nbt_atom_t key)
+{
+	nbt_atom_t a;
+
+	if ( key & LOCAL_NAME )
+		return NBT_ATOM_NONE;
+	if ( !nbt->num_names || NBT_ATOM_NONE == key )
+		return key;
+
+	a = local_find(nbt, atom_str(key), atom_len(key));
+	return (NBT_ATOM_NONE != a) ? a : key;
+}
+
+/* name of a tag which isn't frozen */
+static const char *tag_name(const struct nbt_tag *t, size_t *len)
+{
+	if ( t->t_name & LOCAL_NAME )
+		return local_str(tag_nbt(t), t->t_name, len);
+
+	*len = atom_len(t->t_name);
+	return atom_str(t->t_name);
+}
+
+static size_t name_len(const struct nbt_tag *t)
+{
+	size_t len;
+
+	tag_name(t, &len);
+	return len;
+}
+
+static struct nbt_tag *tag_parent(const struct nbt_tag *t)
+{
+	if ( !t->t_parent )
+		return NULL;
+	return hgang_at(hgang_of(t), t->t_parent);
+}
+
+static void set_parent(struct nbt_tag *c, const struct nbt_tag *t)
+{
+	c->t_parent = hgang_index(hgang_of(t), t);
+}
+
+static int frozen(const struct nbt_tag *t)
+{
+	return t->t_flags & TAG_FROZEN;
+}
+
+/* payload of an array or string, frozen tags hold an offset from the tag */
+static void *payload(const struct nbt_tag *t)
+{
+	if ( frozen(t) )
+		return (uint8_t *)t + t->t_u.t_off;
+	return t->t_u.t_blob;
+}
+
+/* name of a frozen tag, NULL for list elements */
+static const char *frozen_name(const struct nbt_tag *t, size_t *len)
+{
+	const char *name = NULL;
+	uint16_t nlen = 0;
+
+	if ( t->t_name ) {
+		name = (const char *)t + t->t_name;
+		memcpy(&nlen, name - sizeof(nlen), sizeof(nlen));
+	}
+	if ( len )
+		*len = nlen;
+	return name;
+}
+
+/* elements of a frozen list of numbers don't have tags */
+static struct nbt_tag *frozen_kid(const struct nbt_tag *t, unsigned int idx)
+{
+	if ( (t->t_flags & TAG_PACKED) || idx >= (unsigned int)t->t_len )
+		return NULL;
+	return (struct nbt_tag *)payload(t) + idx;
+}
+
+/* order of members in a frozen compound */
+static int name_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int ret;
+
+	ret = memcmp(a, b, (alen < blen) ? alen : blen);
+	if ( ret )
+		return ret;
+	return (alen > blen) - (alen < blen);
+}
+
+static struct nbt_tag *frozen_find(const struct nbt_tag *t,
+					const char *key, size_t klen)
+{
+	struct nbt_tag *kids = payload(t);
+	uint32_t lo = 0, hi = t->t_len, mid;
+	const char *name;
+	size_t len;
+	int cmp;
+
+	while( lo < hi ) {
+		mid = lo + (hi - lo) / 2;
+		name = frozen_name(&kids[mid], &len);
+		cmp = name_cmp(key, klen, name, len);
+		if ( !cmp )
+			return &kids[mid];
+		if ( cmp < 0 )
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+/* list arrays have an implied capacity of the next power of two */
+static uint32_t list_cap(uint32_t len)
+{
+	uint32_t cap;
+
+	for(cap = 1; cap < len; cap <<= 1)
+		/* nothing */;
+
+	return cap;
+}
+
+static size_t kids_size(uint32_t len)
+{
+	return sizeof(struct nbt_kids) +
+		list_cap(len) * sizeof(struct nbt_tag *);
+}
+
+/* encoded size of the scalar types, 0 for everything else */
+static size_t fixed_size(uint8_t type)
+{
+	switch(type) {
+	case NBT_TAG_Byte:
+		return sizeof(uint8_t);
+	case NBT_TAG_Short:
+		return sizeof(int16_t);
+	case NBT_TAG_Int:
+	case NBT_TAG_Float:
+		return sizeof(int32_t);
+	case NBT_TAG_Long:
+	case NBT_TAG_Double:
+		return sizeof(int64_t);
+	default:
+		return 0;
+	}
+}
+
+/* smallest encoding of a list element of the given type, for sanity
+ * checking list lengths against the bytes actually left in the buffer
+ */
+static size_t min_size(uint8_t type)
+{
+	switch(type) {
+	case NBT_TAG_String:
+		return sizeof(uint16_t);
+	case NBT_TAG_Byte_Array:
+	case NBT_TAG_Int_Array:
+	case NBT_TAG_Long_Array:
+		return sizeof(int32_t);
+	case NBT_TAG_List:
+		return sizeof(uint8_t) + sizeof(int32_t);
+	default:
+		return 1;
+	}
+}
+
+/* Tree walks use an explicit stack rather than recursion, so that deep
+ * nesting costs heap rather than C stack and is bounded by max_depth.
+ * The first STACK_INLINE frames live in the walkers own stack frame.
+ */
+#define STACK_INLINE	32
+
+struct frame {
+	struct nbt_tag *tag;
+	struct nbt_tag *peer;
+	const struct nbt_visitor *v;
+	uint64_t h;
+	int32_t idx;
+	uint8_t type;
+	uint8_t ltype;
+};
+
+struct stack {
+	struct frame *f;
+	unsigned int top;
+	unsigned int cap;
+	struct frame inl[STACK_INLINE];
 };
 
+static unsigned int max_depth = NBT_DEFAULT_MAX_DEPTH;
+
+void nbt_set_max_depth(unsigned int depth)
+{
+	max_depth = (depth) ? depth : NBT_DEFAULT_MAX_DEPTH;
+}
+
+static void stack_init(struct stack *s)
+{
+	s->f = s->inl;
+	s->top = 0;
+	s->cap = STACK_INLINE;
+}
+
+static void stack_fini(struct stack *s)
+{
+	if ( s->f != s->inl )
+		free(s->f);
+}
+
+static struct frame *stack_push(struct stack *s)
+{
+	struct frame *new;
+
+	if ( s->top >= max_depth )
+		return NULL;
+
+	if ( s->top == s->cap ) {
+		new = malloc(s->cap * 2 * sizeof(*new));
+		if ( NULL == new )
+			return NULL;
+		memcpy(new, s->f, s->top * sizeof(*new));
+		stack_fini(s);
+		s->f = new;
+		s->cap *= 2;
+	}
+
+	return &s->f[s->top++];
+}
+
+static struct frame *stack_top(struct stack *s)
+{
+	return (s->top) ? &s->f[s->top - 1] : NULL;
+}
+
+static void stack_pop(struct stack *s)
+{
+	s->top--;
+}
+
+/* true if the walkers should descend in to t */
+static int has_children(const struct nbt_tag *t)
+{
+	return (t->t_type == NBT_TAG_List || t->t_type == NBT_TAG_Compound)
+		&& !(t->t_flags & (TAG_LAZY|TAG_PACKED));
+}
+
+static int push_tag(struct stack *s, struct nbt_tag *t)
+{
+	struct frame *f;
+
+	f = stack_push(s);
+	if ( NULL == f )
+		return 0;
+
+	f->tag = t;
+	f->idx = 0;
+	return 1;
+}
+
+/* Next child of the tag in frame f, or NULL when we're done with it. An
+ * empty list slot also gives NULL, without moving on, which frame_hole()
+ * tells apart from the end.
+ */
+static struct nbt_tag *frame_next(struct frame *f)
+{
+	struct nbt_tag *t = f->tag, *c;
+
+	if ( f->idx >= t->t_len )
+		return NULL;
+	c = t->t_u.t_cont.kids->tag[f->idx];
+	if ( c )
+		f->idx++;
+	return c;
+}
+
+static int frame_hole(const struct frame *f)
+{
+	return f->idx < f->tag->t_len;
+}
+
+/* true if t keeps its encoded size in t_cont */
+static int has_size(const struct nbt_tag *t)
+{
+	return (t->t_type == NBT_TAG_List || t->t_type == NBT_TAG_Compound)
+		&& !(t->t_flags & TAG_LAZY);
+}
+
+/* size of a tags value, not counting any children */
+static size_t value_size(const struct nbt_tag *tag)
+{
+	size_t sz = 0;
+
+	if ( tag->t_flags & TAG_LAZY )
+		return tag->t_u.t_lazy.len;
+
+	switch(tag->t_type) {
+	case NBT_TAG_Byte:
+		sz += sizeof(uint8_t);
+		break;
+	case NBT_TAG_Short:
+		sz += sizeof(int16_t);
+		break;
+	case NBT_TAG_Int:
+		sz += sizeof(int32_t);
+		break;
+	case NBT_TAG_Long:
+		sz += sizeof(int64_t);
+		break;
+	case NBT_TAG_Float:
+		sz += sizeof(float);
+		break;
+	case NBT_TAG_Double:
+		sz += sizeof(double);
+		break;
+	case NBT_TAG_Byte_Array:
+		sz += sizeof(int32_t) + tag->t_len;
+		break;
+	case NBT_TAG_String:
+		sz += sizeof(int16_t) + tag->t_len;
+		break;
+	case NBT_TAG_List:
+		sz += sizeof(uint8_t) + sizeof(int32_t);
+		if ( tag->t_flags & TAG_PACKED )
+			sz += tag->t_len * fixed_size(tag->t_ltype);
+		break;
+	case NBT_TAG_Compound:
+		/* the End tag */
+		sz += sizeof(uint8_t);
+		break;
+	case NBT_TAG_Int_Array:
+		sz += sizeof(int32_t) + (tag->t_len * sizeof(int32_t));
+		break;
+	case NBT_TAG_Long_Array:
+		sz += sizeof(int32_t) + (tag->t_len * sizeof(int64_t));
+		break;
+	default:
+		break;
+	}
+
+	return sz;
+}
+
+/* encoded size of the value of t including any children */
+static size_t tag_size(const struct nbt_tag *t)
+{
+	if ( has_size(t) )
+		return t->t_u.t_cont.size;
+	return value_size(t);
+}
+
+/* size of t as it appears in parent p, with the name if it has one */
+static size_t link_size(const struct nbt_tag *p, const struct nbt_tag *t)
+{
+	if ( p->t_type == NBT_TAG_Compound )
+		return 3 + name_len(t) + tag_size(t);
+	return tag_size(t);
+}
+
+/* The encoding of t changed by delta bytes, fix up the sizes all the
+ * way to the root. None of them match the source buffer any more. Other
+ * than lists and compounds, tags have no cached size so start at the
+ * parent.
+ */
+static void tag_resize(struct nbt_tag *t, ssize_t delta)
+{
+	if ( t && !has_size(t) ) {
+		t->t_flags &= ~TAG_SNAPSHOT;
+		t = tag_parent(t);
+	}
+
+	for(; t; t = tag_parent(t)) {
+		t->t_u.t_cont.size += delta;
+		t->t_u.t_cont.src = 0;
+		t->t_flags &= ~TAG_SNAPSHOT;
+	}
+}
+
+/* true if the encoder has to walk the children of t, the source buffer
+ * can only be copied as-is in to big-endian output
+ */
+static int emit_children(const struct nbt_tag *t, int order)
+{
+	return has_children(t) && (order != ORDER_BE || !t->t_u.t_cont.src);
+}
+
+static int expand(struct nbt_tag *t);
+static void cindex_free(struct nbt_tag *t);
+
 #if 0
 static void hex_dumpf(FILE *f, const uint8_t *tmp, size_t len, size_t llen)
 {
@@ -94,9 +742,9 @@ static void hex_dumpf(FILE *f, const uint8_t *tmp, size_t len, size_t llen)
 }
 #endif
 
-static void do_dump(struct nbt_tag *tag, unsigned int depth)
+const char *nbt_type_name(uint8_t type)
 {
-	static const char * const tstr[] = {
+	static const char * const tstr[NBT_TAG_MAX] = {
 		[NBT_TAG_End] = "End",
 		[NBT_TAG_Byte] = "Byte",
 		[NBT_TAG_Short] = "Short",
@@ -109,21 +757,37 @@ static void do_dump(struct nbt_tag *tag, unsigned int depth)
 		[NBT_TAG_List] = "List",
 		[NBT_TAG_Compound] = "Compound",
 		[NBT_TAG_Int_Array] = "IntArray",
+		[NBT_TAG_Long_Array] = "LongArray",
 	};
-	struct nbt_tag *c;
-	int32_t i;
 
-	printf("%*c Tag_%s '%s'",
-		2 * depth, ' ', tstr[tag->t_type], tag->t_name);
+	if ( type >= NBT_TAG_MAX )
+		return NULL;
+	return tstr[type];
+}
 
-	switch(tag->t_type) {
-	case NBT_TAG_Byte_Array:
-		printf(" = %d bytes\n", tag->t_u.t_blob.len);
+/* print a tags header and value, children are printed by do_dump() */
+static int dump_tag(struct nbt_tag *tag, unsigned int depth)
+{
+	const char *name = "";
+	size_t len = 0;
+
+	if ( !expand(tag) )
+		return 0;
+
+	if ( tag->t_name )
+		name = tag_name(tag, &len);
+
+	printf("%*c Tag_%s '%.*s'",
+		2 * depth, ' ', nbt_type_name(tag->t_type),
+		(int)len, name);
+
+	switch(tag->t_type) {
+	case NBT_TAG_Byte_Array:
+		printf(" = %d bytes\n", tag->t_len);
 #if 0
-		if ( !strcmp(tag->t_name, "SkyLight") ||
-			!strcmp(tag->t_name, "BlockLight") ) {
-			hex_dumpf(stdout, tag->t_u.t_blob.array,
-					tag->t_u.t_blob.len, 16);
+		if ( !strcmp(atom_str(tag->t_name), "SkyLight") ||
+			!strcmp(atom_str(tag->t_name), "BlockLight") ) {
+			hex_dumpf(stdout, tag->t_u.t_blob, tag->t_len, 16);
 		}
 #endif
 		break;
@@ -146,767 +810,3898 @@ static void do_dump(struct nbt_tag *tag, unsigned int depth)
 		printf(" = %F\n", tag->t_u.t_double);
 		break;
 	case NBT_TAG_String:
-		printf(" = '%s'\n", tag->t_u.t_str);
+		printf(" = '%.*s'\n", tag->t_len, tag->t_u.t_str);
 		break;
 	case NBT_TAG_List:
 		printf(" type = %s [%d] = {\n",
-			tstr[tag->t_u.t_list.type],
-			tag->t_u.t_list.len);
-		for(i = 0; i < tag->t_u.t_list.len; i++)
-			do_dump(tag->t_u.t_list.array[i], depth + 1);
-		printf("%*c }\n", depth * 2, ' ');
+			nbt_type_name(tag->t_ltype), tag->t_len);
+		if ( tag->t_flags & TAG_PACKED ) {
+			/* dress each element up as a tag of its own */
+			size_t esz = fixed_size(tag->t_ltype);
+			struct nbt_tag el;
+			int32_t i;
+
+			memset(&el, 0, sizeof(el));
+			el.t_type = tag->t_ltype;
+			for(i = 0; i < tag->t_len; i++) {
+				memcpy(&el.t_u, (uint8_t *)tag->t_u.t_cont.vals +
+					i * esz, esz);
+				dump_tag(&el, depth + 1);
+			}
+			printf("%*c }\n", 2 * depth, ' ');
+		}
 		break;
 	case NBT_TAG_Compound:
 		printf(" {\n");
-		list_for_each_entry(c, &tag->t_u.t_compound, t_list)
-			do_dump(c, depth + 1);
-		printf("%*c }\n", depth * 2, ' ');
 		break;
 	case NBT_TAG_Int_Array:
-		printf(" = %d ints\n", tag->t_u.t_ints.len);
+		printf(" = %d ints\n", tag->t_len);
+		break;
+	case NBT_TAG_Long_Array:
+		printf(" = %d longs\n", tag->t_len);
 		break;
 	default:
 		printf("\n");
 		break;
 	}
+
+	return 1;
+}
+
+static void do_dump(struct nbt_tag *tag)
+{
+	struct stack st;
+	struct frame *f;
+	struct nbt_tag *c;
+
+	stack_init(&st);
+
+	if ( !dump_tag(tag, 0) || !has_children(tag) || !push_tag(&st, tag) )
+		goto out;
+
+	while( (f = stack_top(&st)) ) {
+		c = frame_next(f);
+		if ( NULL == c && frame_hole(f) ) {
+			printf("%*c (empty)\n", 2 * st.top, ' ');
+			f->idx++;
+			continue;
+		}
+		if ( NULL == c ) {
+			stack_pop(&st);
+			printf("%*c }\n", st.top * 2, ' ');
+			continue;
+		}
+
+		if ( !dump_tag(c, st.top) || !has_children(c) )
+			continue;
+		if ( !push_tag(&st, c) )
+			break;
+	}
+
+out:
+	stack_fini(&st);
 }
 
 void nbt_dump(nbt_t nbt)
 {
-	do_dump(&nbt->root, 0);
+	do_dump(nbt->root);
 }
 
-static const uint8_t *decode_tag(struct _nbt *nbt,
-					const uint8_t *ptr, size_t len,
-					struct nbt_tag *tag, int type)
+static char *copy_str(struct _nbt *nbt, const char *str, size_t len)
 {
-	const uint8_t *end = ptr + len, *tmp;
-	const uint8_t *aptr;
-	struct nbt_tag *c;
-	int32_t cnt, alen;
-	int16_t slen;
-	char *str;
+	char *ret;
 
-	if ( type == TAG_NAMED ) {
-		if ( len < 1 )
-			return NULL;
+	ret = mpool_alloc(nbt->mem, len + 1);
+	if ( NULL == ret )
+		return NULL;
 
-		tag->t_type = *ptr;
-		ptr++;
-
-		if ( tag->t_type != NBT_TAG_End ) {
-			if ( ptr + 2 > end )
-				return NULL;
-			slen = be16toh(*(int16_t *)ptr);
-			str = (char *)(ptr + 2);
-			ptr += 2 + slen;
-			if ( slen < 0 || ptr > end )
-				return NULL;
-			if ( asprintf(&tag->t_name, "%.*s", slen, str) < 0 )
-				return NULL;
-		}else{
-			tag->t_name = NULL;
-		}
+	memcpy(ret, str, len);
+	ret[len] = '\0';
+	return ret;
+}
+
+/* convert a value between host and the given order, either direction */
+static ALWAYS_INLINE uint16_t order16(uint16_t v, int order)
+{
+	return (order == ORDER_HOST) ? v : __builtin_bswap16(v);
+}
+
+static ALWAYS_INLINE uint32_t order32(uint32_t v, int order)
+{
+	return (order == ORDER_HOST) ? v : __builtin_bswap32(v);
+}
+
+static ALWAYS_INLINE uint64_t order64(uint64_t v, int order)
+{
+	return (order == ORDER_HOST) ? v : __builtin_bswap64(v);
+}
+
+/* lists of shorts are too rare to bother vectorising */
+static void bswap16_array(void *dst, const void *src, size_t n)
+{
+	uint16_t v;
+	size_t i;
+
+	for(i = 0; i < n; i++) {
+		memcpy(&v, (const uint8_t *)src + i * sizeof(v), sizeof(v));
+		v = __builtin_bswap16(v);
+		memcpy((uint8_t *)dst + i * sizeof(v), &v, sizeof(v));
 	}
+}
 
-	switch(tag->t_type) {
-	case NBT_TAG_End:
+/* Convert an array of n elements of esz bytes from one byte order to
+ * another. The source may be unaligned.
+ */
+static void wire(void *dst, const void *src, size_t n, size_t esz,
+			int from, int to)
+{
+	if ( from == to ) {
+		memmove(dst, src, n * esz);
+		return;
+	}
+
+	switch(esz) {
+	case sizeof(int16_t):
+		bswap16_array(dst, src, n);
 		break;
-	case NBT_TAG_Byte:
-		if ( ptr + sizeof(tag->t_u.t_byte) > end )
-			return NULL;
-		tag->t_u.t_byte = *ptr;
-		ptr += sizeof(tag->t_u.t_byte);
+	case sizeof(int32_t):
+		bswap32_array(dst, src, n);
 		break;
-	case NBT_TAG_Short:
-		if ( ptr + sizeof(tag->t_u.t_short) > end )
-			return NULL;
-		tag->t_u.t_short = be16toh(*(int16_t *)ptr);
-		ptr += sizeof(tag->t_u.t_short);
+	case sizeof(int64_t):
+		bswap64_array(dst, src, n);
 		break;
-	case NBT_TAG_Int:
-		if ( ptr + sizeof(tag->t_u.t_int) > end )
-			return NULL;
-		tag->t_u.t_int = be32toh(*(int32_t *)ptr);
-		ptr += sizeof(tag->t_u.t_int);
+	default:
+		memmove(dst, src, n * esz);
 		break;
+	}
+}
+
+/* Bounds checked readers, shared by the tree decoder and nbt_parse().
+ * Each one advances *pptr past what it read, or returns 0 if the buffer
+ * is too short or the lengths are bad.
+ */
+static int rd_u8(const uint8_t **pptr, const uint8_t *end, uint8_t *val)
+{
+	if ( *pptr + sizeof(*val) > end )
+		return 0;
+	*val = **pptr;
+	*pptr += sizeof(*val);
+	return 1;
+}
+
+static ALWAYS_INLINE int rd16(const uint8_t **pptr, const uint8_t *end,
+				int16_t *val, int order)
+{
+	uint16_t v;
+
+	if ( *pptr + sizeof(v) > end )
+		return 0;
+	memcpy(&v, *pptr, sizeof(v));
+	*val = order16(v, order);
+	*pptr += sizeof(v);
+	return 1;
+}
+
+static ALWAYS_INLINE int rd32(const uint8_t **pptr, const uint8_t *end,
+				int32_t *val, int order)
+{
+	uint32_t v;
+
+	if ( *pptr + sizeof(v) > end )
+		return 0;
+	memcpy(&v, *pptr, sizeof(v));
+	*val = order32(v, order);
+	*pptr += sizeof(v);
+	return 1;
+}
+
+static ALWAYS_INLINE int rd64(const uint8_t **pptr, const uint8_t *end,
+				int64_t *val, int order)
+{
+	uint64_t v;
+
+	if ( *pptr + sizeof(v) > end )
+		return 0;
+	memcpy(&v, *pptr, sizeof(v));
+	*val = order64(v, order);
+	*pptr += sizeof(v);
+	return 1;
+}
+
+static ALWAYS_INLINE int rd_float(const uint8_t **pptr, const uint8_t *end,
+					float *val, int order)
+{
+	int32_t v;
+
+	if ( !rd32(pptr, end, &v, order) )
+		return 0;
+	memcpy(val, &v, sizeof(*val));
+	return 1;
+}
+
+static ALWAYS_INLINE int rd_double(const uint8_t **pptr, const uint8_t *end,
+					double *val, int order)
+{
+	int64_t v;
+
+	if ( !rd64(pptr, end, &v, order) )
+		return 0;
+	memcpy(val, &v, sizeof(*val));
+	return 1;
+}
+
+/* 16bit length prefixed string, as used for names and string tags */
+static ALWAYS_INLINE int rd_str(const uint8_t **pptr, const uint8_t *end,
+				const char **str, int16_t *len, int order)
+{
+	if ( !rd16(pptr, end, len, order) )
+		return 0;
+	if ( *len < 0 || *pptr + *len > end )
+		return 0;
+	*str = (const char *)*pptr;
+	*pptr += *len;
+	return 1;
+}
+
+/* 32bit count followed by cnt elements of esz bytes */
+static ALWAYS_INLINE int rd_array(const uint8_t **pptr, const uint8_t *end,
+				size_t esz, const uint8_t **arr, int32_t *cnt,
+				int order)
+{
+	if ( !rd32(pptr, end, cnt, order) )
+		return 0;
+	if ( *cnt < 0 || (size_t)(end - *pptr) / esz < (size_t)*cnt )
+		return 0;
+	*arr = *pptr;
+	*pptr += *cnt * esz;
+	return 1;
+}
+
+/* list element type and count, empty lists may be of type End */
+static ALWAYS_INLINE int rd_list(const uint8_t **pptr, const uint8_t *end,
+				uint8_t *type, int32_t *cnt, int order)
+{
+	if ( !rd_u8(pptr, end, type) || !rd32(pptr, end, cnt, order) )
+		return 0;
+	if ( *cnt < 0 || *type >= NBT_TAG_MAX )
+		return 0;
+	if ( *type == NBT_TAG_End && *cnt )
+		return 0;
+	return 1;
+}
+
+/* Fire the callbacks for one tag. Lists and compounds just have their
+ * header read and begin callback fired, the caller walks the children.
+ * Callbacks are optional, a NULL visitor means we're skipping a subtree.
+ */
+static int parse_value(const uint8_t **pptr, const uint8_t *end,
+			uint8_t type, const char *name, size_t nlen,
+			const struct nbt_visitor *v, void *priv,
+			uint8_t *ltype, int32_t *cnt)
+{
+	union nbt_value val;
+	const uint8_t *aptr;
+	const char *str;
+	int16_t slen;
+
+	switch(type) {
+	case NBT_TAG_Byte:
+		if ( !rd_u8(pptr, end, &val.b) )
+			return NBT_VISIT_ABORT;
+		goto scalar;
+	case NBT_TAG_Short:
+		if ( !rd16(pptr, end, &val.s, ORDER_BE) )
+			return NBT_VISIT_ABORT;
+		goto scalar;
+	case NBT_TAG_Int:
+		if ( !rd32(pptr, end, &val.i, ORDER_BE) )
+			return NBT_VISIT_ABORT;
+		goto scalar;
 	case NBT_TAG_Long:
-		if ( ptr + sizeof(tag->t_u.t_long) > end )
-			return NULL;
-		tag->t_u.t_long = be64toh(*(int64_t *)ptr);
-		ptr += sizeof(tag->t_u.t_long);
-		break;
+		if ( !rd64(pptr, end, &val.l, ORDER_BE) )
+			return NBT_VISIT_ABORT;
+		goto scalar;
 	case NBT_TAG_Float:
-		if ( ptr + sizeof(tag->t_u.t_float) > end )
-			return NULL;
-		tag->t_u.t_float = (float)be32toh(*(int32_t *)ptr);
-		ptr += sizeof(tag->t_u.t_float);
-		break;
+		if ( !rd_float(pptr, end, &val.f, ORDER_BE) )
+			return NBT_VISIT_ABORT;
+		goto scalar;
 	case NBT_TAG_Double:
-		if ( ptr + sizeof(tag->t_u.t_double) > end )
-			return NULL;
-		tag->t_u.t_double = (double)be64toh(*(int64_t *)ptr);
-		ptr += sizeof(tag->t_u.t_double);
+		if ( !rd_double(pptr, end, &val.d, ORDER_BE) )
+			return NBT_VISIT_ABORT;
+scalar:
+		if ( v && v->scalar )
+			return v->scalar(priv, name, nlen, type, &val);
 		break;
 	case NBT_TAG_Byte_Array:
-		if ( ptr + sizeof(alen) > end )
-			return NULL;
-		alen = be32toh(*(int32_t *)ptr);
-		aptr =  ptr + sizeof(alen);
-		ptr += sizeof(alen) + alen;
-		if ( alen < 0 || ptr > end )
-			return NULL;
-		tag->t_u.t_blob.array = malloc(alen);
-		if ( NULL == tag->t_u.t_blob.array )
-			return NULL;
-		tag->t_u.t_blob.len = alen;
-		memcpy(tag->t_u.t_blob.array, aptr, alen);
-		break;
+		if ( !rd_array(pptr, end, sizeof(uint8_t), &aptr, cnt,
+					ORDER_BE) )
+			return NBT_VISIT_ABORT;
+		goto array;
+	case NBT_TAG_Int_Array:
+		if ( !rd_array(pptr, end, sizeof(int32_t), &aptr, cnt,
+					ORDER_BE) )
+			return NBT_VISIT_ABORT;
+		goto array;
+	case NBT_TAG_Long_Array:
+		if ( !rd_array(pptr, end, sizeof(int64_t), &aptr, cnt,
+					ORDER_BE) )
+			return NBT_VISIT_ABORT;
+		goto array;
 	case NBT_TAG_String:
-		if ( ptr + sizeof(tag->t_u.t_short) > end )
-			return NULL;
-		slen = be16toh(*(int16_t *)ptr);
-		str = (char *)ptr + 2;
-		ptr += sizeof(tag->t_u.t_short) + slen;
-		if ( slen < 0 || ptr > end )
-			return NULL;
-		if ( asprintf(&tag->t_u.t_str, "%.*s", slen, str) < 0 )
-			return NULL;
+		if ( !rd_str(pptr, end, &str, &slen, ORDER_BE) )
+			return NBT_VISIT_ABORT;
+		aptr = (const uint8_t *)str;
+		*cnt = slen;
+array:
+		if ( v && v->array )
+			return v->array(priv, name, nlen, type, aptr, *cnt);
 		break;
 	case NBT_TAG_List:
-		if ( ptr + sizeof(uint8_t) + sizeof(int32_t) > end )
-			return NULL;
+		if ( !rd_list(pptr, end, ltype, cnt, ORDER_BE) )
+			return NBT_VISIT_ABORT;
+		if ( v && v->begin_list )
+			return v->begin_list(priv, name, nlen, *ltype, *cnt);
+		break;
+	case NBT_TAG_Compound:
+		if ( v && v->begin_compound )
+			return v->begin_compound(priv, name, nlen);
+		break;
+	default:
+		return NBT_VISIT_ABORT;
+	}
 
-		tag->t_u.t_list.type = *ptr;
-		ptr++;
-		if ( tag->t_u.t_list.type == NBT_TAG_End ) {
-			printf("Bad list format\n");
-			return NULL;
+	return NBT_VISIT_OK;
+}
+
+static int parse_tag(const uint8_t **pptr, const uint8_t *end,
+			uint8_t type, const char *name, size_t nlen,
+			const struct nbt_visitor *v, void *priv)
+{
+	struct stack st;
+	struct frame *f;
+	uint8_t ltype = NBT_TAG_End;
+	int rc, ret = 0;
+	int32_t cnt = 0;
+	int16_t slen;
+	size_t w;
+
+	stack_init(&st);
+
+	for(;;) {
+		rc = parse_value(pptr, end, type, name, nlen, v, priv,
+				&ltype, &cnt);
+		if ( rc == NBT_VISIT_ABORT )
+			goto out;
+
+		if ( type == NBT_TAG_List || type == NBT_TAG_Compound ) {
+			f = stack_push(&st);
+			if ( NULL == f )
+				goto out;
+			f->type = type;
+			f->ltype = ltype;
+			f->idx = cnt;
+			f->v = (rc == NBT_VISIT_SKIP) ? NULL : v;
+		}
+
+		/* find the next tag, closing any finished containers */
+		for(;;) {
+			f = stack_top(&st);
+			if ( NULL == f ) {
+				ret = 1;
+				goto out;
+			}
+
+			v = f->v;
+			if ( f->type == NBT_TAG_List ) {
+				/* nobody is watching, step over the lot */
+				w = fixed_size(f->ltype);
+				if ( f->idx && NULL == v && w ) {
+					if ( (size_t)(end - *pptr) / w <
+							(size_t)f->idx )
+						goto out;
+					*pptr += f->idx * w;
+					f->idx = 0;
+				}
+				if ( f->idx ) {
+					f->idx--;
+					type = f->ltype;
+					name = NULL;
+					nlen = 0;
+					break;
+				}
+				rc = (v && v->end_list) ?
+					v->end_list(priv) : NBT_VISIT_OK;
+			}else{
+				if ( *pptr < end ) {
+					if ( !rd_u8(pptr, end, &type) )
+						goto out;
+				}else{
+					type = NBT_TAG_End;
+				}
+				if ( type != NBT_TAG_End ) {
+					if ( !rd_str(pptr, end, &name, &slen,
+								ORDER_BE) )
+						goto out;
+					nlen = slen;
+					break;
+				}
+				rc = (v && v->end_compound) ?
+					v->end_compound(priv) : NBT_VISIT_OK;
+			}
+
+			stack_pop(&st);
+			if ( rc == NBT_VISIT_ABORT )
+				goto out;
+		}
+	}
+
+out:
+	stack_fini(&st);
+	return ret;
+}
+
+/* Walk an encoded document firing the visitors callbacks as each tag goes
+ * by, without building a tree. Returns 0 if the buffer is malformed or a
+ * callback aborted.
+ */
+int nbt_parse(const uint8_t *buf, size_t len,
+		const struct nbt_visitor *v, void *priv)
+{
+	const uint8_t *ptr = buf, *end = buf + len;
+	const char *name;
+	int16_t nlen;
+	uint8_t type;
+
+	if ( !rd_u8(&ptr, end, &type) )
+		return 0;
+	if ( type == NBT_TAG_End )
+		return 1;
+	if ( !rd_str(&ptr, end, &name, &nlen, ORDER_BE) )
+		return 0;
+
+	return parse_tag(&ptr, end, type, name, nlen, v, priv);
+}
+
+/* Resumable version of nbt_parse() for documents arriving in pieces, eg.
+ * straight out of inflate. Input is consumed an item at a time, an item
+ * being a tag header plus its value (just the header for lists and
+ * compounds) so that callbacks always see contiguous data. Items which
+ * straddle two feeds are gathered up in the carry buffer, arrays and
+ * strings nobody wants to see are counted off in skip instead.
+ */
+struct _nbt_parser {
+	const struct nbt_visitor *v;
+	void *priv;
+	uint8_t *carry;
+	size_t clen;
+	size_t ccap;
+	uint64_t skip;
+	struct stack st;
+	uint8_t done;
+	uint8_t err;
+};
+
+nbt_parser_t nbt_parser_new(const struct nbt_visitor *v, void *priv)
+{
+	struct _nbt_parser *p;
+
+	p = calloc(1, sizeof(*p));
+	if ( NULL == p )
+		return NULL;
+
+	p->v = v;
+	p->priv = priv;
+	stack_init(&p->st);
+	return p;
+}
+
+static const struct nbt_visitor *parser_visitor(struct _nbt_parser *p)
+{
+	struct frame *f = stack_top(&p->st);
+	return (f) ? f->v : p->v;
+}
+
+/* element size of the array types, strings are arrays of bytes too */
+static size_t array_esz(uint8_t type)
+{
+	switch(type) {
+	case NBT_TAG_Byte_Array:
+	case NBT_TAG_String:
+		return sizeof(uint8_t);
+	case NBT_TAG_Int_Array:
+		return sizeof(int32_t);
+	case NBT_TAG_Long_Array:
+		return sizeof(int64_t);
+	default:
+		return 0;
+	}
+}
+
+static int skip_array(const struct nbt_visitor *v, uint8_t type)
+{
+	return array_esz(type) && (NULL == v || NULL == v->array);
+}
+
+/* Length of the next item. If ptr is too short to know that then the
+ * result is how much is needed to find out, which is more than avail.
+ * Bad lengths are left for parse_value() to choke on.
+ */
+static size_t parser_want(struct _nbt_parser *p, const uint8_t *ptr,
+				size_t avail)
+{
+	const uint8_t *end = ptr + avail, *q;
+	struct frame *f = stack_top(&p->st);
+	size_t n = 0, esz;
+	int32_t cnt;
+	int16_t len;
+	uint8_t type;
+
+	if ( NULL == f || f->type == NBT_TAG_Compound ) {
+		if ( avail < 1 )
+			return 1;
+		type = ptr[0];
+		if ( type == NBT_TAG_End )
+			return 1;
+		q = ptr + 1;
+		if ( !rd16(&q, end, &len, ORDER_BE) )
+			return 3;
+		n = 3 + ((len < 0) ? 0 : len);
+	}else{
+		type = f->ltype;
+	}
+
+	switch(type) {
+	case NBT_TAG_Byte_Array:
+	case NBT_TAG_Int_Array:
+	case NBT_TAG_Long_Array:
+		esz = array_esz(type);
+		q = ptr + n;
+		if ( n > avail || !rd32(&q, end, &cnt, ORDER_BE) )
+			return n + sizeof(cnt);
+		if ( cnt < 0 || skip_array(parser_visitor(p), type) )
+			return n + sizeof(cnt);
+		return n + sizeof(cnt) + cnt * esz;
+	case NBT_TAG_String:
+		q = ptr + n;
+		if ( n > avail || !rd16(&q, end, &len, ORDER_BE) )
+			return n + sizeof(len);
+		if ( len < 0 || skip_array(parser_visitor(p), type) )
+			return n + sizeof(len);
+		return n + sizeof(len) + len;
+	case NBT_TAG_List:
+		return n + sizeof(uint8_t) + sizeof(int32_t);
+	default:
+		return n + fixed_size(type);
+	}
+}
+
+/* pop finished lists and step over unwatched runs of numbers */
+static int parser_settle(struct _nbt_parser *p)
+{
+	const struct nbt_visitor *v;
+	struct frame *f;
+	size_t w;
+	int rc;
+
+	for(;;) {
+		f = stack_top(&p->st);
+		if ( NULL == f ) {
+			p->done = 1;
+			return 1;
+		}
+		if ( f->type != NBT_TAG_List )
+			return 1;
+
+		v = f->v;
+		w = fixed_size(f->ltype);
+		if ( f->idx && NULL == v && w ) {
+			p->skip += (uint64_t)f->idx * w;
+			f->idx = 0;
+		}
+		if ( f->idx )
+			return 1;
+
+		rc = (v && v->end_list) ? v->end_list(p->priv) : NBT_VISIT_OK;
+		stack_pop(&p->st);
+		if ( rc == NBT_VISIT_ABORT )
+			return 0;
+	}
+}
+
+/* consume exactly one item, as sized by parser_want() */
+static int parser_item(struct _nbt_parser *p, const uint8_t *ptr, size_t n)
+{
+	const uint8_t *end = ptr + n;
+	const struct nbt_visitor *v;
+	uint8_t type, ltype = NBT_TAG_End;
+	const char *name = NULL;
+	int16_t nlen = 0, slen;
+	struct frame *f;
+	int32_t cnt = 0;
+	int rc;
+
+	f = stack_top(&p->st);
+	v = parser_visitor(p);
+
+	if ( NULL == f || f->type == NBT_TAG_Compound ) {
+		if ( !rd_u8(&ptr, end, &type) )
+			return 0;
+		if ( type == NBT_TAG_End ) {
+			if ( NULL == f ) {
+				p->done = 1;
+				return 1;
+			}
+			rc = (v && v->end_compound) ?
+				v->end_compound(p->priv) : NBT_VISIT_OK;
+			stack_pop(&p->st);
+			if ( rc == NBT_VISIT_ABORT )
+				return 0;
+			return parser_settle(p);
+		}
+		if ( !rd_str(&ptr, end, &name, &nlen, ORDER_BE) )
+			return 0;
+	}else{
+		f->idx--;
+		type = f->ltype;
+	}
+
+	if ( skip_array(v, type) ) {
+		if ( type == NBT_TAG_String ) {
+			if ( !rd16(&ptr, end, &slen, ORDER_BE) || slen < 0 )
+				return 0;
+			p->skip = slen;
+		}else{
+			if ( !rd32(&ptr, end, &cnt, ORDER_BE) || cnt < 0 )
+				return 0;
+			p->skip = (uint64_t)cnt * array_esz(type);
 		}
+		return parser_settle(p);
+	}
+
+	rc = parse_value(&ptr, end, type, name, nlen, v, p->priv,
+			&ltype, &cnt);
+	if ( rc == NBT_VISIT_ABORT )
+		return 0;
+
+	if ( type == NBT_TAG_List || type == NBT_TAG_Compound ) {
+		f = stack_push(&p->st);
+		if ( NULL == f )
+			return 0;
+		f->type = type;
+		f->ltype = ltype;
+		f->idx = cnt;
+		f->v = (rc == NBT_VISIT_SKIP) ? NULL : v;
+	}
+
+	return parser_settle(p);
+}
+
+/* append up to want bytes of input to the carry buffer */
+static int parser_gather(struct _nbt_parser *p, const uint8_t **pptr,
+				const uint8_t *end, size_t want)
+{
+	size_t n = want - p->clen;
+	uint8_t *new;
+	size_t cap;
+
+	if ( n > (size_t)(end - *pptr) )
+		n = end - *pptr;
+
+	if ( p->clen + n > p->ccap ) {
+		for(cap = (p->ccap) ? p->ccap : 64; cap < p->clen + n; )
+			cap *= 2;
+		new = realloc(p->carry, cap);
+		if ( NULL == new )
+			return 0;
+		p->carry = new;
+		p->ccap = cap;
+	}
+
+	memcpy(p->carry + p->clen, *pptr, n);
+	p->clen += n;
+	*pptr += n;
+	return 1;
+}
+
+/* Feed the next len bytes of the document. Returns 0 if it's malformed
+ * or a callback aborted, after which all further feeds fail. Anything
+ * after the end of the document is ignored.
+ */
+int nbt_parser_feed(nbt_parser_t p, const uint8_t *buf, size_t len)
+{
+	const uint8_t *ptr = buf, *end = buf + len;
+	size_t want, n;
+
+	if ( p->err )
+		return 0;
+
+	for(;;) {
+		if ( p->skip ) {
+			n = end - ptr;
+			if ( p->skip < n )
+				n = p->skip;
+			p->skip -= n;
+			ptr += n;
+			if ( p->skip )
+				return 1;
+		}
+
+		if ( p->done )
+			return 1;
+
+		if ( p->clen ) {
+			for(;;) {
+				want = parser_want(p, p->carry, p->clen);
+				if ( want <= p->clen || ptr == end )
+					break;
+				if ( !parser_gather(p, &ptr, end, want) )
+					goto err;
+			}
+			if ( want > p->clen )
+				return 1;
+			if ( !parser_item(p, p->carry, want) )
+				goto err;
+			p->clen -= want;
+			memmove(p->carry, p->carry + want, p->clen);
+			continue;
+		}
+
+		want = parser_want(p, ptr, end - ptr);
+		if ( want > (size_t)(end - ptr) ) {
+			if ( ptr < end && !parser_gather(p, &ptr, end, want) )
+				goto err;
+			return 1;
+		}
+
+		if ( !parser_item(p, ptr, want) )
+			goto err;
+		ptr += want;
+	}
+
+err:
+	p->err = 1;
+	return 0;
+}
+
+/* Free the parser, returns 1 if a whole document was parsed. As with
+ * nbt_parse() compounds still open at the end of input are closed.
+ */
+int nbt_parser_finish(nbt_parser_t p)
+{
+	static const uint8_t none;
+	const struct nbt_visitor *v;
+	struct frame *f;
+	int rc, ret = 0;
+
+	if ( p->err || p->skip || p->clen )
+		goto out;
+
+	/* as in nbt_parse(), compounds may end with the input, including
+	 * any elements of a list of compounds which are still to come
+	 */
+	while( !p->done ) {
+		f = stack_top(&p->st);
+		if ( NULL == f )
+			goto out;
+		if ( f->type == NBT_TAG_List ) {
+			if ( f->ltype != NBT_TAG_Compound ||
+					!parser_item(p, &none, 0) )
+				goto out;
+			continue;
+		}
+		v = f->v;
+		rc = (v && v->end_compound) ?
+			v->end_compound(p->priv) : NBT_VISIT_OK;
+		stack_pop(&p->st);
+		if ( rc == NBT_VISIT_ABORT || !parser_settle(p) )
+			goto out;
+	}
+
+	ret = 1;
+out:
+	stack_fini(&p->st);
+	free(p->carry);
+	free(p);
+	return ret;
+}
+
+/* A compiled path is a series of steps, each either a compound member
+ * name or a list index, -1 standing for every element. Names point in to
+ * a copy of the path allocated along with the steps.
+ */
+struct path_step {
+	const char *name;
+	size_t nlen;
+	int32_t idx;
+};
+
+struct _nbt_path {
+	unsigned int nsteps;
+	int wild;
+	struct path_step step[0];
+};
+
+#define PATH_ERR	0
+#define PATH_MORE	1
+#define PATH_DONE	2
+
+struct path_eval {
+	const struct _nbt_path *p;
+	const uint8_t *end;
+	nbt_match_t cb;
+	void *priv;
+};
+
+nbt_path_t nbt_path_compile(const char *path)
+{
+	struct _nbt_path *p;
+	struct path_step *st;
+	unsigned int n = 1;
+	unsigned long idx;
+	const char *s;
+	char *e, *names;
+	size_t len;
+
+	/* every dot or bracket starts at most one step */
+	for(s = path; *s; s++)
+		if ( *s == '.' || *s == '[' )
+			n++;
+	if ( n > max_depth )
+		return NULL;
+
+	len = s - path;
+	p = calloc(1, sizeof(*p) + n * sizeof(*p->step) + len + 1);
+	if ( NULL == p )
+		return NULL;
+
+	names = (char *)(p->step + n);
+	memcpy(names, path, len + 1);
+
+	for(s = names;;) {
+		e = (char *)s + strcspn(s, ".[]");
+		if ( e == s || e - s > INT16_MAX )
+			goto err;
+
+		st = &p->step[p->nsteps++];
+		st->name = s;
+		st->nlen = e - s;
+
+		for(s = e; *s == '['; s = e + 1) {
+			st = &p->step[p->nsteps++];
+			if ( s[1] == '*' ) {
+				e = (char *)s + 2;
+				st->idx = -1;
+				p->wild = 1;
+			}else{
+				if ( s[1] < '0' || s[1] > '9' )
+					goto err;
+				idx = strtoul(s + 1, &e, 10);
+				if ( idx > INT32_MAX )
+					goto err;
+				st->idx = idx;
+			}
+			if ( *e != ']' )
+				goto err;
+		}
+
+		if ( *s == '\0' )
+			break;
+		if ( *s != '.' )
+			goto err;
+		s++;
+	}
+
+	return p;
+err:
+	free(p);
+	return NULL;
+}
+
+void nbt_path_free(nbt_path_t p)
+{
+	free(p);
+}
+
+/* Report the value of the given type at *pptr and step past it */
+static int path_match(struct path_eval *e, const uint8_t **pptr, uint8_t type)
+{
+	const uint8_t *data = *pptr;
+	const char *str;
+	int16_t slen;
+	int32_t cnt;
+	size_t len;
+
+	switch(type) {
+	case NBT_TAG_Byte_Array:
+		if ( !rd_array(pptr, e->end, sizeof(uint8_t), &data, &cnt,
+					ORDER_BE) )
+			return PATH_ERR;
+		len = *pptr - data;
+		break;
+	case NBT_TAG_Int_Array:
+		if ( !rd_array(pptr, e->end, sizeof(int32_t), &data, &cnt,
+					ORDER_BE) )
+			return PATH_ERR;
+		len = *pptr - data;
+		break;
+	case NBT_TAG_Long_Array:
+		if ( !rd_array(pptr, e->end, sizeof(int64_t), &data, &cnt,
+					ORDER_BE) )
+			return PATH_ERR;
+		len = *pptr - data;
+		break;
+	case NBT_TAG_String:
+		if ( !rd_str(pptr, e->end, &str, &slen, ORDER_BE) )
+			return PATH_ERR;
+		data = (const uint8_t *)str;
+		len = slen;
+		break;
+	default:
+		if ( !parse_tag(pptr, e->end, type, NULL, 0, NULL, NULL) )
+			return PATH_ERR;
+		len = *pptr - data;
+		break;
+	}
+
+	if ( !(*e->cb)(e->priv, type, data, len) )
+		return PATH_DONE;
+
+	/* without a wildcard there can only be one match */
+	return (e->p->wild) ? PATH_MORE : PATH_DONE;
+}
+
+/* Run steps i onwards against the value of the given type at *pptr,
+ * leaving *pptr past the value unless we're done. This recurses once per
+ * step, which compile bounds by max_depth, the input has no say in it.
+ */
+static int path_walk(struct path_eval *e, unsigned int i,
+			const uint8_t **pptr, uint8_t type)
+{
+	const struct path_step *st;
+	const char *name;
+	uint8_t ctype;
+	int16_t nlen;
+	int32_t cnt, n;
+	size_t w;
+	int rc;
+
+	if ( i == e->p->nsteps )
+		return path_match(e, pptr, type);
+
+	st = &e->p->step[i];
+
+	if ( st->name ) {
+		if ( type != NBT_TAG_Compound )
+			goto skip;
+
+		for(;;) {
+			/* tolerate a missing End at the end of the buffer */
+			if ( *pptr >= e->end )
+				return PATH_MORE;
+			if ( !rd_u8(pptr, e->end, &ctype) )
+				return PATH_ERR;
+			if ( ctype == NBT_TAG_End )
+				return PATH_MORE;
+			if ( !rd_str(pptr, e->end, &name, &nlen, ORDER_BE) )
+				return PATH_ERR;
+
+			if ( (size_t)nlen == st->nlen &&
+					!memcmp(name, st->name, nlen) ) {
+				rc = path_walk(e, i + 1, pptr, ctype);
+				if ( rc != PATH_MORE )
+					return rc;
+			}else if ( !parse_tag(pptr, e->end, ctype,
+						NULL, 0, NULL, NULL) ) {
+				return PATH_ERR;
+			}
+		}
+	}
+
+	if ( type != NBT_TAG_List )
+		goto skip;
+	if ( !rd_list(pptr, e->end, &ctype, &cnt, ORDER_BE) )
+		return PATH_ERR;
+
+	/* go straight to the element if they're all the same size */
+	w = fixed_size(ctype);
+	if ( w && st->idx >= 0 ) {
+		if ( (size_t)(e->end - *pptr) / w < (size_t)cnt )
+			return PATH_ERR;
+		if ( st->idx < cnt ) {
+			const uint8_t *ptr = *pptr + st->idx * w;
+			rc = path_walk(e, i + 1, &ptr, ctype);
+			if ( rc != PATH_MORE )
+				return rc;
+		}
+		*pptr += cnt * w;
+		return PATH_MORE;
+	}
+
+	for(n = 0; n < cnt; n++) {
+		if ( st->idx < 0 || st->idx == n ) {
+			rc = path_walk(e, i + 1, pptr, ctype);
+			if ( rc != PATH_MORE )
+				return rc;
+		}else if ( !parse_tag(pptr, e->end, ctype,
+					NULL, 0, NULL, NULL) ) {
+			return PATH_ERR;
+		}
+	}
+
+	return PATH_MORE;
+skip:
+	if ( !parse_tag(pptr, e->end, type, NULL, 0, NULL, NULL) )
+		return PATH_ERR;
+	return PATH_MORE;
+}
+
+/* Run a compiled path over an encoded document calling cb for every
+ * match, without building a tree. Returns 0 if the buffer is malformed,
+ * as far as it had to be looked at.
+ */
+int nbt_path_eval(nbt_path_t p, const uint8_t *buf, size_t len,
+			nbt_match_t cb, void *priv)
+{
+	const uint8_t *ptr = buf;
+	struct path_eval e = {
+		.p = p,
+		.end = buf + len,
+		.cb = cb,
+		.priv = priv,
+	};
+	const char *name;
+	int16_t nlen;
+	uint8_t type;
+
+	if ( !rd_u8(&ptr, e.end, &type) )
+		return 0;
+	if ( type == NBT_TAG_End )
+		return 1;
+	if ( !rd_str(&ptr, e.end, &name, &nlen, ORDER_BE) )
+		return 0;
+
+	return path_walk(&e, 0, &ptr, type) != PATH_ERR;
+}
+
+struct path_first {
+	const uint8_t *data;
+	size_t len;
+	uint8_t type;
+	int found;
+};
+
+static int first_cb(void *priv, uint8_t type, const uint8_t *data, size_t len)
+{
+	struct path_first *f = priv;
+
+	f->data = data;
+	f->len = len;
+	f->type = type;
+	f->found = 1;
+	return 0;
+}
+
+/* Returns 1 and fills in the first match, or 0 if there was none */
+int nbt_path_first(nbt_path_t p, const uint8_t *buf, size_t len,
+			uint8_t *type, const uint8_t **data, size_t *dlen)
+{
+	struct path_first f = { .found = 0 };
+
+	if ( !nbt_path_eval(p, buf, len, first_cb, &f) || !f.found )
+		return 0;
+
+	*type = f.type;
+	*data = f.data;
+	*dlen = f.len;
+	return 1;
+}
+
+/* Make the children array of t fit n of them. Entries past the current
+ * length are left for the caller to fill in, those past n are dropped.
+ */
+static int kids_resize(struct _nbt *nbt, struct nbt_tag *t, uint32_t n)
+{
+	struct nbt_kids *old = t->t_u.t_cont.kids, *new = NULL;
+	uint32_t len = t->t_len;
+
+	if ( old && n && list_cap(n) == list_cap(len) )
+		return 1;
+
+	if ( n ) {
+		new = mpool_alloc(nbt->mem, kids_size(n));
+		if ( NULL == new )
+			return 0;
+		new->idx = NULL;
+		if ( old ) {
+			new->idx = old->idx;
+			memcpy(new->tag, old->tag,
+				((n < len) ? n : len) * sizeof(new->tag[0]));
+		}
+	}else{
+		cindex_free(t);
+	}
+
+	if ( old )
+		mpool_return(nbt->mem, old, kids_size(len));
+	t->t_u.t_cont.kids = new;
+	return 1;
+}
+
+/* Decode one tags value. Lists and compounds just have their header read
+ * here, decode_tree() walks the children. If lazy is set then lists and
+ * compounds are validated and remembered for expand() instead.
+ */
+static ALWAYS_INLINE int decode_value(struct _nbt *nbt, const uint8_t **pptr,
+				const uint8_t *end, struct nbt_tag *tag,
+				int lazy, int order)
+{
+	const uint8_t *aptr;
+	int32_t alen;
+	const char *str;
+	int16_t slen;
+	size_t esz;
+
+	switch(tag->t_type) {
+	case NBT_TAG_End:
+		break;
+	case NBT_TAG_Byte:
+		if ( !rd_u8(pptr, end, &tag->t_u.t_byte) )
+			return 0;
+		break;
+	case NBT_TAG_Short:
+		if ( !rd16(pptr, end, &tag->t_u.t_short, order) )
+			return 0;
+		break;
+	case NBT_TAG_Int:
+		if ( !rd32(pptr, end, &tag->t_u.t_int, order) )
+			return 0;
+		break;
+	case NBT_TAG_Long:
+		if ( !rd64(pptr, end, &tag->t_u.t_long, order) )
+			return 0;
+		break;
+	case NBT_TAG_Float:
+		if ( !rd_float(pptr, end, &tag->t_u.t_float, order) )
+			return 0;
+		break;
+	case NBT_TAG_Double:
+		if ( !rd_double(pptr, end, &tag->t_u.t_double, order) )
+			return 0;
+		break;
+	case NBT_TAG_Byte_Array:
+		if ( !rd_array(pptr, end, sizeof(uint8_t), &aptr, &alen,
+					order) )
+			return 0;
+		tag->t_len = alen;
+		if ( nbt->borrow ) {
+			tag->t_u.t_blob = (uint8_t *)aptr;
+			tag->t_flags |= TAG_DATA_BORROWED;
+			break;
+		}
+		tag->t_u.t_blob = mpool_alloc(nbt->mem, alen);
+		if ( NULL == tag->t_u.t_blob )
+			return 0;
+		memcpy(tag->t_u.t_blob, aptr, alen);
+		break;
+	case NBT_TAG_String:
+		if ( !rd_str(pptr, end, &str, &slen, order) )
+			return 0;
+		tag->t_len = slen;
+		if ( nbt->borrow ) {
+			tag->t_u.t_str = (char *)str;
+			tag->t_flags |= TAG_DATA_BORROWED;
+			break;
+		}
+		tag->t_u.t_str = copy_str(nbt, str, slen);
+		if ( NULL == tag->t_u.t_str )
+			return 0;
+		break;
+	case NBT_TAG_List:
+		if ( lazy )
+			goto defer;
+		if ( !rd_list(pptr, end, &tag->t_ltype, &alen, order) )
+			return 0;
+
+		esz = fixed_size(tag->t_ltype);
+		if ( esz ) {
+			if ( (size_t)(end - *pptr) / esz < (size_t)alen )
+				return 0;
+			tag->t_u.t_cont.vals = mpool_alloc(nbt->mem,
+						list_cap(alen) * esz);
+			if ( NULL == tag->t_u.t_cont.vals )
+				return 0;
+			wire(tag->t_u.t_cont.vals, *pptr, alen, esz,
+				order, ORDER_HOST);
+			*pptr += alen * esz;
+			tag->t_len = alen;
+			tag->t_flags |= TAG_PACKED;
+			break;
+		}
+
+		if ( (size_t)(end - *pptr) / min_size(tag->t_ltype) <
+				(size_t)alen )
+			return 0;
+		tag->t_len = 0;
+		tag->t_u.t_cont.kids = NULL;
+		if ( !kids_resize(nbt, tag, alen) )
+			return 0;
+		tag->t_len = alen;
+		break;
+	case NBT_TAG_Compound:
+		if ( lazy )
+			goto defer;
+		tag->t_len = 0;
+		tag->t_u.t_cont.kids = NULL;
+		break;
+	case NBT_TAG_Int_Array:
+		if ( !rd_array(pptr, end, sizeof(int32_t), &aptr, &alen,
+					order) )
+			return 0;
+		tag->t_len = alen;
+		if ( nbt->borrow ) {
+			tag->t_u.t_ints = (int32_t *)aptr;
+			tag->t_flags |= TAG_DATA_BORROWED;
+			break;
+		}
+		tag->t_u.t_ints = mpool_alloc(nbt->mem, alen * sizeof(int32_t));
+		if ( NULL == tag->t_u.t_ints )
+			return 0;
+		wire(tag->t_u.t_ints, aptr, alen, sizeof(int32_t),
+			order, ORDER_HOST);
+		break;
+	case NBT_TAG_Long_Array:
+		if ( !rd_array(pptr, end, sizeof(int64_t), &aptr, &alen,
+					order) )
+			return 0;
+		tag->t_len = alen;
+		if ( nbt->borrow ) {
+			tag->t_u.t_longs = (int64_t *)aptr;
+			tag->t_flags |= TAG_DATA_BORROWED;
+			break;
+		}
+		tag->t_u.t_longs = mpool_alloc(nbt->mem, alen * sizeof(int64_t));
+		if ( NULL == tag->t_u.t_longs )
+			return 0;
+		wire(tag->t_u.t_longs, aptr, alen, sizeof(int64_t),
+			order, ORDER_HOST);
+		break;
+	default:
+		return 0;
+	}
+
+	return 1;
+
+defer:
+	aptr = *pptr;
+	if ( !parse_tag(pptr, end, tag->t_type, NULL, 0, NULL, NULL) )
+		return 0;
+	tag->t_u.t_lazy.ptr = aptr;
+	tag->t_u.t_lazy.len = *pptr - aptr;
+	tag->t_flags |= TAG_LAZY;
+
+	/* list headers are cheap to read now and save expanding later */
+	tag->t_len = 0;
+	if ( tag->t_type == NBT_TAG_List )
+		rd_list(&aptr, end, &tag->t_ltype, &tag->t_len, order);
+	return 1;
+}
+
+/* lists and compounds start off at the size of their value, and with
+ * where it came from if the buffer is borrowed
+ */
+static void size_init(struct _nbt *nbt, struct nbt_tag *t,
+			const uint8_t *vptr)
+{
+	if ( !has_size(t) )
+		return;
+	t->t_u.t_cont.size = value_size(t);
+	t->t_u.t_cont.src = (nbt->borrow) ? vptr - nbt->src + 1 : 0;
+}
+
+/* Compound members are collected here until the End, so that each
+ * compound gets an array of the right size in one go. Each open compound
+ * has its first member at f->idx.
+ */
+#define PENDING_INLINE	128
+
+struct pending {
+	struct nbt_tag **tag;
+	uint32_t cnt;
+	uint32_t cap;
+	struct nbt_tag *inl[PENDING_INLINE];
+};
+
+static void pending_init(struct pending *p)
+{
+	p->tag = p->inl;
+	p->cnt = 0;
+	p->cap = PENDING_INLINE;
+}
+
+static void pending_fini(struct pending *p)
+{
+	if ( p->tag != p->inl )
+		free(p->tag);
+}
+
+static int pending_add(struct pending *p, struct nbt_tag *c)
+{
+	struct nbt_tag **new;
+
+	if ( p->cnt == p->cap ) {
+		new = malloc(p->cap * 2 * sizeof(*new));
+		if ( NULL == new )
+			return 0;
+		memcpy(new, p->tag, p->cnt * sizeof(*new));
+		pending_fini(p);
+		p->tag = new;
+		p->cap *= 2;
+	}
+
+	p->tag[p->cnt++] = c;
+	return 1;
+}
+
+/* hand compound t the members from base onwards */
+static int pending_flush(struct _nbt *nbt, struct pending *p,
+				struct nbt_tag *t, uint32_t base)
+{
+	uint32_t n = p->cnt - base;
+
+	if ( !kids_resize(nbt, t, n) )
+		return 0;
+	if ( n ) {
+		memcpy(t->t_u.t_cont.kids->tag, p->tag + base,
+			n * sizeof(p->tag[0]));
+	}
+	t->t_len = n;
+	p->cnt = base;
+	return 1;
+}
+
+/* Decode the value of tag and everything below it, in lazy mode the
+ * children of tag are left lazy. Sizes are summed on the way back up.
+ */
+static ALWAYS_INLINE const uint8_t *decode_tree(struct _nbt *nbt,
+					const uint8_t *ptr, const uint8_t *end,
+					struct nbt_tag *tag, int order)
+{
+	const uint8_t *vptr = ptr;
+	struct nbt_tag *t, *c;
+	struct pending pend;
+	struct stack st;
+	struct frame *f;
+	const char *str;
+	int16_t slen;
+
+	stack_init(&st);
+	pending_init(&pend);
+
+	if ( !decode_value(nbt, &ptr, end, tag, 0, order) )
+		goto err;
+	size_init(nbt, tag, vptr);
+	if ( has_children(tag) && !push_tag(&st, tag) )
+		goto err;
+	if ( tag->t_type == NBT_TAG_Compound )
+		stack_top(&st)->idx = 0;
+
+	while( (f = stack_top(&st)) ) {
+		t = f->tag;
+		if ( t->t_type == NBT_TAG_List ) {
+			if ( f->idx >= t->t_len )
+				goto pop;
+
+			c = hgang_alloc0(nbt->nodes);
+			if ( NULL == c )
+				goto err;
+			c->t_type = t->t_ltype;
+			t->t_u.t_cont.kids->tag[f->idx++] = c;
+		}else{
+			/* tolerate a missing End at the end of the buffer,
+			 * but then the source can't be copied as-is
+			 */
+			if ( ptr >= end ) {
+				tag_resize(t, 0);
+				goto pop;
+			}
+
+			c = hgang_alloc0(nbt->nodes);
+			if ( NULL == c )
+				goto err;
+			if ( !rd_u8(&ptr, end, &c->t_type) )
+				goto err;
+			if ( c->t_type == NBT_TAG_End ) {
+				hgang_return(nbt->nodes, c);
+				goto pop;
+			}
+
+			if ( !rd_str(&ptr, end, &str, &slen, order) )
+				goto err;
+			c->t_name = decode_name(nbt, str, slen);
+			if ( NBT_ATOM_NONE == c->t_name )
+				goto err;
+			if ( !pending_add(&pend, c) )
+				goto err;
+		}
+
+		set_parent(c, t);
+		vptr = ptr;
+		if ( !decode_value(nbt, &ptr, end, c, nbt->lazy, order) )
+			goto err;
+		size_init(nbt, c, vptr);
+
+		if ( has_children(c) ) {
+			if ( !push_tag(&st, c) )
+				goto err;
+			if ( c->t_type == NBT_TAG_Compound )
+				stack_top(&st)->idx = pend.cnt;
+		}else{
+			t->t_u.t_cont.size += link_size(t, c);
+		}
+		continue;
+pop:
+		if ( t->t_type == NBT_TAG_Compound &&
+				!pending_flush(nbt, &pend, t, f->idx) )
+			goto err;
+		stack_pop(&st);
+		f = stack_top(&st);
+		if ( f )
+			f->tag->t_u.t_cont.size += link_size(f->tag, t);
+	}
+
+	pending_fini(&pend);
+	stack_fini(&st);
+	return ptr;
+err:
+	pending_fini(&pend);
+	stack_fini(&st);
+	return NULL;
+}
+
+/* one copy of the decoder for each byte order */
+#define DECODER(name, order) \
+static const uint8_t *name(struct _nbt *nbt, const uint8_t *ptr, \
+				const uint8_t *end, struct nbt_tag *tag) \
+{ \
+	return decode_tree(nbt, ptr, end, tag, order); \
+}
+
+DECODER(decode_tree_be, ORDER_BE)
+DECODER(decode_tree_le, ORDER_LE)
+
+/* Decode the children of a lazy list or compound */
+static int expand(struct nbt_tag *t)
+{
+	struct nbt_lazy lazy;
+	uint8_t ltype;
+	int32_t len;
+
+	if ( !(t->t_flags & TAG_LAZY) )
+		return 1;
+
+	lazy = t->t_u.t_lazy;
+	len = t->t_len;
+	ltype = t->t_ltype;
+	t->t_flags &= ~TAG_LAZY;
+	if ( NULL == decode_tree_be(tag_nbt(t), lazy.ptr,
+				lazy.ptr + lazy.len, t) ) {
+		t->t_u.t_lazy = lazy;
+		t->t_len = len;
+		t->t_ltype = ltype;
+		t->t_flags |= TAG_LAZY;
+		return 0;
+	}
+
+	/* only if the End was missing */
+	if ( t->t_u.t_cont.size != lazy.len )
+		tag_resize(tag_parent(t),
+			(ssize_t)t->t_u.t_cont.size - (ssize_t)lazy.len);
+
+	return 1;
+}
+
+/* Take a private copy of a borrowed payload, in native order. This alone
+ * doesn't change the value so the source buffer is still good to encode
+ * from.
+ */
+static int unborrow(struct nbt_tag *t)
+{
+	struct _nbt *nbt;
+	void *buf;
+	size_t len;
+
+	if ( !(t->t_flags & TAG_DATA_BORROWED) )
+		return 1;
+
+	nbt = tag_nbt(t);
+
+	switch(t->t_type) {
+	case NBT_TAG_Byte_Array:
+		len = t->t_len;
+		buf = mpool_alloc(nbt->mem, len);
+		if ( NULL == buf )
+			return 0;
+		memcpy(buf, t->t_u.t_blob, len);
+		t->t_u.t_blob = buf;
+		break;
+	case NBT_TAG_String:
+		buf = copy_str(nbt, t->t_u.t_str, t->t_len);
+		if ( NULL == buf )
+			return 0;
+		t->t_u.t_str = buf;
+		break;
+	case NBT_TAG_Int_Array:
+		len = t->t_len * sizeof(int32_t);
+		buf = mpool_alloc(nbt->mem, len);
+		if ( NULL == buf )
+			return 0;
+		wire(buf, t->t_u.t_ints, t->t_len, sizeof(int32_t),
+			ORDER_BE, ORDER_HOST);
+		t->t_u.t_ints = buf;
+		break;
+	case NBT_TAG_Long_Array:
+		len = t->t_len * sizeof(int64_t);
+		buf = mpool_alloc(nbt->mem, len);
+		if ( NULL == buf )
+			return 0;
+		wire(buf, t->t_u.t_longs, t->t_len, sizeof(int64_t),
+			ORDER_BE, ORDER_HOST);
+		t->t_u.t_longs = buf;
+		break;
+	default:
+		break;
+	}
+
+	t->t_flags &= ~TAG_DATA_BORROWED;
+	return 1;
+}
+
+/* Hand a payload back to the pool. Borrowed and lazy ones aren't ours.
+ * List arrays are (at least) list_cap() of their length.
+ */
+static void free_payload(struct _nbt *nbt, struct nbt_tag *t)
+{
+	if ( t->t_flags & (TAG_DATA_BORROWED|TAG_LAZY) )
+		return;
+
+	switch(t->t_type) {
+	case NBT_TAG_Byte_Array:
+		mpool_return(nbt->mem, t->t_u.t_blob, t->t_len);
+		break;
+	case NBT_TAG_String:
+		mpool_return(nbt->mem, t->t_u.t_str, t->t_len + 1);
+		break;
+	case NBT_TAG_Int_Array:
+		mpool_return(nbt->mem, t->t_u.t_ints,
+				t->t_len * sizeof(int32_t));
+		break;
+	case NBT_TAG_Long_Array:
+		mpool_return(nbt->mem, t->t_u.t_longs,
+				t->t_len * sizeof(int64_t));
+		break;
+	case NBT_TAG_List:
+		if ( t->t_flags & TAG_PACKED ) {
+			mpool_return(nbt->mem, t->t_u.t_cont.vals,
+					list_cap(t->t_len) *
+					fixed_size(t->t_ltype));
+			break;
+		}
+		/* fall through */
+	case NBT_TAG_Compound:
+		cindex_free(t);
+		if ( t->t_u.t_cont.kids ) {
+			mpool_return(nbt->mem, t->t_u.t_cont.kids,
+					kids_size(t->t_len));
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/* next child to free, skipping empty list slots */
+static struct nbt_tag *free_next(struct frame *f)
+{
+	struct nbt_tag *t = f->tag, *c;
+
+	while( f->idx < t->t_len ) {
+		c = t->t_u.t_cont.kids->tag[f->idx++];
+		if ( c )
+			return c;
+	}
+	return NULL;
+}
+
+static void free_node(struct _nbt *nbt, struct nbt_tag *t)
+{
+	free_payload(nbt, t);
+	hgang_return(nbt->nodes, t);
+}
+
+/* Return an unlinked tag and everything under it to the pools. Anything
+ * deeper than we can walk is just abandoned.
+ */
+static void free_tree(struct nbt_tag *t)
+{
+	struct _nbt *nbt = tag_nbt(t);
+	struct stack st;
+	struct frame *f;
+	struct nbt_tag *c;
+
+	stack_init(&st);
+
+	if ( !has_children(t) || !push_tag(&st, t) ) {
+		free_node(nbt, t);
+		goto out;
+	}
+
+	while( (f = stack_top(&st)) ) {
+		c = free_next(f);
+		if ( NULL == c ) {
+			c = f->tag;
+			stack_pop(&st);
+			free_node(nbt, c);
+			continue;
+		}
+
+		if ( has_children(c) && push_tag(&st, c) )
+			continue;
+		free_node(nbt, c);
+	}
+
+out:
+	stack_fini(&st);
+}
+
+/* true if t is a or is somewhere beneath it */
+static int within(const struct nbt_tag *t, const struct nbt_tag *a)
+{
+	for(; t; t = tag_parent(t)) {
+		if ( t == a )
+			return 1;
+	}
+	return 0;
+}
+
+/* Take a private copy of a borrowed payload so that it may be written to */
+static int privatize(struct nbt_tag *t)
+{
+	/* and they promised not to write to this one */
+	if ( frozen(t) )
+		return 1;
+
+	/* caller is about to get a writable pointer */
+	tag_resize(t, 0);
+	return unborrow(t);
+}
+
+/* Give each element of a packed list a tag of its own */
+static int unpack(struct nbt_tag *t)
+{
+	struct _nbt *nbt;
+	struct nbt_kids *kids = NULL;
+	struct nbt_tag *c;
+	uint32_t pidx;
+	size_t esz;
+	int32_t i;
+
+	if ( !(t->t_flags & TAG_PACKED) )
+		return 1;
+
+	nbt = tag_nbt(t);
+	esz = fixed_size(t->t_ltype);
+	pidx = hgang_index(nbt->nodes, t);
+
+	if ( t->t_len ) {
+		kids = mpool_alloc(nbt->mem, kids_size(t->t_len));
+		if ( NULL == kids )
+			return 0;
+		kids->idx = NULL;
+	}
+
+	/* t is left packed until every element is made */
+	for(i = 0; i < t->t_len; i++) {
+		c = hgang_alloc0(nbt->nodes);
+		if ( NULL == c )
+			goto err;
+		c->t_type = t->t_ltype;
+		memcpy(&c->t_u, (uint8_t *)t->t_u.t_cont.vals + i * esz, esz);
+		c->t_parent = pidx;
+		kids->tag[i] = c;
+	}
+
+	free_payload(nbt, t);
+	t->t_u.t_cont.kids = kids;
+	t->t_flags &= ~TAG_PACKED;
+	return 1;
+
+err:
+	while( i-- > 0 )
+		hgang_return(nbt->nodes, kids->tag[i]);
+	mpool_return(nbt->mem, kids, kids_size(t->t_len));
+	return 0;
+}
+
+/* The reverse, the element tags are free'd. Empty slots become zero */
+static int pack(struct nbt_tag *t)
+{
+	struct _nbt *nbt;
+	struct nbt_tag *c;
+	uint8_t *vals;
+	size_t esz;
+	int32_t i;
+
+	if ( t->t_flags & TAG_PACKED )
+		return 1;
+
+	esz = fixed_size(t->t_ltype);
+	if ( !esz )
+		return 0;
+
+	nbt = tag_nbt(t);
+	vals = mpool_alloc(nbt->mem, list_cap(t->t_len) * esz);
+	if ( NULL == vals )
+		return 0;
+
+	for(i = 0; i < t->t_len; i++) {
+		c = t->t_u.t_cont.kids->tag[i];
+		if ( c ) {
+			memcpy(vals + i * esz, &c->t_u, esz);
+			free_node(nbt, c);
+		}else{
+			memset(vals + i * esz, 0, esz);
+		}
+	}
+
+	free_payload(nbt, t);
+	t->t_u.t_cont.vals = vals;
+	t->t_flags |= TAG_PACKED;
+	tag_resize(t, (ssize_t)value_size(t) - (ssize_t)t->t_u.t_cont.size);
+	return 1;
+}
+
+nbt_tag_t nbt_root_tag(nbt_t nbt)
+{
+	return nbt->root;
+}
+
+int nbt_byte_get(nbt_tag_t t, uint8_t *val)
+{
+	if (NULL == t || t->t_type != NBT_TAG_Byte)
+		return 0;
+	*val = t->t_u.t_byte;
+	return 1;
+}
+
+int nbt_short_get(nbt_tag_t t, int16_t *val)
+{
+	if (NULL == t || t->t_type != NBT_TAG_Short)
+		return 0;
+	*val = t->t_u.t_short;
+	return 1;
+}
+
+int nbt_int_get(nbt_tag_t t, int32_t *val)
+{
+	if (NULL == t || t->t_type != NBT_TAG_Int)
+		return 0;
+	*val = t->t_u.t_int;
+	return 1;
+}
+
+int nbt_long_get(nbt_tag_t t, int64_t *val)
+{
+	if (NULL == t || t->t_type != NBT_TAG_Long)
+		return 0;
+	*val = t->t_u.t_long;
+	return 1;
+}
+
+int nbt_bytearray_get(nbt_tag_t t, uint8_t **bytes, size_t *sz)
+{
+	if (NULL == t || t->t_type != NBT_TAG_Byte_Array)
+		return 0;
+	if ( !privatize(t) )
+		return 0;
+	*bytes = payload(t);
+	*sz = (size_t)t->t_len;
+	return 1;
+}
+
+int nbt_intarray_get(nbt_tag_t t, int32_t **ints, unsigned int *num)
+{
+	if (NULL == t || t->t_type != NBT_TAG_Int_Array)
+		return 0;
+	if ( !privatize(t) )
+		return 0;
+	*ints = payload(t);
+	*num = t->t_len;
+	return 1;
+}
+
+int nbt_longarray_get(nbt_tag_t t, int64_t **longs, unsigned int *num)
+{
+	if (NULL == t || t->t_type != NBT_TAG_Long_Array)
+		return 0;
+	if ( !privatize(t) )
+		return 0;
+	*longs = payload(t);
+	*num = t->t_len;
+	return 1;
+}
+
+int nbt_string_get(nbt_tag_t t, char **val)
+{
+	if (NULL == t || t->t_type != NBT_TAG_String)
+		return 0;
+	if ( !privatize(t) )
+		return 0;
+	*val = payload(t);
+	return 1;
+}
+
+int nbt_bytearray_peek(nbt_tag_t t, const uint8_t **bytes, size_t *sz)
+{
+	if (NULL == t || t->t_type != NBT_TAG_Byte_Array)
+		return 0;
+	*bytes = payload(t);
+	*sz = (size_t)t->t_len;
+	return 1;
+}
+
+/* these have to be converted to native order first */
+int nbt_intarray_peek(nbt_tag_t t, const int32_t **ints, unsigned int *num)
+{
+	if (NULL == t || t->t_type != NBT_TAG_Int_Array)
+		return 0;
+	if ( !unborrow(t) )
+		return 0;
+	*ints = payload(t);
+	*num = t->t_len;
+	return 1;
+}
+
+int nbt_longarray_peek(nbt_tag_t t, const int64_t **longs, unsigned int *num)
+{
+	if (NULL == t || t->t_type != NBT_TAG_Long_Array)
+		return 0;
+	if ( !unborrow(t) )
+		return 0;
+	*longs = payload(t);
+	*num = t->t_len;
+	return 1;
+}
+
+int nbt_string_peek(nbt_tag_t t, const char **val, size_t *len)
+{
+	if (NULL == t || t->t_type != NBT_TAG_String)
+		return 0;
+	*val = payload(t);
+	*len = (size_t)t->t_len;
+	return 1;
+}
+
+nbt_tag_t nbt_list_get(nbt_tag_t t, unsigned idx)
+{
+	if (NULL == t || t->t_type != NBT_TAG_List)
+		return 0;
+	if ( frozen(t) )
+		return frozen_kid(t, idx);
+	if ( !expand(t) || !unpack(t) )
+		return 0;
+	if ( idx >= (unsigned)t->t_len )
+		return 0;
+	return t->t_u.t_cont.kids->tag[idx];
+}
+
+int nbt_list_get_size(nbt_tag_t t)
+{
+	if (NULL == t || t->t_type != NBT_TAG_List)
+		return -1;
+
+	/* lazy lists have the count too, no need to expand */
+	return t->t_len;
+}
+
+/* atoms are sequential, spread them out over the table */
+static uint32_t atom_hash(nbt_atom_t a)
+{
+	return a * 2654435761U;
+}
+
+static void cindex_insert(struct nbt_cindex *idx, struct nbt_tag *c)
+{
+	uint32_t i;
+
+	for(i = atom_hash(c->t_name) & idx->mask; idx->slot[i];
+			i = (i + 1) & idx->mask)
+		/* nothing */;
+
+	idx->slot[i] = c;
+	idx->cnt++;
+}
+
+static void cindex_remove(struct nbt_cindex *idx, struct nbt_tag *c)
+{
+	uint32_t i, j, k;
+
+	for(i = atom_hash(c->t_name) & idx->mask; idx->slot[i] != c;
+			i = (i + 1) & idx->mask)
+		assert(idx->slot[i]);
+
+	/* shift back any following entries which would no longer be
+	 * reachable from their home slot
+	 */
+	for(j = i;;) {
+		idx->slot[i] = NULL;
+		do {
+			j = (j + 1) & idx->mask;
+			if ( NULL == idx->slot[j] )
+				goto out;
+			k = atom_hash(idx->slot[j]->t_name) & idx->mask;
+		}while( (i <= j) ? (i < k && k <= j) : (i < k || k <= j) );
+
+		idx->slot[i] = idx->slot[j];
+		i = j;
+	}
+out:
+	idx->cnt--;
+}
+
+static void cindex_free(struct nbt_tag *t)
+{
+	struct nbt_kids *kids = t->t_u.t_cont.kids;
+	struct nbt_cindex *idx;
+
+	if ( NULL == kids || NULL == (idx = kids->idx) )
+		return;
+
+	mpool_return(tag_nbt(t)->mem, idx,
+			sizeof(*idx) + (idx->mask + 1) * sizeof(idx->slot[0]));
+	kids->idx = NULL;
+}
+
+/* (re)build the index for all current children */
+static int cindex_build(struct nbt_tag *t)
+{
+	struct nbt_kids *kids = t->t_u.t_cont.kids;
+	struct nbt_cindex *idx;
+	uint32_t sz, cnt = t->t_len, i;
+
+	for(sz = CINDEX_MIN * 2; sz < cnt * 2; sz <<= 1)
+		/* nothing */;
+
+	idx = mpool_alloc0(tag_nbt(t)->mem,
+			sizeof(*idx) + sz * sizeof(idx->slot[0]));
+	if ( NULL == idx )
+		return 0;
+
+	idx->mask = sz - 1;
+	for(i = 0; i < cnt; i++)
+		cindex_insert(idx, kids->tag[i]);
+
+	cindex_free(t);
+	kids->idx = idx;
+	return 1;
+}
+
+static struct nbt_tag *compound_find(struct nbt_tag *t, nbt_atom_t name)
+{
+	struct nbt_kids *kids = t->t_u.t_cont.kids;
+	struct nbt_cindex *idx;
+	struct nbt_tag *c;
+	int32_t n;
+	uint32_t i;
+
+	if ( NULL == kids )
+		return NULL;
+
+	idx = kids->idx;
+	if ( NULL == idx ) {
+		for(n = 0; n < t->t_len; n++) {
+			c = kids->tag[n];
+			if ( c->t_name == name )
+				goto found;
+		}
+		c = NULL;
+found:
+		/* a long walk on a big compound, index it for next time */
+		if ( n > CINDEX_MIN )
+			cindex_build(t);
+		return c;
+	}
+
+	for(i = atom_hash(name) & idx->mask; (c = idx->slot[i]);
+			i = (i + 1) & idx->mask) {
+		if ( c->t_name == name )
+			return c;
+	}
+
+	return NULL;
+}
+
+/* add c to the end of compound t, name must already be set */
+static int compound_add(struct nbt_tag *t, struct nbt_tag *c)
+{
+	struct nbt_cindex *idx;
+
+	if ( !kids_resize(tag_nbt(t), t, t->t_len + 1) )
+		return 0;
+
+	t->t_u.t_cont.kids->tag[t->t_len++] = c;
+	set_parent(c, t);
+
+	idx = t->t_u.t_cont.kids->idx;
+	if ( NULL == idx )
+		return 1;
+
+	if ( (idx->cnt + 1) * 2 > idx->mask + 1 ) {
+		/* if we can't grow, drop back to linear search */
+		if ( !cindex_build(t) )
+			cindex_free(t);
+		return 1;
+	}
+
+	cindex_insert(idx, c);
+	return 1;
+}
+
+static int32_t compound_slot(struct nbt_tag *t, struct nbt_tag *c)
+{
+	int32_t i;
+
+	for(i = 0; t->t_u.t_cont.kids->tag[i] != c; i++)
+		/* nothing */;
+
+	return i;
+}
+
+/* c takes the place of old, which has the same name */
+static void compound_swap(struct nbt_tag *t, struct nbt_tag *old,
+				struct nbt_tag *c)
+{
+	struct nbt_kids *kids = t->t_u.t_cont.kids;
+
+	kids->tag[compound_slot(t, old)] = c;
+	set_parent(c, t);
+	if ( kids->idx ) {
+		cindex_remove(kids->idx, old);
+		cindex_insert(kids->idx, c);
+	}
+}
+
+static void compound_remove(struct nbt_tag *t, struct nbt_tag *c)
+{
+	struct nbt_kids *kids = t->t_u.t_cont.kids;
+	int32_t i;
+
+	if ( kids->idx )
+		cindex_remove(kids->idx, c);
+
+	/* members stay in order, shrinking the array is best effort */
+	i = compound_slot(t, c);
+	memmove(&kids->tag[i], &kids->tag[i + 1],
+		(t->t_len - i - 1) * sizeof(kids->tag[0]));
+	kids_resize(tag_nbt(t), t, t->t_len - 1);
+	t->t_len--;
+	c->t_parent = 0;
+}
+
+nbt_tag_t nbt_compound_get_atom(nbt_tag_t t, nbt_atom_t key)
+{
+	if (NULL == t || t->t_type != NBT_TAG_Compound)
+		return NULL;
+	if ( NBT_ATOM_NONE == key || (key & LOCAL_NAME) )
+		return NULL;
+	if ( frozen(t) )
+		return frozen_find(t, atom_str(key), atom_len(key));
+	if ( !expand(t) )
+		return NULL;
+
+	return compound_find(t, doc_key(tag_nbt(t), key));
+}
+
+nbt_tag_t nbt_compound_get(nbt_tag_t t, const char *name)
+{
+	nbt_atom_t key;
+
+	if (NULL == t || t->t_type != NBT_TAG_Compound)
+		return NULL;
+	if ( frozen(t) )
+		return frozen_find(t, name, strlen(name));
+	if ( !expand(t) )
+		return NULL;
+
+	/* if the name was never seen then no tag can have it */
+	key = doc_atom(tag_nbt(t), name, strlen(name));
+	if ( NBT_ATOM_NONE == key )
+		return NULL;
+
+	return compound_find(t, key);
+}
+
+int nbt_byte_set(nbt_tag_t t, uint8_t val)
+{
+	if ( NULL == t || t->t_type != NBT_TAG_Byte || frozen(t) )
+		return 0;
+	t->t_u.t_byte = val;
+	tag_resize(t, 0);
+	return 1;
+}
+
+int nbt_short_set(nbt_tag_t t, int16_t val)
+{
+	if ( NULL == t || t->t_type != NBT_TAG_Short || frozen(t) )
+		return 0;
+	t->t_u.t_short = val;
+	tag_resize(t, 0);
+	return 1;
+}
+
+int nbt_int_set(nbt_tag_t t, int32_t val)
+{
+	if ( NULL == t || t->t_type != NBT_TAG_Int || frozen(t) )
+		return 0;
+	t->t_u.t_int = val;
+	tag_resize(t, 0);
+	return 1;
+}
+
+int nbt_long_set(nbt_tag_t t, int64_t val)
+{
+	if ( NULL == t || t->t_type != NBT_TAG_Long || frozen(t) )
+		return 0;
+	t->t_u.t_long = val;
+	tag_resize(t, 0);
+	return 1;
+}
+
+int nbt_bytearray_set(nbt_tag_t t, const uint8_t *bytes, unsigned int num)
+{
+	uint8_t *buf;
+
+	if ( NULL == t || t->t_type != NBT_TAG_Byte_Array || frozen(t) )
+		return 0;
+
+	if ( num ) {
+		buf = mpool_alloc(tag_nbt(t)->mem, num);
+		if ( NULL == buf )
+			return 0;
+	}else{
+		buf = NULL;
+		bytes = NULL;
+	}
+
+	if ( bytes )
+		memcpy(buf, bytes, num);
+	else if ( num )
+		memset(buf, 0, num);
+	free_payload(tag_nbt(t), t);
+	t->t_flags &= ~TAG_DATA_BORROWED;
+	tag_resize(t, (ssize_t)num - t->t_len);
+	t->t_u.t_blob = buf;
+	t->t_len = num;
+
+	return 1;
+}
+
+int nbt_intarray_set(nbt_tag_t t, const int32_t *ints, unsigned int num)
+{
+	int32_t *buf;
+
+	if ( NULL == t || t->t_type != NBT_TAG_Int_Array || frozen(t) )
+		return 0;
+
+	if ( num ) {
+		buf = mpool_alloc(tag_nbt(t)->mem, sizeof(int32_t) * num);
+		if ( NULL == buf )
+			return 0;
+	}else{
+		buf = NULL;
+		ints = NULL;
+	}
+
+	if ( ints )
+		memcpy(buf, ints, sizeof(int32_t) * num);
+	else if ( num )
+		memset(buf, 0, sizeof(int32_t) * num);
+	free_payload(tag_nbt(t), t);
+	t->t_flags &= ~TAG_DATA_BORROWED;
+	tag_resize(t, ((ssize_t)num - t->t_len) * (ssize_t)sizeof(int32_t));
+	t->t_u.t_ints = buf;
+	t->t_len = num;
+
+	return 1;
+}
+
+int nbt_longarray_set(nbt_tag_t t, const int64_t *longs, unsigned int num)
+{
+	int64_t *buf;
+
+	if ( NULL == t || t->t_type != NBT_TAG_Long_Array || frozen(t) )
+		return 0;
+
+	if ( num ) {
+		buf = mpool_alloc(tag_nbt(t)->mem, sizeof(int64_t) * num);
+		if ( NULL == buf )
+			return 0;
+	}else{
+		buf = NULL;
+		longs = NULL;
+	}
+
+	if ( longs )
+		memcpy(buf, longs, sizeof(int64_t) * num);
+	else if ( num )
+		memset(buf, 0, sizeof(int64_t) * num);
+	free_payload(tag_nbt(t), t);
+	t->t_flags &= ~TAG_DATA_BORROWED;
+	tag_resize(t, ((ssize_t)num - t->t_len) * (ssize_t)sizeof(int64_t));
+	t->t_u.t_longs = buf;
+	t->t_len = num;
+
+	return 1;
+}
+
+int nbt_string_set(nbt_tag_t t, const char *val)
+{
+	size_t len;
+	char *str;
+
+	if ( NULL == t || t->t_type != NBT_TAG_String || frozen(t) )
+		return 0;
+
+	len = strlen(val);
+	if ( len > INT16_MAX )
+		return 0;
+
+	str = copy_str(tag_nbt(t), val, len);
+	if ( NULL == str )
+		return 0;
+
+	free_payload(tag_nbt(t), t);
+	t->t_flags &= ~TAG_DATA_BORROWED;
+	tag_resize(t, (ssize_t)len - t->t_len);
+	t->t_u.t_str = str;
+	t->t_len = len;
+
+	return 1;
+}
+
+int nbt_list_set(nbt_tag_t t, unsigned idx, nbt_tag_t val)
+{
+	struct nbt_tag *old;
+	ssize_t delta;
+
+	if ( NULL == t || t->t_type != NBT_TAG_List || frozen(t) )
+		return 0;
+	if ( frozen(val) )
+		return 0;
+	if ( !expand(t) || !unpack(t) )
+		return 0;
+	if ( val->t_type != t->t_ltype || hgang_of(val) != hgang_of(t) )
+		return 0;
+	if ( idx > INT_MAX || (unsigned)t->t_len <= idx )
+		return 0;
+
+	old = t->t_u.t_cont.kids->tag[idx];
+	if ( old == val )
+		return 1;
+	if ( old && within(val, old) )
+		return 0;
+
+	delta = tag_size(val);
+	if ( old ) {
+		delta -= tag_size(old);
+		free_tree(old);
+	}
+
+	t->t_u.t_cont.kids->tag[idx] = val;
+	set_parent(val, t);
+	tag_resize(t, delta);
+	return 1;
+
+}
+
+int nbt_list_set_size(nbt_tag_t t, unsigned sz)
+{
+	struct _nbt *nbt;
+	struct nbt_tag *c;
+	ssize_t delta = 0;
+	unsigned int i;
+
+	if ( NULL == t || t->t_type != NBT_TAG_List || frozen(t) )
+		return 0;
+	if ( sz > INT_MAX )
+		return 0;
+	if ( !expand(t) || !unpack(t) )
+		return 0;
+
+	nbt = tag_nbt(t);
+
+	/* drop anything that falls off the end */
+	for(i = sz; i < (unsigned)t->t_len; i++) {
+		c = t->t_u.t_cont.kids->tag[i];
+		if ( NULL == c )
+			continue;
+		delta -= tag_size(c);
+		free_tree(c);
+		t->t_u.t_cont.kids->tag[i] = NULL;
+	}
+
+	/* shrink the array too, so that the whole of the old one can be
+	 * reused. If that fails it's just a bit bigger than it need be.
+	 */
+	if ( sz < (unsigned)t->t_len )
+		kids_resize(nbt, t, sz);
+	else if ( !kids_resize(nbt, t, sz) )
+		return 0;
+
+	/* new slots are empty until nbt_list_set() */
+	for(i = t->t_len; i < sz; i++)
+		t->t_u.t_cont.kids->tag[i] = NULL;
+
+	t->t_len = sz;
+	tag_resize(t, delta);
+	return 1;
+}
+
+int nbt_list_append(nbt_tag_t t, nbt_tag_t val)
+{
+	int idx = nbt_list_get_size(t);
+	if ( idx < 0 || !nbt_list_set_size(t, idx + 1) )
+		return 0;
+	if ( !nbt_list_set(t, idx, val) ) {
+		/* don't leave an empty slot behind */
+		nbt_list_set_size(t, idx);
+		return 0;
+	}
+	return 1;
+}
+
+int nbt_compound_delete(nbt_tag_t t, const char *key)
+{
+	struct nbt_tag *c;
+	nbt_atom_t name;
+
+	if ( NULL == t || t->t_type != NBT_TAG_Compound || frozen(t) )
+		return 0;
+	if ( !expand(t) )
+		return 0;
+
+	name = doc_atom(tag_nbt(t), key, strlen(key));
+	if ( NBT_ATOM_NONE == name )
+		return 1;
+
+	c = compound_find(t, name);
+	if ( c ) {
+		tag_resize(t, -(ssize_t)link_size(t, c));
+		compound_remove(t, c);
+		free_tree(c);
+	}
+
+	return 1;
+}
+
+int nbt_compound_set_atom(nbt_tag_t t, nbt_atom_t key, nbt_tag_t val)
+{
+	struct nbt_tag *old;
+
+	if ( NULL == t || t->t_type != NBT_TAG_Compound || frozen(t) )
+		return 0;
+	if ( !expand(t) )
+		return 0;
+
+	if ( NBT_ATOM_NONE == key || (key & LOCAL_NAME) ||
+			atom_len(key) > INT16_MAX )
+		return 0;
+	if ( frozen(val) || hgang_of(val) != hgang_of(t) )
+		return 0;
+
+	key = doc_key(tag_nbt(t), key);
+
+	old = compound_find(t, key);
+	if ( old == val )
+		return 1;
+	if ( old && within(val, old) )
+		return 0;
+
+	val->t_name = key;
+	if ( old ) {
+		/* replaced in place, so nothing to allocate */
+		tag_resize(t, -(ssize_t)link_size(t, old));
+		compound_swap(t, old, val);
+		free_tree(old);
+	}else if ( !compound_add(t, val) ) {
+		return 0;
+	}
+
+	tag_resize(t, link_size(t, val));
+	return 1;
+}
+
+int nbt_compound_set(nbt_tag_t t, const char *key, nbt_tag_t val)
+{
+	size_t len;
+
+	if ( NULL == t || t->t_type != NBT_TAG_Compound )
+		return 0;
+
+	len = strlen(key);
+	if ( len > INT16_MAX )
+		return 0;
+
+	return nbt_compound_set_atom(t, atom_intern(key, len), val);
+}
+
+
+int nbt_list_nuke(nbt_tag_t t)
+{
+	ssize_t sz;
+	int32_t i;
+
+	if (NULL == t || t->t_type != NBT_TAG_List || frozen(t))
+		return 0;
+
+	sz = tag_size(t);
+
+	/* the element type is already known, don't bother decoding */
+	if ( t->t_flags & TAG_LAZY ) {
+		t->t_flags &= ~TAG_LAZY;
+	}else{
+		if ( !(t->t_flags & TAG_PACKED) ) {
+			for(i = 0; i < t->t_len; i++)
+				if ( t->t_u.t_cont.kids->tag[i] )
+					free_tree(t->t_u.t_cont.kids->tag[i]);
+		}
+		free_payload(tag_nbt(t), t);
+		t->t_flags &= ~TAG_PACKED;
+	}
+
+	t->t_len = 0;
+	t->t_u.t_cont.kids = NULL;
+	t->t_u.t_cont.size = sz;
+	tag_resize(t, (ssize_t)value_size(t) - sz);
+	return 1;
+}
+
+static void *list_values(nbt_tag_t t, uint8_t type, unsigned int *num)
+{
+	if ( NULL == t || t->t_type != NBT_TAG_List )
+		return NULL;
+	if ( frozen(t) ) {
+		if ( t->t_ltype != type )
+			return NULL;
+		*num = t->t_len;
+		return payload(t);
+	}
+	if ( !expand(t) )
+		return NULL;
+	if ( t->t_ltype != type || !pack(t) )
+		return NULL;
+
+	/* caller is about to get a writable pointer */
+	tag_resize(t, 0);
+
+	*num = t->t_len;
+	return t->t_u.t_cont.vals;
+}
+
+static int list_set_values(nbt_tag_t t, uint8_t type,
+				const void *vals, unsigned int num)
+{
+	size_t esz = fixed_size(type);
+	void *buf;
+
+	if ( NULL == t || t->t_type != NBT_TAG_List || frozen(t) )
+		return 0;
+	if ( num > INT_MAX )
+		return 0;
+	if ( t->t_ltype != type )
+		return 0;
+
+	buf = mpool_alloc(tag_nbt(t)->mem, list_cap(num) * esz);
+	if ( NULL == buf )
+		return 0;
+	if ( num )
+		memcpy(buf, vals, num * esz);
+
+	if ( !nbt_list_nuke(t) )
+		return 0;
+
+	t->t_u.t_cont.vals = buf;
+	t->t_len = num;
+	t->t_flags |= TAG_PACKED;
+	tag_resize(t, num * esz);
+	return 1;
+}
+
+#define LIST_VALUES(name, ctype, type) \
+int nbt_list_get_##name(nbt_tag_t t, ctype **vals, unsigned int *num) \
+{ \
+	*vals = list_values(t, type, num); \
+	return NULL != *vals; \
+} \
+int nbt_list_set_##name(nbt_tag_t t, const ctype *vals, unsigned int num) \
+{ \
+	return list_set_values(t, type, vals, num); \
+}
+
+LIST_VALUES(bytes, uint8_t, NBT_TAG_Byte)
+LIST_VALUES(shorts, int16_t, NBT_TAG_Short)
+LIST_VALUES(ints, int32_t, NBT_TAG_Int)
+LIST_VALUES(longs, int64_t, NBT_TAG_Long)
+LIST_VALUES(floats, float, NBT_TAG_Float)
+LIST_VALUES(doubles, double, NBT_TAG_Double)
+
+int nbt_compound_nuke(nbt_tag_t t)
+{
+	ssize_t sz;
+	int32_t i;
+
+	if (NULL == t || t->t_type != NBT_TAG_Compound || frozen(t))
+		return 0;
+
+	sz = tag_size(t);
+
+	/* nothing was decoded, so nothing to free */
+	if ( t->t_flags & TAG_LAZY ) {
+		t->t_flags &= ~TAG_LAZY;
+	}else{
+		for(i = 0; i < t->t_len; i++)
+			free_tree(t->t_u.t_cont.kids->tag[i]);
+		free_payload(tag_nbt(t), t);
+	}
+
+	t->t_len = 0;
+	t->t_u.t_cont.kids = NULL;
+	t->t_u.t_cont.size = sz;
+	tag_resize(t, (ssize_t)value_size(t) - sz);
+	return 1;
+}
+
+static struct nbt_tag *new_node(struct _nbt *nbt, uint8_t type,
+				uint8_t list_type)
+{
+	struct nbt_tag *tag;
+
+	if ( type >= NBT_TAG_MAX )
+		return NULL;
+
+	/* use nbt_tag_new_list instead */
+	if ( type == NBT_TAG_List && list_type == NBT_TAG_End )
+		return NULL;
+
+	tag = hgang_alloc0(nbt->nodes);
+	if ( NULL == tag )
+		return NULL;
+
+	tag->t_type = type;
+
+	if ( type == NBT_TAG_List )
+		tag->t_ltype = list_type;
+	if ( has_size(tag) )
+		tag->t_u.t_cont.size = value_size(tag);
+	return tag;
+}
+
+nbt_tag_t nbt_tag_new(nbt_t nbt, uint8_t type)
+{
+	return new_node(nbt, type, NBT_TAG_End);
+}
+
+nbt_tag_t nbt_tag_new_list(nbt_t nbt, uint8_t type)
+{
+	return new_node(nbt, NBT_TAG_List, type);
+}
+
+uint8_t nbt_tag_type(nbt_tag_t t)
+{
+	if ( NULL == t )
+		return NBT_TAG_End;
+	return t->t_type;
+}
+
+const char *nbt_tag_name(nbt_tag_t t)
+{
+	size_t len;
+
+	if ( NULL == t )
+		return NULL;
+	if ( frozen(t) )
+		return frozen_name(t, NULL);
+	return tag_name(t, &len);
+}
+
+nbt_atom_t nbt_tag_atom(nbt_tag_t t)
+{
+	const char *name;
+	size_t len;
+
+	if ( NULL == t )
+		return NBT_ATOM_NONE;
+	if ( frozen(t) ) {
+		name = frozen_name(t, &len);
+		return (name) ? atom_intern(name, len) : NBT_ATOM_NONE;
+	}
+	if ( t->t_name & LOCAL_NAME ) {
+		name = tag_name(t, &len);
+		return atom_intern(name, len);
+	}
+	return t->t_name;
+}
+
+size_t nbt_size_in_bytes(nbt_t nbt)
+{
+	return 3 + name_len(nbt->root) + tag_size(nbt->root);
+}
+
+/* room for len (at most NBT_SINK_MIN) bytes at s->ptr */
+static int sink_reserve(struct nbt_sink *s, size_t len)
+{
+	if ( (size_t)(s->end - s->ptr) >= len )
+		return 1;
+	return (*s->flush)(s) && (size_t)(s->end - s->ptr) >= len;
+}
+
+static int sink_write(struct nbt_sink *s, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t n;
+
+	while( len ) {
+		if ( s->ptr == s->end ) {
+			if ( !(*s->flush)(s) || s->ptr == s->end )
+				return 0;
+		}
+
+		n = s->end - s->ptr;
+		if ( n > len )
+			n = len;
+
+		memcpy(s->ptr, p, n);
+		s->ptr += n;
+		p += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+/* write n array or packed list elements in order to */
+static int sink_write_wire(struct nbt_sink *s, const void *buf,
+				size_t n, size_t esz, int from, int to)
+{
+	const uint8_t *p = buf;
+	size_t cnt;
+
+	while( n ) {
+		if ( !sink_reserve(s, esz) )
+			return 0;
+
+		cnt = (s->end - s->ptr) / esz;
+		if ( cnt > n )
+			cnt = n;
+
+		wire(s->ptr, p, cnt, esz, from, to);
+
+		s->ptr += cnt * esz;
+		p += cnt * esz;
+		n -= cnt;
+	}
+
+	return 1;
+}
+
+/* these assume that sink_reserve() was already called */
+static ALWAYS_INLINE void put16(struct nbt_sink *s, uint16_t v, int order)
+{
+	v = order16(v, order);
+	memcpy(s->ptr, &v, sizeof(v));
+	s->ptr += sizeof(v);
+}
+
+static ALWAYS_INLINE void put32(struct nbt_sink *s, uint32_t v, int order)
+{
+	v = order32(v, order);
+	memcpy(s->ptr, &v, sizeof(v));
+	s->ptr += sizeof(v);
+}
+
+static ALWAYS_INLINE void put64(struct nbt_sink *s, uint64_t v, int order)
+{
+	v = order64(v, order);
+	memcpy(s->ptr, &v, sizeof(v));
+	s->ptr += sizeof(v);
+}
+
+/* write a tags header and value, do_get_bytes() writes the children */
+static ALWAYS_INLINE int put_tag(const struct nbt_tag *tag, int type,
+					struct nbt_sink *s, int order)
+{
+	const char *name;
+	uint32_t u32;
+	uint64_t u64;
+	size_t nlen;
+
+	if ( type == TAG_NAMED ) {
+		if ( !sink_reserve(s, 3) )
+			return 0;
+		*s->ptr++ = tag->t_type;
+		name = tag_name(tag, &nlen);
+		put16(s, nlen, order);
+		if ( !sink_write(s, name, nlen) )
+			return 0;
+	}
+
+	/* unchanged since it was decoded, lazy tags always are and the
+	 * caller expands them if the byte order is different
+	 */
+	if ( tag->t_flags & TAG_LAZY )
+		return sink_write(s, tag->t_u.t_lazy.ptr, tag->t_u.t_lazy.len);
+	if ( order == ORDER_BE && has_size(tag) && tag->t_u.t_cont.src )
+		return sink_write(s, tag_nbt(tag)->src +
+					tag->t_u.t_cont.src - 1,
+					tag->t_u.t_cont.size);
+
+	switch(tag->t_type) {
+	case NBT_TAG_Byte:
+		if ( !sink_reserve(s, sizeof(uint8_t)) )
+			return 0;
+		*s->ptr++ = tag->t_u.t_byte;
+		break;
+	case NBT_TAG_Short:
+		if ( !sink_reserve(s, sizeof(int16_t)) )
+			return 0;
+		put16(s, tag->t_u.t_short, order);
+		break;
+	case NBT_TAG_Int:
+		if ( !sink_reserve(s, sizeof(int32_t)) )
+			return 0;
+		put32(s, tag->t_u.t_int, order);
+		break;
+	case NBT_TAG_Long:
+		if ( !sink_reserve(s, sizeof(int64_t)) )
+			return 0;
+		put64(s, tag->t_u.t_long, order);
+		break;
+	case NBT_TAG_Float:
+		if ( !sink_reserve(s, sizeof(float)) )
+			return 0;
+		memcpy(&u32, &tag->t_u.t_float, sizeof(u32));
+		put32(s, u32, order);
+		break;
+	case NBT_TAG_Double:
+		if ( !sink_reserve(s, sizeof(double)) )
+			return 0;
+		memcpy(&u64, &tag->t_u.t_double, sizeof(u64));
+		put64(s, u64, order);
+		break;
+	case NBT_TAG_Byte_Array:
+		if ( !sink_reserve(s, sizeof(int32_t)) )
+			return 0;
+		put32(s, tag->t_len, order);
+		return sink_write(s, tag->t_u.t_blob, tag->t_len);
+	case NBT_TAG_String:
+		if ( !sink_reserve(s, sizeof(int16_t)) )
+			return 0;
+		put16(s, tag->t_len, order);
+		return sink_write(s, tag->t_u.t_str, tag->t_len);
+	case NBT_TAG_List:
+		if ( !sink_reserve(s, sizeof(uint8_t) + sizeof(int32_t)) )
+			return 0;
+		*s->ptr++ = tag->t_ltype;
+		put32(s, tag->t_len, order);
+		if ( tag->t_flags & TAG_PACKED )
+			return sink_write_wire(s, tag->t_u.t_cont.vals,
+					tag->t_len, fixed_size(tag->t_ltype),
+					ORDER_HOST, order);
+		break;
+	case NBT_TAG_Compound:
+		break;
+	case NBT_TAG_Int_Array:
+		if ( !sink_reserve(s, sizeof(int32_t)) )
+			return 0;
+		put32(s, tag->t_len, order);
+		return sink_write_wire(s, tag->t_u.t_ints,
+					tag->t_len, sizeof(int32_t),
+					(tag->t_flags & TAG_DATA_BORROWED) ?
+						ORDER_BE : ORDER_HOST, order);
+	case NBT_TAG_Long_Array:
+		if ( !sink_reserve(s, sizeof(int32_t)) )
+			return 0;
+		put32(s, tag->t_len, order);
+		return sink_write_wire(s, tag->t_u.t_longs,
+					tag->t_len, sizeof(int64_t),
+					(tag->t_flags & TAG_DATA_BORROWED) ?
+						ORDER_BE : ORDER_HOST, order);
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+static ALWAYS_INLINE int do_get_bytes(struct nbt_tag *tag, int type,
+					struct nbt_sink *s, int order)
+{
+	struct nbt_tag *c;
+	struct stack st;
+	struct frame *f;
+	int ret = 0;
+
+	stack_init(&st);
+
+	/* lazy subtrees are big-endian, so have to be walked otherwise */
+	if ( order != ORDER_BE && !expand(tag) )
+		goto out;
+	if ( !put_tag(tag, type, s, order) )
+		goto out;
+	if ( emit_children(tag, order) && !push_tag(&st, tag) )
+		goto out;
+
+	while( (f = stack_top(&st)) ) {
+		c = frame_next(f);
+		/* the list header already promised t_len elements */
+		if ( NULL == c && frame_hole(f) )
+			goto out;
+		if ( NULL == c ) {
+			if ( f->tag->t_type == NBT_TAG_Compound ) {
+				if ( !sink_reserve(s, sizeof(uint8_t)) )
+					goto out;
+				*s->ptr++ = NBT_TAG_End;
+			}
+			stack_pop(&st);
+			continue;
+		}
+
+		if ( order != ORDER_BE && !expand(c) )
+			goto out;
+		if ( !put_tag(c, (f->tag->t_type == NBT_TAG_Compound) ?
+					TAG_NAMED : TAG_ANON, s, order) )
+			goto out;
+		if ( emit_children(c, order) && !push_tag(&st, c) )
+			goto out;
+	}
+
+	ret = 1;
+out:
+	stack_fini(&st);
+	return ret;
+}
+
+/* one copy of the encoder for each byte order */
+#define ENCODER(name, order) \
+static int name(struct nbt_tag *tag, int type, struct nbt_sink *s) \
+{ \
+	return do_get_bytes(tag, type, s, order); \
+}
+
+ENCODER(do_get_bytes_be, ORDER_BE)
+ENCODER(do_get_bytes_le, ORDER_LE)
+
+/* Encode in a single pass, what's left in the sink's window is not
+ * flushed, that's up to the caller.
+ */
+int nbt_encode(nbt_t nbt, struct nbt_sink *s)
+{
+	return do_get_bytes_be(nbt->root, TAG_NAMED, s);
+}
+
+int nbt_encode_le(nbt_t nbt, struct nbt_sink *s)
+{
+	return do_get_bytes_le(nbt->root, TAG_NAMED, s);
+}
+
+static int fixed_flush(struct nbt_sink *s)
+{
+	return 0;
+}
+
+int nbt_get_bytes(nbt_t nbt, uint8_t *buf, size_t len)
+{
+	struct nbt_sink s = {
+		.ptr = buf,
+		.end = buf + len,
+		.flush = fixed_flush,
+	};
+
+	return nbt_encode(nbt, &s);
+}
+
+int nbt_get_bytes_le(nbt_t nbt, uint8_t *buf, size_t len)
+{
+	struct nbt_sink s = {
+		.ptr = buf,
+		.end = buf + len,
+		.flush = fixed_flush,
+	};
+
+	return nbt_encode_le(nbt, &s);
+}
+
+static int buf_flush(struct nbt_sink *s)
+{
+	struct nbt_buf *b = (struct nbt_buf *)s;
+	size_t len, cap;
+	uint8_t *new;
+
+	len = s->ptr - b->base;
+	cap = (s->end - b->base) * 2;
+	if ( cap < NBT_BUF_INITIAL )
+		cap = NBT_BUF_INITIAL;
+
+	new = realloc(b->base, cap);
+	if ( NULL == new )
+		return 0;
+
+	b->base = new;
+	s->ptr = new + len;
+	s->end = new + cap;
+	return 1;
+}
+
+void nbt_buf_init(struct nbt_buf *b)
+{
+	b->base = NULL;
+	b->sink.ptr = NULL;
+	b->sink.end = NULL;
+	b->sink.flush = buf_flush;
+}
 
-		tag->t_u.t_list.len = be32toh(*(int32_t *)ptr);
-		ptr += 4;
+size_t nbt_buf_len(const struct nbt_buf *b)
+{
+	return b->sink.ptr - b->base;
+}
 
-		tag->t_u.t_list.array = calloc(tag->t_u.t_list.len,
-						sizeof(*tag->t_u.t_list.array));
-		if ( NULL == tag->t_u.t_list.array )
-			return NULL;
+static int fd_flush(struct nbt_sink *s)
+{
+	struct nbt_fd_sink *f = (struct nbt_fd_sink *)s;
+	int ret;
 
-		for(cnt = 0; cnt < tag->t_u.t_list.len; cnt++) {
-			c = hgang_alloc0(nbt->nodes);
-			if ( NULL == c )
-				return NULL;
-			tag->t_u.t_list.array[cnt] = c;
-			c->t_type = tag->t_u.t_list.type;
-			tmp = decode_tag(nbt, ptr, end - ptr, c, TAG_ANON);
-			if ( NULL == tmp )
-				return NULL;
-			ptr = tmp;
-		}
-		break;
-	case NBT_TAG_Compound:
-		INIT_LIST_HEAD(&tag->t_u.t_compound);
-		while(ptr < end) {
-			c = hgang_alloc0(nbt->nodes);
-			if ( NULL == c )
-				return NULL;
-			tmp = decode_tag(nbt, ptr, end - ptr, c, TAG_NAMED);
-			if ( NULL == tmp )
-				return NULL;
-			ptr = tmp;
-			if ( c->t_type == NBT_TAG_End ) {
-				hgang_return(nbt->nodes, c);
-				break;
-			}else{
-				list_add_tail(&c->t_list, &tag->t_u.t_compound);
-			}
-		}
-		break;
-	case NBT_TAG_Int_Array:
-		if ( ptr + sizeof(alen) > end )
-			return NULL;
-		alen = be32toh(*(int32_t *)ptr) * sizeof(int32_t);
-		aptr =  ptr + sizeof(alen);
-		ptr += sizeof(alen) + alen;
-		if ( alen < 0 || ptr > end )
-			return NULL;
-		tag->t_u.t_ints.array = malloc(alen);
-		if ( NULL == tag->t_u.t_ints.array )
-			return NULL;
-		tag->t_u.t_ints.len = alen / sizeof(int32_t);
-		memcpy(tag->t_u.t_ints.array, aptr, alen);
-		break;
-	default:
-		printf("nbt: uknown type %d\n", tag->t_type);
-		return NULL;
-	}
+	ret = libmc_write_all(f->fd, f->buf, s->ptr - f->buf);
+	s->ptr = f->buf;
+	return ret;
+}
 
-	return ptr;
+void nbt_fd_sink_init(struct nbt_fd_sink *f, int fd)
+{
+	f->fd = fd;
+	f->sink.ptr = f->buf;
+	f->sink.end = f->buf + sizeof(f->buf);
+	f->sink.flush = fd_flush;
 }
 
-static void free_nbt_data(struct nbt_tag *tag)
+int nbt_fd_sink_finish(struct nbt_fd_sink *f)
 {
-	struct nbt_tag *c;
-	int32_t i;
+	return fd_flush(&f->sink);
+}
 
-	switch(tag->t_type) {
-	case NBT_TAG_Byte_Array:
-		free(tag->t_u.t_blob.array);
-		break;
-	case NBT_TAG_String:
-		free(tag->t_u.t_str);
-		break;
-	case NBT_TAG_List:
-		for(i = 0; i < tag->t_u.t_list.len; i++)
-			free_nbt_data(tag->t_u.t_list.array[i]);
-		free(tag->t_u.t_list.array);
-		break;
-	case NBT_TAG_Compound:
-		list_for_each_entry(c, &tag->t_u.t_compound, t_list)
-			free_nbt_data(c);
-		break;
-	case NBT_TAG_Int_Array:
-		free(tag->t_u.t_ints.array);
-		break;
-	default:
-		break;
-	}
+/* Hashing. nbt_hash_bytes() is for encoded documents, nbt_hash() hashes
+ * a tree by value so that it doesn't depend on how the tree was built or
+ * decoded. Compound members are unordered so their hashes are summed,
+ * list elements are chained in order. Floats hash by bit pattern.
+ */
+#define HASH_P1		0x9e3779b185ebca87ULL
+#define HASH_P2		0xc2b2ae3d27d4eb4fULL
+#define HASH_P3		0x165667b19e3779f9ULL
 
-	free(tag->t_name);
+static uint64_t rotl64(uint64_t x, unsigned int r)
+{
+	return (x << r) | (x >> (64 - r));
 }
 
-nbt_tag_t nbt_root_tag(nbt_t nbt)
+static uint64_t fmix64(uint64_t k)
 {
-	return &nbt->root;
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
 }
 
-int nbt_byte_get(nbt_tag_t t, uint8_t *val)
+static uint64_t hash_mix(uint64_t h, uint64_t v)
 {
-	if (NULL == t || t->t_type != NBT_TAG_Byte)
-		return 0;
-	*val = t->t_u.t_byte;
-	return 1;
+	return fmix64(h ^ fmix64(v));
 }
 
-int nbt_short_get(nbt_tag_t t, int16_t *val)
+static uint64_t load64(const uint8_t *p)
 {
-	if (NULL == t || t->t_type != NBT_TAG_Short)
-		return 0;
-	*val = t->t_u.t_short;
-	return 1;
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
 }
 
-int nbt_int_get(nbt_tag_t t, int32_t *val)
+static void hash_stripe(uint64_t *h, const uint8_t *buf)
 {
-	if (NULL == t || t->t_type != NBT_TAG_Int)
-		return 0;
-	*val = t->t_u.t_int;
-	return 1;
+	unsigned int i;
+
+	for(i = 0; i < 4; i++) {
+		h[i] += load64(buf + 8 * i) * HASH_P2;
+		h[i] = rotl64(h[i], 31) * HASH_P1;
+	}
 }
 
-int nbt_long_get(nbt_tag_t t, int64_t *val)
+/* fold the lanes together with len, then the last len % 32 bytes */
+static uint64_t hash_tail(const uint64_t *h, uint64_t len,
+				const uint8_t *buf, const uint8_t *end)
 {
-	if (NULL == t || t->t_type != NBT_TAG_Long)
-		return 0;
-	*val = t->t_u.t_long;
-	return 1;
+	uint64_t ret, v;
+	unsigned int i;
+
+	ret = rotl64(h[0], 1) + rotl64(h[1], 7) +
+		rotl64(h[2], 12) + rotl64(h[3], 18);
+	ret = hash_mix(ret, len);
+
+	for(; end - buf >= 8; buf += 8)
+		ret = rotl64(ret ^ (load64(buf) * HASH_P2), 27) * HASH_P1;
+
+	for(v = 0, i = 0; buf < end; buf++, i += 8)
+		v |= (uint64_t)*buf << i;
+
+	ret = fmix64(ret ^ (v * HASH_P3));
+	return (ret) ? ret : 1;
 }
 
-int nbt_bytearray_get(nbt_tag_t t, uint8_t **bytes, size_t *sz)
+/* Four independent lanes of 8 bytes each so that the multiplies overlap,
+ * then the tail a word at a time. Never returns 0 so callers may use
+ * that to mean "not known".
+ */
+uint64_t nbt_hash_bytes(const uint8_t *buf, size_t len)
 {
-	if (NULL == t || t->t_type != NBT_TAG_Byte_Array)
-		return 0;
-	*bytes = t->t_u.t_blob.array;
-	*sz = (size_t)t->t_u.t_blob.len;
-	return 1;
+	uint64_t h[4] = {HASH_P1 + HASH_P2, HASH_P2, 0, -HASH_P1};
+	const uint8_t *end = buf + len;
+
+	for(; end - buf >= 32; buf += 32)
+		hash_stripe(h, buf);
+
+	return hash_tail(h, len, buf, end);
 }
 
-int nbt_intarray_get(nbt_tag_t t, int32_t **ints, unsigned int *num)
+void nbt_hasher_init(struct nbt_hasher *h)
 {
-	if (NULL == t || t->t_type != NBT_TAG_Int_Array)
-		return 0;
-	*ints = t->t_u.t_ints.array;
-	*num = t->t_u.t_ints.len;
-	return 1;
+	h->h[0] = HASH_P1 + HASH_P2;
+	h->h[1] = HASH_P2;
+	h->h[2] = 0;
+	h->h[3] = -HASH_P1;
+	h->len = 0;
 }
 
-int nbt_string_get(nbt_tag_t t, char **val)
+/* whole stripes are hashed as soon as they're complete, so there are
+ * never more than 31 bytes left in buf
+ */
+void nbt_hasher_update(struct nbt_hasher *h, const uint8_t *buf, size_t len)
 {
-	if (NULL == t || t->t_type != NBT_TAG_String)
-		return 0;
-	*val = t->t_u.t_str;
-	return 1;
+	const uint8_t *end = buf + len;
+	size_t fill = h->len % sizeof(h->buf), n;
+
+	h->len += len;
+
+	if ( fill ) {
+		n = sizeof(h->buf) - fill;
+		if ( n > len )
+			n = len;
+		memcpy(h->buf + fill, buf, n);
+		buf += n;
+		if ( fill + n < sizeof(h->buf) )
+			return;
+		hash_stripe(h->h, h->buf);
+	}
+
+	for(; end - buf >= 32; buf += 32)
+		hash_stripe(h->h, buf);
+
+	memcpy(h->buf, buf, end - buf);
 }
 
-nbt_tag_t nbt_list_get(nbt_tag_t t, unsigned idx)
+uint64_t nbt_hasher_final(const struct nbt_hasher *h)
 {
-	if (NULL == t || t->t_type != NBT_TAG_List)
-		return 0;
-	if ( idx >= (unsigned)t->t_u.t_list.len )
-		return 0;
-	return t->t_u.t_list.array[idx];
+	return hash_tail(h->h, h->len, h->buf,
+			h->buf + h->len % sizeof(h->buf));
 }
 
-int nbt_list_get_size(nbt_tag_t t)
+static uint64_t name_hash(const struct nbt_tag *t)
 {
-	if (NULL == t || t->t_type != NBT_TAG_List)
-		return -1;
-	return t->t_u.t_list.len;
+	const char *name;
+	size_t len;
+
+	name = tag_name(t, &len);
+	return nbt_hash_bytes((const uint8_t *)name, len);
 }
 
-nbt_tag_t nbt_compound_get(nbt_tag_t t, const char *name)
+/* atom of c's name in the document that peer belongs to */
+static nbt_atom_t peer_name(const struct nbt_tag *c,
+				const struct nbt_tag *peer)
 {
-	struct nbt_tag *c;
+	const struct _nbt *a = tag_nbt(c), *b = tag_nbt(peer);
+	const char *name;
+	size_t len;
 
-	if (NULL == t || t->t_type != NBT_TAG_Compound)
-		return NULL;
+	if ( a == b || !((c->t_name & LOCAL_NAME) || b->num_names) )
+		return c->t_name;
 
-	list_for_each_entry(c, &t->t_u.t_compound, t_list) {
-		if ( !strcmp(c->t_name, name) ) {
-			return c;
-		}
+	name = tag_name(c, &len);
+	return doc_atom(b, name, len);
+}
+
+/* lists of fixed size types are compared and hashed element by element
+ * whether they're packed or not, everything else with children is walked
+ */
+static int walk_into(const struct nbt_tag *t)
+{
+	if ( t->t_type == NBT_TAG_List )
+		return !fixed_size(t->t_ltype);
+	return t->t_type == NBT_TAG_Compound;
+}
+
+/* value of element i of such a list, empty slots read as zero */
+static uint64_t list_elem(const struct nbt_tag *t, int32_t i)
+{
+	size_t esz = fixed_size(t->t_ltype);
+	uint64_t v = 0;
+
+	if ( t->t_flags & TAG_PACKED ) {
+		memcpy(&v, (uint8_t *)t->t_u.t_cont.vals + i * esz, esz);
+	}else if ( t->t_u.t_cont.kids->tag[i] ) {
+		memcpy(&v, &t->t_u.t_cont.kids->tag[i]->t_u, esz);
 	}
 
-	return NULL;
+	return v;
 }
 
-int nbt_byte_set(nbt_tag_t t, uint8_t val)
+static uint64_t list_seed(const struct nbt_tag *t)
 {
-	if ( NULL == t || t->t_type != NBT_TAG_Byte )
-		return 0;
-	t->t_u.t_byte = val;
-	return 1;
+	return hash_mix(hash_mix(NBT_TAG_List, t->t_ltype), t->t_len);
 }
 
-int nbt_short_set(nbt_tag_t t, int16_t val)
+/* hash of a tag that isn't walked in to */
+static int leaf_hash(struct nbt_tag *t, uint64_t *hash)
 {
-	if ( NULL == t || t->t_type != NBT_TAG_Short )
-		return 0;
-	t->t_u.t_short = val;
+	const void *data;
+	uint64_t v = 0;
+	size_t len;
+	int32_t i;
+
+	switch(t->t_type) {
+	case NBT_TAG_Byte_Array:
+		data = t->t_u.t_blob;
+		len = t->t_len;
+		break;
+	case NBT_TAG_String:
+		data = t->t_u.t_str;
+		len = t->t_len;
+		break;
+	case NBT_TAG_Int_Array:
+		if ( !unborrow(t) )
+			return 0;
+		data = t->t_u.t_ints;
+		len = t->t_len * sizeof(int32_t);
+		break;
+	case NBT_TAG_Long_Array:
+		if ( !unborrow(t) )
+			return 0;
+		data = t->t_u.t_longs;
+		len = t->t_len * sizeof(int64_t);
+		break;
+	case NBT_TAG_List:
+		v = list_seed(t);
+		for(i = 0; i < t->t_len; i++)
+			v = hash_mix(v, hash_mix(t->t_ltype, list_elem(t, i)));
+		*hash = v;
+		return 1;
+	default:
+		memcpy(&v, &t->t_u, fixed_size(t->t_type));
+		*hash = hash_mix(t->t_type, v);
+		return 1;
+	}
+
+	*hash = hash_mix(hash_mix(t->t_type, len), nbt_hash_bytes(data, len));
 	return 1;
 }
 
-int nbt_int_set(nbt_tag_t t, int32_t val)
+/* next child of f, and its counterpart in f->peer if cp is given. Unlike
+ * frame_next() empty list slots don't end the walk, c is just NULL.
+ */
+static int walk_next(struct frame *f, struct nbt_tag **c,
+			struct nbt_tag **cp)
 {
-	if ( NULL == t || t->t_type != NBT_TAG_Int )
+	struct nbt_tag *t = f->tag;
+
+	if ( t->t_type == NBT_TAG_List ) {
+		if ( f->idx >= t->t_len )
+			return 0;
+		*c = t->t_u.t_cont.kids->tag[f->idx];
+		if ( cp )
+			*cp = f->peer->t_u.t_cont.kids->tag[f->idx];
+		f->idx++;
+		return 1;
+	}
+
+	*c = frame_next(f);
+	if ( NULL == *c )
 		return 0;
-	t->t_u.t_int = val;
+	if ( cp )
+		*cp = compound_find(f->peer, peer_name(*c, f->peer));
 	return 1;
 }
 
-int nbt_long_set(nbt_tag_t t, int64_t val)
+/* c is NULL only for an empty list slot */
+static void hash_fold(struct frame *f, const struct nbt_tag *c, uint64_t h)
 {
-	if ( NULL == t || t->t_type != NBT_TAG_Long )
+	if ( f->tag->t_type == NBT_TAG_Compound )
+		f->h += hash_mix(name_hash(c), h);
+	else
+		f->h = hash_mix(f->h, h);
+}
+
+static int push_hash(struct stack *s, struct nbt_tag *t)
+{
+	if ( !push_tag(s, t) )
 		return 0;
-	t->t_u.t_long = val;
+	stack_top(s)->h = (t->t_type == NBT_TAG_List) ? list_seed(t) : 0;
 	return 1;
 }
 
-int nbt_bytearray_set(nbt_tag_t t, const uint8_t *bytes, unsigned int num)
+/* 0 if lazy subtrees couldn't be decoded or it's too deep */
+uint64_t nbt_hash(nbt_t nbt)
 {
-	uint8_t *buf;
+	struct nbt_tag *t = nbt->root, *c;
+	struct stack st;
+	struct frame *f;
+	uint64_t h;
 
-	if ( NULL == t || t->t_type != NBT_TAG_Byte_Array )
-		return 0;
+	stack_init(&st);
 
-	if ( num ) {
-		buf = malloc(num);
-		if ( NULL == buf )
-			return 0;
-	}else{
-		buf = NULL;
-		bytes = NULL;
+	if ( !expand(t) )
+		goto err;
+	if ( !walk_into(t) ) {
+		if ( !leaf_hash(t, &h) )
+			goto err;
+		goto out;
 	}
+	if ( !push_hash(&st, t) )
+		goto err;
 
-	free(t->t_u.t_blob.array);
-	if ( bytes )
-		memcpy(buf, bytes, num);
-	else
-		memset(buf, 0, num);
-	t->t_u.t_blob.array = buf;
-	t->t_u.t_blob.len = num;
+	while( (f = stack_top(&st)) ) {
+		if ( !walk_next(f, &c, NULL) ) {
+			c = f->tag;
+			h = f->h;
+			if ( c->t_type == NBT_TAG_Compound )
+				h = hash_mix(NBT_TAG_Compound, h);
+			stack_pop(&st);
+			f = stack_top(&st);
+			if ( f )
+				hash_fold(f, c, h);
+			continue;
+		}
 
-	return 1;
+		if ( NULL == c ) {
+			hash_fold(f, c, 0);
+			continue;
+		}
+		if ( !expand(c) )
+			goto err;
+		if ( walk_into(c) ) {
+			if ( !push_hash(&st, c) )
+				goto err;
+			continue;
+		}
+		if ( !leaf_hash(c, &h) )
+			goto err;
+		hash_fold(f, c, h);
+	}
+
+out:
+	stack_fini(&st);
+	h = hash_mix(name_hash(nbt->root), h);
+	return (h) ? h : 1;
+err:
+	stack_fini(&st);
+	return 0;
 }
 
-int nbt_intarray_set(nbt_tag_t t, const int32_t *ints, unsigned int num)
+static int same_bytes(const void *a, const void *b, size_t len)
 {
-	int32_t *buf;
+	return !len || !memcmp(a, b, len);
+}
+
+/* compare a and b, but not their children */
+static int same_value(struct nbt_tag *a, struct nbt_tag *b)
+{
+	int32_t i;
 
-	if ( NULL == t || t->t_type != NBT_TAG_Int_Array )
+	if ( !expand(a) || !expand(b) )
+		return 0;
+	if ( a->t_type != b->t_type )
 		return 0;
 
-	if ( num ) {
-		buf = malloc(sizeof(int32_t) * num);
-		if ( NULL == buf )
+	switch(a->t_type) {
+	case NBT_TAG_End:
+		return 1;
+	case NBT_TAG_Byte_Array:
+		return a->t_len == b->t_len &&
+			same_bytes(a->t_u.t_blob, b->t_u.t_blob, a->t_len);
+	case NBT_TAG_String:
+		return a->t_len == b->t_len &&
+			same_bytes(a->t_u.t_str, b->t_u.t_str, a->t_len);
+	case NBT_TAG_Int_Array:
+		if ( !unborrow(a) || !unborrow(b) )
 			return 0;
-	}else{
-		buf = NULL;
-		ints = NULL;
+		return a->t_len == b->t_len &&
+			same_bytes(a->t_u.t_ints, b->t_u.t_ints,
+				a->t_len * sizeof(int32_t));
+	case NBT_TAG_Long_Array:
+		if ( !unborrow(a) || !unborrow(b) )
+			return 0;
+		return a->t_len == b->t_len &&
+			same_bytes(a->t_u.t_longs, b->t_u.t_longs,
+				a->t_len * sizeof(int64_t));
+	case NBT_TAG_List:
+		if ( a->t_ltype != b->t_ltype || a->t_len != b->t_len )
+			return 0;
+		if ( walk_into(a) )
+			return 1;
+		for(i = 0; i < a->t_len; i++) {
+			if ( list_elem(a, i) != list_elem(b, i) )
+				return 0;
+		}
+		return 1;
+	case NBT_TAG_Compound:
+		return a->t_len == b->t_len;
+	default:
+		return same_bytes(&a->t_u, &b->t_u, fixed_size(a->t_type));
 	}
+}
 
-	free(t->t_u.t_ints.array);
-	if ( ints )
-		memcpy(buf, ints, sizeof(int32_t) * num);
-	else
-		memset(buf, 0, sizeof(int32_t) * num);
-	t->t_u.t_ints.array = buf;
-	t->t_u.t_ints.len = num;
+/* Equal by value as for nbt_hash(), member order in compounds doesn't
+ * matter. Returns 0 on any error as well.
+ */
+int nbt_equal(nbt_t a, nbt_t b)
+{
+	struct nbt_tag *ca, *cb;
+	struct stack st;
+	struct frame *f;
+	int ret = 0;
 
-	return 1;
+	if ( peer_name(a->root, b->root) != b->root->t_name )
+		return 0;
+	if ( !same_value(a->root, b->root) )
+		return 0;
+	if ( !walk_into(a->root) )
+		return 1;
+
+	stack_init(&st);
+	if ( !push_tag(&st, a->root) )
+		goto out;
+	stack_top(&st)->peer = b->root;
+
+	while( (f = stack_top(&st)) ) {
+		if ( !walk_next(f, &ca, &cb) ) {
+			stack_pop(&st);
+			continue;
+		}
+
+		if ( NULL == ca || NULL == cb ) {
+			if ( ca != cb )
+				goto out;
+			continue;
+		}
+		if ( !same_value(ca, cb) )
+			goto out;
+
+		if ( walk_into(ca) ) {
+			if ( !push_tag(&st, ca) )
+				goto out;
+			stack_top(&st)->peer = cb;
+		}
+	}
+
+	ret = 1;
+out:
+	stack_fini(&st);
+	return ret;
 }
 
-int nbt_string_set(nbt_tag_t t, const char *val)
+/* A frozen document is a header followed by the root tag, everything in
+ * it is found by offset so the buffer can go anywhere. Tags are laid out
+ * as in a tree but with TAG_FROZEN set and no parent. t_name is the
+ * offset of the name from the tag, names are NUL terminated and follow
+ * their length as a native uint16_t. t_u.t_off is the offset of the
+ * payload of an array or string, the values of a list of numbers or the
+ * array of children of any other list or compound. Things always come
+ * after the tag that refers to them and offsets are 32 bits, so frozen
+ * documents are limited to 4GB. Lists of numbers are always packed and
+ * compound members are sorted by name_cmp() for frozen_find().
+ */
+#define FROZEN_MAGIC	0x3146424eU	/* "NBF1" in native order */
+
+struct frozen_hdr {
+	uint32_t magic;
+	uint32_t len;
+};
+
+/* a list or compound whose children are still to be frozen */
+struct frz_todo {
+	struct nbt_tag *tag;
+	size_t off;
+};
+
+struct freezer {
+	uint8_t *base;
+	size_t len;
+	size_t cap;
+	struct frz_todo *todo;
+	size_t ntodo;
+	size_t todo_cap;
+	struct nbt_tag **sorted;
+	size_t sorted_cap;
+};
+
+/* offset of len more bytes, or 0 on failure. Padding is zeroed so that
+ * the same tree always freezes the same. The buffer may move.
+ */
+static size_t frz_alloc(struct freezer *z, size_t len, size_t align)
 {
-	char *str;
+	uint8_t *new;
+	size_t off, cap;
 
-	if ( NULL == t || t->t_type != NBT_TAG_String )
+	off = (z->len + align - 1) & ~(align - 1);
+	if ( off > UINT32_MAX || len > UINT32_MAX - off )
 		return 0;
 
-	str = strdup(val);
-	if ( NULL == str )
-		return 0;
+	for(cap = z->cap; cap < off + len; )
+		cap = (cap > SIZE_MAX / 2) ? off + len : cap * 2;
 
-	free(t->t_u.t_str);
-	t->t_u.t_str = str;
+	if ( cap != z->cap ) {
+		new = realloc(z->base, cap);
+		if ( NULL == new )
+			return 0;
+		z->base = new;
+		z->cap = cap;
+	}
 
-	return 1;
+	memset(z->base + z->len, 0, off - z->len);
+	z->len = off + len;
+	return off;
 }
 
-int nbt_list_set(nbt_tag_t t, unsigned idx, nbt_tag_t val)
+static struct nbt_tag *frz_node(struct freezer *z, size_t off)
 {
-	if ( NULL == t || t->t_type != NBT_TAG_List )
-		return 0;
-	if ( val->t_type != t->t_u.t_list.type )
-		return 0;
-	if ( idx > INT_MAX || (unsigned)t->t_u.t_list.len <= idx )
-		return 0;
-	t->t_u.t_list.array[idx] = val;
-	return 1;
+	return (struct nbt_tag *)(z->base + off);
+}
+
+/* room for the payload of the frozen tag at off */
+static uint8_t *frz_payload(struct freezer *z, size_t off,
+				size_t len, size_t align)
+{
+	size_t at;
+
+	at = frz_alloc(z, len, align);
+	if ( !at )
+		return NULL;
 
+	frz_node(z, off)->t_u.t_off = at - off;
+	return z->base + at;
 }
 
-int nbt_list_set_size(nbt_tag_t t, unsigned sz)
+static int frz_name(struct freezer *z, size_t off, const struct nbt_tag *t)
 {
-	nbt_tag_t *new;
+	const char *name;
+	uint16_t len;
+	size_t at, nlen;
 
-	if ( NULL == t || t->t_type != NBT_TAG_List )
-		return 0;
+	name = tag_name(t, &nlen);
+	len = nlen;
 
-	new = realloc(t->t_u.t_list.array, sz * sizeof(*new));
-	if ( NULL == new )
+	at = frz_alloc(z, sizeof(len) + len + 1, sizeof(len));
+	if ( !at )
 		return 0;
 
-	t->t_u.t_list.array = new;
-	t->t_u.t_list.len = sz;
+	memcpy(z->base + at, &len, sizeof(len));
+	if ( len )
+		memcpy(z->base + at + sizeof(len), name, len);
+	z->base[at + sizeof(len) + len] = '\0';
+	frz_node(z, off)->t_name = at + sizeof(len) - off;
 	return 1;
 }
 
-int nbt_list_append(nbt_tag_t t, nbt_tag_t val)
+static int frz_push(struct freezer *z, struct nbt_tag *t, size_t off)
+{
+	struct frz_todo *new;
+	size_t cap;
+
+	if ( z->ntodo == z->todo_cap ) {
+		cap = (z->todo_cap) ? z->todo_cap * 2 : 64;
+		new = realloc(z->todo, cap * sizeof(*new));
+		if ( NULL == new )
+			return 0;
+		z->todo = new;
+		z->todo_cap = cap;
+	}
+
+	z->todo[z->ntodo].tag = t;
+	z->todo[z->ntodo].off = off;
+	z->ntodo++;
+	return 1;
+}
+
+/* Copy the name and value of t to the frozen tag at off. The children of
+ * lists and compounds are left for later.
+ */
+static int freeze_tag(struct freezer *z, size_t off,
+			struct nbt_tag *t, int named)
 {
-	unsigned int idx = t->t_u.t_list.len;
-	if ( !nbt_list_set_size(t, t->t_u.t_list.len + 1) )
+	const void *src;
+	struct nbt_tag *n;
+	size_t esz, len;
+	uint8_t *dst;
+	int32_t i;
+	uint64_t v;
+
+	if ( !expand(t) )
 		return 0;
-	if ( !nbt_list_set(t, idx, val) )
+	if ( named && !frz_name(z, off, t) )
 		return 0;
-	return 1;
-}
 
-int nbt_compound_delete(nbt_tag_t t, const char *key)
-{
-	struct nbt_tag *c;
+	n = frz_node(z, off);
+	n->t_type = t->t_type;
+	n->t_flags = TAG_FROZEN;
+	n->t_len = t->t_len;
 
-	if ( NULL == t || t->t_type != NBT_TAG_Compound )
+	switch(t->t_type) {
+	case NBT_TAG_Byte_Array:
+	case NBT_TAG_String:
+		esz = 1;
+		break;
+	case NBT_TAG_Int_Array:
+		esz = sizeof(int32_t);
+		break;
+	case NBT_TAG_Long_Array:
+		esz = sizeof(int64_t);
+		break;
+	case NBT_TAG_List:
+		n->t_ltype = t->t_ltype;
+		esz = fixed_size(t->t_ltype);
+		if ( esz ) {
+			n->t_flags |= TAG_PACKED;
+			break;
+		}
+		/* fall through */
+	case NBT_TAG_Compound:
+		if ( t->t_len && !frz_push(z, t, off) )
+			return 0;
+		return 1;
+	default:
+		memcpy(&n->t_u, &t->t_u, fixed_size(t->t_type));
+		return 1;
+	}
+
+	/* strings keep their NUL */
+	len = t->t_len * esz;
+	dst = frz_payload(z, off, len + (t->t_type == NBT_TAG_String), esz);
+	if ( NULL == dst )
 		return 0;
+	if ( t->t_type == NBT_TAG_String )
+		dst[len] = '\0';
+	if ( !len )
+		return 1;
 
-	list_for_each_entry(c, &t->t_u.t_compound, t_list) {
-		if ( !strcmp(c->t_name, key) ) {
-			list_del(&t->t_list);
-			free_nbt_data(c);
-			return 1;
+	if ( t->t_type == NBT_TAG_List ) {
+		if ( t->t_flags & TAG_PACKED ) {
+			memcpy(dst, t->t_u.t_cont.vals, len);
+		}else{
+			for(i = 0; i < t->t_len; i++) {
+				v = list_elem(t, i);
+				memcpy(dst + i * esz, &v, esz);
+			}
 		}
+		return 1;
 	}
 
+	src = t->t_u.t_blob;
+	if ( t->t_flags & TAG_DATA_BORROWED )
+		wire(dst, src, t->t_len, esz, ORDER_BE, ORDER_HOST);
+	else
+		memcpy(dst, src, len);
 	return 1;
 }
 
-int nbt_compound_set(nbt_tag_t t, const char *key, nbt_tag_t val)
+static int frz_order(const void *a, const void *b)
 {
-	char *name;
+	const struct nbt_tag *x = *(struct nbt_tag * const *)a;
+	const struct nbt_tag *y = *(struct nbt_tag * const *)b;
 
-	if ( NULL == t || t->t_type != NBT_TAG_Compound )
-		return 0;
-
-	name = strdup(key);
-	if ( NULL == name )
-		return 0;
+	const char *xn, *yn;
+	size_t xlen, ylen;
 
-	free(val->t_name);
-	val->t_name = name;
-	nbt_compound_delete(t, key);
-	list_add_tail(&val->t_list, &t->t_u.t_compound);
-	return 1;
+	xn = tag_name(x, &xlen);
+	yn = tag_name(y, &ylen);
+	return name_cmp(xn, xlen, yn, ylen);
 }
 
-
-int nbt_list_nuke(nbt_tag_t t)
+/* members of compound t sorted by name, in z->sorted */
+static int frz_sort(struct freezer *z, struct nbt_tag *t)
 {
-	int32_t i;
+	struct nbt_tag **new;
 
-	if (NULL == t || t->t_type != NBT_TAG_List)
-		return 0;
-
-	for(i = 0; i < t->t_u.t_list.len; i++)
-		free_nbt_data(t->t_u.t_list.array[i]);
-	free(t->t_u.t_list.array);
+	if ( (size_t)t->t_len > z->sorted_cap ) {
+		new = realloc(z->sorted, t->t_len * sizeof(*new));
+		if ( NULL == new )
+			return 0;
+		z->sorted = new;
+		z->sorted_cap = t->t_len;
+	}
 
-	t->t_u.t_list.len = 0;
-	t->t_u.t_list.array = NULL;
+	memcpy(z->sorted, t->t_u.t_cont.kids->tag,
+		t->t_len * sizeof(*z->sorted));
+	qsort(z->sorted, t->t_len, sizeof(*z->sorted), frz_order);
 	return 1;
 }
 
-int nbt_compound_nuke(nbt_tag_t t)
+/* give the frozen list or compound at off its children */
+static int freeze_kids(struct freezer *z, struct nbt_tag *t, size_t off)
 {
-	if (NULL == t || t->t_type != NBT_TAG_Compound)
+	struct nbt_tag **kids, *c, empty;
+	int named = (t->t_type == NBT_TAG_Compound);
+	size_t at;
+	int32_t i;
+
+	at = frz_alloc(z, t->t_len * sizeof(*c), sizeof(uint64_t));
+	if ( !at )
 		return 0;
+	memset(z->base + at, 0, t->t_len * sizeof(*c));
+	frz_node(z, off)->t_u.t_off = at - off;
+
+	kids = t->t_u.t_cont.kids->tag;
+	if ( named ) {
+		if ( !frz_sort(z, t) )
+			return 0;
+		kids = z->sorted;
+	}
+
+	for(i = 0; i < t->t_len; i++) {
+		c = kids[i];
+		if ( NULL == c ) {
+			/* empty list slots freeze as an empty value */
+			memset(&empty, 0, sizeof(empty));
+			empty.t_type = t->t_ltype;
+			c = &empty;
+		}
+		if ( !freeze_tag(z, at + i * sizeof(*c), c, named) )
+			return 0;
+	}
 
-	/* TODO: compound nuke */
 	return 1;
 }
 
-static struct nbt_tag *new_node(struct _nbt *nbt, uint8_t type,
-				uint8_t list_type)
+void *nbt_freeze(nbt_t nbt, size_t *len)
 {
-	struct nbt_tag *tag;
+	struct freezer z;
+	struct frozen_hdr *hdr;
+	struct frz_todo todo;
+	size_t root;
+	void *ret;
 
-	if ( type >= NBT_TAG_MAX )
-		return NULL;
+	memset(&z, 0, sizeof(z));
 
-	/* use nbt_tag_new_list instead */
-	if ( type == NBT_TAG_List && list_type == NBT_TAG_End )
-		return NULL;
+	/* frozen is usually somewhat bigger than encoded */
+	z.cap = 2 * nbt_size_in_bytes(nbt);
+	if ( z.cap < 4096 )
+		z.cap = 4096;
+	z.base = malloc(z.cap);
+	if ( NULL == z.base )
+		goto err;
 
-	tag = hgang_alloc0(nbt->nodes);
-	if ( NULL == tag )
-		return NULL;
+	/* nothing is ever at offset 0 so that can mean failure */
+	memset(z.base, 0, sizeof(*hdr));
+	z.len = sizeof(*hdr);
 
-	tag->t_type = type;
+	root = frz_alloc(&z, sizeof(struct nbt_tag), sizeof(uint64_t));
+	if ( !root )
+		goto err;
+	memset(z.base + root, 0, sizeof(struct nbt_tag));
+	if ( !freeze_tag(&z, root, nbt->root, 1) )
+		goto err;
 
-	/* type specific initialisation */
-	switch(tag->t_type) {
-	case NBT_TAG_Compound:
-		INIT_LIST_HEAD(&tag->t_u.t_compound);
-	case NBT_TAG_List:
-		tag->t_u.t_list.type = list_type;
-		break;
-	default:
-		break;
+	while( z.ntodo ) {
+		todo = z.todo[--z.ntodo];
+		if ( !freeze_kids(&z, todo.tag, todo.off) )
+			goto err;
 	}
 
-	return tag;
-}
+	ret = realloc(z.base, z.len);
+	if ( NULL == ret )
+		ret = z.base;
 
-nbt_tag_t nbt_tag_new(nbt_t nbt, uint8_t type)
-{
-	return new_node(nbt, type, NBT_TAG_End);
-}
+	hdr = ret;
+	hdr->magic = FROZEN_MAGIC;
+	hdr->len = z.len;
+	*len = z.len;
 
-nbt_tag_t nbt_tag_new_list(nbt_t nbt, uint8_t type)
-{
-	return new_node(nbt, NBT_TAG_List, type);
+	free(z.todo);
+	free(z.sorted);
+	return ret;
+err:
+	free(z.base);
+	free(z.todo);
+	free(z.sorted);
+	return NULL;
 }
 
-char *nbt_tag_name(nbt_tag_t t)
+/* a frozen tag still to be checked, ltype is -1 for a compound member */
+struct frz_check {
+	size_t off;
+	int ltype;
+};
+
+/* payload of a frozen array, string or list of numbers at off */
+static int frz_check_payload(const uint8_t *base, size_t len, size_t off,
+				const struct nbt_tag *t, size_t esz)
 {
-	if ( NULL == t )
-		return NULL;
-	return t->t_name;
+	size_t at, nul = (t->t_type == NBT_TAG_String);
+
+	if ( t->t_u.t_off < sizeof(*t) || t->t_u.t_off > len - off )
+		return 0;
+	at = off + t->t_u.t_off;
+	if ( at % esz || len - at < nul ||
+			(size_t)t->t_len > (len - at - nul) / esz )
+		return 0;
+	if ( nul && base[at + t->t_len] != '\0' )
+		return 0;
+	return 1;
 }
 
-static void do_get_size(struct nbt_tag *tag, int type, size_t *sz)
+/* Check the frozen tag at off, which is known to be in the buffer and
+ * aligned. Its name and payload must be too, and its children are
+ * returned in *kids for the caller to check in turn.
+ */
+static int frz_check_tag(const uint8_t *base, size_t len,
+			const struct frz_check *c, size_t *kids)
 {
-	struct nbt_tag *c;
-	int32_t i;
+	const struct nbt_tag *t = (const struct nbt_tag *)(base + c->off);
+	size_t at, esz;
+	uint16_t nlen;
 
-	if ( type == TAG_NAMED ) {
-		*sz += 3 + strlen(tag->t_name);
+	*kids = 0;
+
+	if ( (t->t_flags & ~TAG_PACKED) != TAG_FROZEN )
+		return 0;
+	if ( t->t_type > NBT_TAG_Long_Array || t->t_len < 0 )
+		return 0;
+	if ( c->ltype >= 0 && t->t_type != c->ltype )
+		return 0;
+
+	if ( c->ltype < 0 ) {
+		if ( t->t_name < sizeof(*t) + sizeof(nlen) ||
+				t->t_name > len - c->off )
+			return 0;
+		at = c->off + t->t_name;
+		memcpy(&nlen, base + at - sizeof(nlen), sizeof(nlen));
+		if ( nlen >= len - at || base[at + nlen] != '\0' )
+			return 0;
+	}else if ( t->t_name ) {
+		return 0;
 	}
 
-	switch(tag->t_type) {
-	case NBT_TAG_Byte:
-		*sz += sizeof(uint8_t);
-		break;
-	case NBT_TAG_Short:
-		*sz += sizeof(int16_t);
-		break;
-	case NBT_TAG_Int:
-		*sz += sizeof(int32_t);
-		break;
-	case NBT_TAG_Long:
-		*sz += sizeof(int64_t);
-		break;
-	case NBT_TAG_Float:
-		*sz += sizeof(float);
-		break;
-	case NBT_TAG_Double:
-		*sz += sizeof(double);
-		break;
+	esz = (t->t_type == NBT_TAG_List) ? fixed_size(t->t_ltype) : 0;
+	if ( !!(t->t_flags & TAG_PACKED) != !!esz )
+		return 0;
+
+	switch(t->t_type) {
 	case NBT_TAG_Byte_Array:
-		*sz += sizeof(tag->t_u.t_blob.len) + tag->t_u.t_blob.len;
-		break;
 	case NBT_TAG_String:
-		*sz += sizeof(int16_t) + strlen(tag->t_u.t_str);
-		break;
+		return frz_check_payload(base, len, c->off, t, 1);
+	case NBT_TAG_Int_Array:
+		return frz_check_payload(base, len, c->off, t, sizeof(int32_t));
+	case NBT_TAG_Long_Array:
+		return frz_check_payload(base, len, c->off, t, sizeof(int64_t));
 	case NBT_TAG_List:
-		*sz += sizeof(uint8_t) + sizeof(int32_t);
-		for(i = 0; i < tag->t_u.t_list.len; i++)
-			do_get_size(tag->t_u.t_list.array[i], TAG_ANON, sz);
-		break;
+		if ( t->t_ltype > NBT_TAG_Long_Array )
+			return 0;
+		if ( esz )
+			return frz_check_payload(base, len, c->off, t, esz);
+		/* fall through */
 	case NBT_TAG_Compound:
-		list_for_each_entry(c, &tag->t_u.t_compound, t_list)
-			do_get_size(c, TAG_NAMED, sz);
-		*sz += 1;
-		break;
-	case NBT_TAG_Int_Array:
-		*sz += sizeof(tag->t_u.t_ints.len) +
-			(tag->t_u.t_ints.len * sizeof(int32_t));
-		break;
+		if ( !t->t_len )
+			return 1;
+		if ( t->t_u.t_off < sizeof(*t) ||
+				t->t_u.t_off > len - c->off )
+			return 0;
+		at = c->off + t->t_u.t_off;
+		if ( at % sizeof(uint64_t) ||
+				(size_t)t->t_len > (len - at) / sizeof(*t) )
+			return 0;
+		*kids = at;
+		return 1;
 	default:
-		break;
+		return 1;
 	}
 }
 
-size_t nbt_size_in_bytes(nbt_t nbt)
-{
-	size_t sz = 0;
-	do_get_size(&nbt->root, TAG_NAMED, &sz);
-	return sz;
-}
-
-static int do_get_bytes(struct nbt_tag *tag, int type,
-				uint8_t **pptr, uint8_t *end)
+/* Walk the whole of a frozen document making sure that nothing in it
+ * points outside of it. Offsets only ever point forwards, but children
+ * could still be shared, so no more tags are looked at than would fit.
+ */
+static int frz_check(const uint8_t *base, size_t len)
 {
-	uint8_t *ptr = *pptr;
-	struct nbt_tag *c;
-	int16_t slen;
+	struct frz_check *todo, *new, c;
+	size_t ntodo = 0, cap = 64, left, kids;
+	const struct nbt_tag *t;
 	int32_t i;
+	int ret = 0;
 
-	if ( type == TAG_NAMED ) {
-		slen = strlen(tag->t_name);
-
-		if ( ptr + 3 + slen > end )
-			return 0;
+	todo = malloc(cap * sizeof(*todo));
+	if ( NULL == todo )
+		return 0;
 
-		*ptr = tag->t_type;
-		ptr++;
+	todo[ntodo].off = sizeof(struct frozen_hdr);
+	todo[ntodo].ltype = -1;
+	ntodo++;
+	left = len / sizeof(*t) - 1;
 
-		*(int16_t *)ptr = htobe16(slen);
-		ptr += sizeof(int16_t);
+	while( ntodo ) {
+		c = todo[--ntodo];
+		if ( !frz_check_tag(base, len, &c, &kids) )
+			goto out;
+		if ( !kids )
+			continue;
 
-		memcpy(ptr, tag->t_name, slen);
-		ptr += slen;
-	}
+		t = (const struct nbt_tag *)(base + c.off);
+		if ( (size_t)t->t_len > left )
+			goto out;
+		left -= t->t_len;
 
-	switch(tag->t_type) {
-	case NBT_TAG_Byte:
-		if ( ptr + sizeof(uint8_t) > end )
-			return 0;
-		*ptr = tag->t_u.t_byte;
-		ptr += sizeof(uint8_t);
-		break;
-	case NBT_TAG_Short:
-		if ( ptr + sizeof(uint16_t) > end )
-			return 0;
-		*(int16_t *)ptr = htobe16(tag->t_u.t_short);
-		ptr += sizeof(int16_t);
-		break;
-	case NBT_TAG_Int:
-		if ( ptr + sizeof(uint32_t) > end )
-			return 0;
-		*(int32_t *)ptr = htobe32(tag->t_u.t_int);
-		ptr += sizeof(int32_t);
-		break;
-	case NBT_TAG_Long:
-		if ( ptr + sizeof(uint64_t) > end )
-			return 0;
-		*(int64_t *)ptr = htobe64(tag->t_u.t_long);
-		ptr += sizeof(int64_t);
-		break;
-	case NBT_TAG_Float:
-		if ( ptr + sizeof(float) > end )
-			return 0;
-		*(float *)ptr = htobe32((int32_t)tag->t_u.t_float);
-		ptr += sizeof(float);
-		break;
-	case NBT_TAG_Double:
-		if ( ptr + sizeof(double) > end )
-			return 0;
-		*(double *)ptr = htobe64((int64_t)tag->t_u.t_double);
-		ptr += sizeof(double);
-		break;
-	case NBT_TAG_Byte_Array:
-		if ( ptr + sizeof(int32_t) + tag->t_u.t_blob.len > end ) {
-			return 0;
+		if ( ntodo + t->t_len > cap ) {
+			while( ntodo + t->t_len > cap )
+				cap *= 2;
+			new = realloc(todo, cap * sizeof(*todo));
+			if ( NULL == new )
+				goto out;
+			todo = new;
 		}
-		*(int32_t *)ptr = htobe32(tag->t_u.t_blob.len);
-		ptr += sizeof(int32_t);
-		memcpy(ptr, tag->t_u.t_blob.array, tag->t_u.t_blob.len);
-		ptr += tag->t_u.t_blob.len;
-		break;
-	case NBT_TAG_String:
-		slen = strlen(tag->t_u.t_str);
-		if ( ptr + sizeof(int16_t) + slen > end )
-			return 0;
-		*(int16_t *)ptr = htobe16(slen);
-		memcpy(ptr + sizeof(int16_t), tag->t_u.t_str, slen);
-		ptr += sizeof(int16_t) + slen;
-		break;
-	case NBT_TAG_List:
-		if ( ptr +  sizeof(uint8_t) + sizeof(int32_t) > end )
-			return 0;
-		*ptr = tag->t_u.t_list.type;
-		ptr += sizeof(uint8_t);
-		*(int32_t *)ptr = htobe32(tag->t_u.t_list.len);
-		ptr += sizeof(int32_t);
-
-		for(i = 0; i < tag->t_u.t_list.len; i++)
-			if ( !do_get_bytes(tag->t_u.t_list.array[i],
-					TAG_ANON, &ptr, end) )
-				return 0;
-		break;
-	case NBT_TAG_Compound:
-		list_for_each_entry(c, &tag->t_u.t_compound, t_list)
-			if ( !do_get_bytes(c, TAG_NAMED, &ptr, end) )
-				return 0;
 
-		if ( ptr + sizeof(uint8_t) > end )
-			return 0;
-		*ptr = NBT_TAG_End;
-		ptr += sizeof(uint8_t);
-		break;
-	case NBT_TAG_Int_Array:
-		if ( ptr + sizeof(int32_t) +
-			(tag->t_u.t_ints.len * sizeof(int32_t)) > end ) {
-			return 0;
+		for(i = 0; i < t->t_len; i++) {
+			todo[ntodo].off = kids + i * sizeof(*t);
+			todo[ntodo].ltype = (t->t_type == NBT_TAG_List) ?
+						t->t_ltype : -1;
+			ntodo++;
 		}
-		*(int32_t *)ptr = htobe32(tag->t_u.t_ints.len);
-		ptr += sizeof(int32_t);
-		memcpy(ptr, tag->t_u.t_ints.array,
-			tag->t_u.t_ints.len * sizeof(int32_t));
-		ptr += tag->t_u.t_ints.len * sizeof(int32_t);
-		break;
-	default:
-		return 0;
 	}
 
-	*pptr = ptr;
-	return 1;
+	ret = 1;
+out:
+	free(todo);
+	return ret;
 }
 
-int nbt_get_bytes(nbt_t nbt, uint8_t *buf, size_t len)
+/* root tag of a frozen document, after checking all of it */
+nbt_tag_t nbt_frozen_root(const void *buf, size_t len)
+{
+	const struct frozen_hdr *hdr = buf;
+
+	if ( len < sizeof(*hdr) + sizeof(struct nbt_tag) )
+		return NULL;
+	if ( (uintptr_t)buf & (sizeof(uint64_t) - 1) )
+		return NULL;
+	if ( hdr->magic != FROZEN_MAGIC || hdr->len != len )
+		return NULL;
+	if ( !frz_check(buf, len) )
+		return NULL;
+
+	return (struct nbt_tag *)(hdr + 1);
+}
+
+static struct nbt_snap *snap_get(struct nbt_snap *s)
 {
-	uint8_t **pptr = &buf;
-	return do_get_bytes(&nbt->root, TAG_NAMED, pptr, buf + len);
+	__atomic_add_fetch(&s->ref, 1, __ATOMIC_RELAXED);
+	return s;
+}
+
+static void snap_put(struct nbt_snap *s)
+{
+	if ( s && 0 == __atomic_sub_fetch(&s->ref, 1, __ATOMIC_ACQ_REL) )
+		free(s);
 }
 
 static struct _nbt *create_nbt(void)
@@ -917,12 +4712,26 @@ static struct _nbt *create_nbt(void)
 	if ( NULL == nbt )
 		goto out;
 
-	nbt->nodes = hgang_new(sizeof(struct nbt_tag), 0);
+	nbt->nodes = hgang_new(sizeof(struct nbt_tag));
 	if ( NULL == nbt->nodes )
 		goto out_free;
 
+	hgang_set_priv(nbt->nodes, nbt);
+
+	nbt->mem = mpool_new(0);
+	if ( NULL == nbt->mem )
+		goto out_free_nodes;
+
+	nbt->root = hgang_alloc0(nbt->nodes);
+	if ( NULL == nbt->root )
+		goto out_free_mem;
+
 	goto out;
 
+out_free_mem:
+	mpool_free(nbt->mem);
+out_free_nodes:
+	hgang_free(nbt->nodes);
 out_free:
 	free(nbt);
 	nbt = NULL;
@@ -930,17 +4739,72 @@ out:
 	return nbt;
 }
 
-nbt_t nbt_decode(const uint8_t *buf, size_t len)
+/* Throw away the contents of nbt but keep the memory */
+static int reset_nbt(struct _nbt *nbt)
+{
+	hgang_reset(nbt->nodes);
+	mpool_reset(nbt->mem);
+	snap_put(nbt->share);
+	snap_put(nbt->snap);
+	nbt->share = nbt->snap = NULL;
+	nbt->src = NULL;
+	nbt->borrow = nbt->lazy = 0;
+
+	/* the strings went with the mpool */
+	if ( nbt->num_names )
+		memset(nbt->name_idx, 0,
+			(nbt->name_mask + 1) * sizeof(*nbt->name_idx));
+	nbt->num_names = 0;
+
+	nbt->root = hgang_alloc0(nbt->nodes);
+	return NULL != nbt->root;
+}
+
+static int decode_into(struct _nbt *nbt, const uint8_t *buf, size_t len,
+			int borrow, int lazy, int order)
+{
+	const uint8_t *ptr = buf, *end = buf + len;
+	const char *str;
+	int16_t slen;
+
+	/* borrowed sizes and offsets are 32bit */
+	if ( len > UINT32_MAX )
+		return 0;
+
+	nbt->src = (borrow) ? buf : NULL;
+	nbt->borrow = borrow;
+	nbt->lazy = lazy;
+	nbt->new_names = NBT_NEW_NAMES;
+
+	if ( !rd_u8(&ptr, end, &nbt->root->t_type) )
+		return 0;
+
+	if ( nbt->root->t_type != NBT_TAG_End ) {
+		if ( !rd_str(&ptr, end, &str, &slen, order) )
+			return 0;
+		nbt->root->t_name = decode_name(nbt, str, slen);
+		if ( NBT_ATOM_NONE == nbt->root->t_name )
+			return 0;
+	}
+
+	if ( order == ORDER_LE )
+		ptr = decode_tree_le(nbt, ptr, end, nbt->root);
+	else
+		ptr = decode_tree_be(nbt, ptr, end, nbt->root);
+
+	return NULL != ptr;
+}
+
+static struct _nbt *do_decode(const uint8_t *buf, size_t len,
+				int borrow, int lazy, int order)
 {
-	const uint8_t *ptr;
 	struct _nbt *nbt;
 
 	nbt = create_nbt();
 	if ( NULL == nbt )
 		return NULL;
 
-	ptr = decode_tag(nbt, buf, len, &nbt->root, TAG_NAMED);
-	if ( NULL == ptr ) {
+	if ( !decode_into(nbt, buf, len, borrow, lazy, order) ) {
 		nbt_free(nbt);
 		return NULL;
 	}
@@ -948,6 +4812,52 @@ nbt_t nbt_decode(const uint8_t *buf, size_t len)
 	return nbt;
 }
 
+nbt_t nbt_decode(const uint8_t *buf, size_t len)
+{
+	return do_decode(buf, len, 0, 0, ORDER_BE);
+}
+
+/* Decode without copying strings or arrays out of buf. The caller
+ * must keep buf alive and unmodified until nbt_free(). Borrowed payloads
+ * are copied on first mutable access (nbt_*_get() or a setter), use the
+ * nbt_*_peek() accessors for read-only access.
+ */
+nbt_t nbt_decode_borrowed(const uint8_t *buf, size_t len)
+{
+	return do_decode(buf, len, 1, 0, ORDER_BE);
+}
+
+/* Like nbt_decode_borrowed() but lists and compounds are only validated,
+ * their children are decoded the first time they're looked at. Subtrees
+ * which are never touched are copied straight from buf when encoding.
+ */
+nbt_t nbt_decode_lazy(const uint8_t *buf, size_t len)
+{
+	return do_decode(buf, len, 1, 1, ORDER_BE);
+}
+
+/* Little-endian documents are always decoded in full and copied */
+nbt_t nbt_decode_le(const uint8_t *buf, size_t len)
+{
+	return do_decode(buf, len, 0, 0, ORDER_LE);
+}
+
+/* Decode in to a document from an earlier nbt_decode*() or nbt_new(),
+ * replacing what's in it but reusing its memory, so that a loop over
+ * many documents stops allocating once it's warmed up. Tags from the old
+ * contents are gone. On error nbt is only good for nbt_free() or another
+ * nbt_decode_into().
+ */
+int nbt_decode_into(nbt_t nbt, const uint8_t *buf, size_t len)
+{
+	return reset_nbt(nbt) && decode_into(nbt, buf, len, 0, 0, ORDER_BE);
+}
+
+int nbt_decode_lazy_into(nbt_t nbt, const uint8_t *buf, size_t len)
+{
+	return reset_nbt(nbt) && decode_into(nbt, buf, len, 1, 1, ORDER_BE);
+}
+
 nbt_t nbt_new(void)
 {
 	struct _nbt *nbt;
@@ -956,21 +4866,79 @@ nbt_t nbt_new(void)
 	if ( NULL == nbt )
 		return NULL;
 
-	nbt->root.t_type = NBT_TAG_Compound;
-	nbt->root.t_name = strdup("");
-	if ( NULL == nbt->root.t_name ) {
+	nbt->root->t_type = NBT_TAG_Compound;
+	nbt->root->t_name = atom_intern("", 0);
+	if ( NBT_ATOM_NONE == nbt->root->t_name ) {
 		nbt_free(nbt);
 		return NULL;
 	}
-	INIT_LIST_HEAD(&nbt->root.t_u.t_compound);
+	nbt->root->t_u.t_cont.size = value_size(nbt->root);
 	return nbt;
 }
 
+/* (re-)encode nbt for cloning from */
+static int snapshot(struct _nbt *nbt)
+{
+	struct nbt_snap *s;
+	size_t len;
+
+	len = nbt_size_in_bytes(nbt);
+	if ( len > UINT32_MAX )
+		return 0;
+
+	s = malloc(sizeof(*s) + len);
+	if ( NULL == s )
+		return 0;
+
+	s->ref = 1;
+	s->len = len;
+	if ( !nbt_get_bytes(nbt, s->buf, len) ) {
+		free(s);
+		return 0;
+	}
+
+	snap_put(nbt->snap);
+	nbt->snap = s;
+	nbt->root->t_flags |= TAG_SNAPSHOT;
+	return 1;
+}
+
+/* Copy-on-write copy of a document. nbt is encoded once and clones are
+ * decoded lazily from that, borrowing payloads and copying untouched
+ * subtrees straight out of it when encoded, so a clone only costs what
+ * is looked at or changed. The encoding is reused for further clones of
+ * nbt, or of the clones, until they're modified. Writes through pointers
+ * from nbt_*_get() which were obtained before cloning aren't noticed.
+ * The shared encoding is refcounted atomically, so clones can be handed
+ * to and freed on other threads, but nbt_clone() itself uses nbt like any
+ * other call and mustn't race with it.
+ */
+nbt_t nbt_clone(nbt_t nbt)
+{
+	struct _nbt *c;
+
+	if ( !(nbt->root->t_flags & TAG_SNAPSHOT) && !snapshot(nbt) )
+		return NULL;
+
+	c = do_decode(nbt->snap->buf, nbt->snap->len, 1, 1, ORDER_BE);
+	if ( NULL == c )
+		return NULL;
+
+	c->share = snap_get(nbt->snap);
+	c->snap = snap_get(nbt->snap);
+	c->root->t_flags |= TAG_SNAPSHOT;
+	return c;
+}
+
 void nbt_free(nbt_t nbt)
 {
 	if ( nbt ) {
-		free_nbt_data(&nbt->root);
 		hgang_free(nbt->nodes);
+		mpool_free(nbt->mem);
+		snap_put(nbt->share);
+		snap_put(nbt->snap);
+		free(nbt->names);
+		free(nbt->name_idx);
 		free(nbt);
 	}
 }
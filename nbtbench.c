@@ -0,0 +1,439 @@
+/* Copyright (c) Gianni Tedesco 2011
+ * Author: Gianni Tedesco (gianni at scaramanga dot co dot uk)
+ *
+ * Measure NBT codec throughput over all the chunks in a region file
+*/
+#include <time.h>
+#include <zlib.h>
+
+#include <libmc/minecraft.h>
+#include <libmc/schematic.h>
+#include <libmc/chunk.h>
+#include <libmc/region.h>
+#include <libmc/nbt.h>
+
+static const char *cmd = "nbtbench";
+
+struct blob {
+	uint8_t *buf;
+	size_t sz;
+};
+
+static struct blob blobs[REGION_X * REGION_Z];
+static nbt_t docs[REGION_X * REGION_Z];
+static unsigned int num_blobs;
+static size_t total;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double begin, unsigned int iters)
+{
+	double secs = now() - begin;
+
+	printf("%16s: %8.1f MB/s %8.2f us/chunk\n", name,
+		(total * iters) / secs / 1e6,
+		secs * 1e6 / (num_blobs * iters));
+}
+
+static int load(const char *fn)
+{
+	region_t r;
+	uint8_t x, z;
+
+	r = region_open(fn);
+	if ( NULL == r )
+		return 0;
+
+	for(x = 0; x < REGION_X; x++) {
+		for(z = 0; z < REGION_Z; z++) {
+			const uint8_t *enc;
+			chunk_t c;
+			size_t sz;
+
+			c = region_get_chunk(r, x, z);
+			if ( NULL == c )
+				continue;
+
+			enc = chunk_encode(c, CHUNK_ENC_RAW, &sz);
+			if ( enc ) {
+				blobs[num_blobs].buf = malloc(sz);
+				if ( blobs[num_blobs].buf ) {
+					memcpy(blobs[num_blobs].buf, enc, sz);
+					blobs[num_blobs].sz = sz;
+					total += sz;
+					num_blobs++;
+				}
+			}
+			chunk_put(c);
+		}
+	}
+
+	region_put(r);
+	return num_blobs != 0;
+}
+
+static void bench_decode(const char *name, unsigned int iters,
+				nbt_t (*decode)(const uint8_t *, size_t))
+{
+	unsigned int i, j;
+	double begin;
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			nbt_t nbt;
+			nbt = (*decode)(blobs[j].buf, blobs[j].sz);
+			if ( NULL == nbt )
+				abort();
+			nbt_free(nbt);
+		}
+	}
+	report(name, begin, iters);
+}
+
+/* the same, but decoding in to one document over and over */
+static void bench_decode_into(const char *name, unsigned int iters,
+			int (*decode)(nbt_t, const uint8_t *, size_t))
+{
+	unsigned int i, j;
+	double begin;
+	nbt_t nbt;
+
+	nbt = nbt_new();
+	if ( NULL == nbt )
+		abort();
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			if ( !(*decode)(nbt, blobs[j].buf, blobs[j].sz) )
+				abort();
+		}
+	}
+	report(name, begin, iters);
+
+	nbt_free(nbt);
+}
+
+static void bench_parse(unsigned int iters)
+{
+	static const struct nbt_visitor v;
+	unsigned int i, j;
+	double begin;
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			if ( !nbt_parse(blobs[j].buf, blobs[j].sz, &v, NULL) )
+				abort();
+		}
+	}
+	report("parse", begin, iters);
+}
+
+static int count_match(void *priv, uint8_t type,
+			const uint8_t *data, size_t len)
+{
+	unsigned int *cnt = priv;
+	(*cnt)++;
+	return 1;
+}
+
+/* whole chunk inflated then parsed, vs. parsed as it's inflated */
+static void bench_stream(unsigned int iters)
+{
+	static const struct nbt_visitor v;
+	static struct blob z[REGION_X * REGION_Z];
+	unsigned int i, j;
+	uLongf dlen;
+	double begin;
+	uint8_t *buf;
+
+	for(j = 0; j < num_blobs; j++) {
+		dlen = compressBound(blobs[j].sz);
+		z[j].buf = malloc(dlen);
+		if ( NULL == z[j].buf )
+			abort();
+		if ( compress(z[j].buf, &dlen, blobs[j].buf,
+				blobs[j].sz) != Z_OK )
+			abort();
+		z[j].sz = dlen;
+	}
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			dlen = blobs[j].sz;
+			buf = malloc(dlen);
+			if ( NULL == buf )
+				abort();
+			if ( uncompress(buf, &dlen, z[j].buf, z[j].sz) != Z_OK )
+				abort();
+			if ( !nbt_parse(buf, dlen, &v, NULL) )
+				abort();
+			free(buf);
+		}
+	}
+	report("inflate_parse", begin, iters);
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			if ( !libmc_inflate_parse(LIBMC_DEFLATE_ZLIB,
+					z[j].buf, z[j].sz, &v, NULL) )
+				abort();
+		}
+	}
+	report("stream_parse", begin, iters);
+
+	for(j = 0; j < num_blobs; j++)
+		free(z[j].buf);
+}
+
+static void bench_path(const char *name, const char *path,
+			unsigned int iters)
+{
+	unsigned int i, j, cnt = 0;
+	nbt_path_t p;
+	double begin;
+
+	p = nbt_path_compile(path);
+	if ( NULL == p )
+		abort();
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			if ( !nbt_path_eval(p, blobs[j].buf, blobs[j].sz,
+						count_match, &cnt) )
+				abort();
+		}
+	}
+	report(name, begin, iters);
+
+	nbt_path_free(p);
+}
+
+static void bench_encode(unsigned int iters)
+{
+	unsigned int i, j;
+	double begin;
+	uint8_t *buf;
+
+	for(j = 0; j < num_blobs; j++) {
+		docs[j] = nbt_decode(blobs[j].buf, blobs[j].sz);
+		if ( NULL == docs[j] )
+			abort();
+	}
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			if ( nbt_size_in_bytes(docs[j]) != blobs[j].sz )
+				abort();
+		}
+	}
+	report("size", begin, iters);
+
+	buf = malloc(total);
+	if ( NULL == buf )
+		abort();
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			if ( !nbt_get_bytes(docs[j], buf, blobs[j].sz) )
+				abort();
+		}
+	}
+	report("encode", begin, iters);
+
+	free(buf);
+	for(j = 0; j < num_blobs; j++)
+		nbt_free(docs[j]);
+}
+
+static void bench_clone(unsigned int iters)
+{
+	unsigned int i, j;
+	double begin;
+	nbt_t nbt;
+
+	for(j = 0; j < num_blobs; j++) {
+		docs[j] = nbt_decode(blobs[j].buf, blobs[j].sz);
+		if ( NULL == docs[j] )
+			abort();
+	}
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			nbt = nbt_clone(docs[j]);
+			if ( NULL == nbt )
+				abort();
+			nbt_free(nbt);
+		}
+	}
+	report("clone", begin, iters);
+
+	for(j = 0; j < num_blobs; j++)
+		nbt_free(docs[j]);
+}
+
+static unsigned int lookup(nbt_tag_t root, nbt_atom_t level, nbt_atom_t xpos)
+{
+	int32_t x;
+
+	if ( !nbt_int_get(nbt_compound_get_atom(
+			nbt_compound_get_atom(root, level), xpos), &x) )
+		abort();
+	return x;
+}
+
+static void bench_freeze(unsigned int iters)
+{
+	nbt_atom_t level = nbt_atom("Level"), xpos = nbt_atom("xPos");
+	static void *frozen[REGION_X * REGION_Z];
+	static size_t lens[REGION_X * REGION_Z];
+	unsigned int i, j, sum = 0;
+	size_t flen = 0;
+	double begin;
+
+	for(j = 0; j < num_blobs; j++) {
+		docs[j] = nbt_decode(blobs[j].buf, blobs[j].sz);
+		if ( NULL == docs[j] )
+			abort();
+	}
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			free(frozen[j]);
+			frozen[j] = nbt_freeze(docs[j], &lens[j]);
+			if ( NULL == frozen[j] )
+				abort();
+			if ( !i )
+				flen += lens[j];
+		}
+	}
+	report("freeze", begin, iters);
+	printf("%16s: %zu bytes\n", "frozen", flen);
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++)
+			sum += lookup(nbt_root_tag(docs[j]), level, xpos);
+	}
+	report("get_tree", begin, iters);
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			sum -= lookup(nbt_frozen_root(frozen[j], lens[j]),
+					level, xpos);
+		}
+	}
+	report("get_frozen", begin, iters);
+
+	if ( sum )
+		abort();
+
+	for(j = 0; j < num_blobs; j++) {
+		free(frozen[j]);
+		nbt_free(docs[j]);
+	}
+}
+
+static void bench_le(unsigned int iters)
+{
+	static uint8_t *le[REGION_X * REGION_Z];
+	unsigned int i, j;
+	double begin;
+
+	for(j = 0; j < num_blobs; j++) {
+		docs[j] = nbt_decode(blobs[j].buf, blobs[j].sz);
+		le[j] = malloc(blobs[j].sz);
+		if ( NULL == docs[j] || NULL == le[j] )
+			abort();
+		if ( !nbt_get_bytes_le(docs[j], le[j], blobs[j].sz) )
+			abort();
+		nbt_free(docs[j]);
+	}
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			nbt_t nbt;
+			nbt = nbt_decode_le(le[j], blobs[j].sz);
+			if ( NULL == nbt )
+				abort();
+			nbt_free(nbt);
+		}
+	}
+	report("decode_le", begin, iters);
+
+	for(j = 0; j < num_blobs; j++) {
+		docs[j] = nbt_decode_le(le[j], blobs[j].sz);
+		if ( NULL == docs[j] )
+			abort();
+	}
+
+	begin = now();
+	for(i = 0; i < iters; i++) {
+		for(j = 0; j < num_blobs; j++) {
+			if ( !nbt_get_bytes_le(docs[j], le[j], blobs[j].sz) )
+				abort();
+		}
+	}
+	report("encode_le", begin, iters);
+
+	for(j = 0; j < num_blobs; j++) {
+		free(le[j]);
+		nbt_free(docs[j]);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int iters = 20;
+
+	if ( argc )
+		cmd = argv[0];
+
+	if ( argc < 2 ) {
+		fprintf(stderr, "Usage:\n\t%s <region-file> [iterations]\n",
+			cmd);
+		return EXIT_FAILURE;
+	}
+
+	if ( argc > 2 )
+		iters = atoi(argv[2]);
+
+	if ( !load(argv[1]) ) {
+		fprintf(stderr, "%s: %s: no chunks loaded\n", cmd, argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	printf("%u chunks, %zu bytes\n", num_blobs, total);
+
+	bench_decode("decode", iters, nbt_decode);
+	bench_decode("decode_borrowed", iters, nbt_decode_borrowed);
+	bench_decode("decode_lazy", iters, nbt_decode_lazy);
+	bench_decode_into("decode_into", iters, nbt_decode_into);
+	bench_decode_into("lazy_into", iters, nbt_decode_lazy_into);
+	bench_parse(iters);
+	bench_stream(iters);
+	bench_path("path_xpos", "Level.xPos", iters);
+	bench_path("path_blocks", "Level.Sections[*].Blocks", iters);
+	bench_encode(iters);
+	bench_clone(iters);
+	bench_freeze(iters);
+	bench_le(iters);
+
+	return EXIT_SUCCESS;
+}
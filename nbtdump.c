@@ -8,50 +8,141 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include <libmc/nbt.h>
 
-static int mapfile(int fd, const uint8_t **begin, size_t *sz)
+struct dump {
+	unsigned int depth;
+};
+
+static void dump_name(struct dump *d, uint8_t type,
+			const char *name, size_t nlen)
 {
-	struct stat st;
+	printf("%*c Tag_%s '%.*s'", 2 * d->depth, ' ',
+		nbt_type_name(type), (int)nlen, name ? name : "");
+}
 
-	if ( fstat(fd, &st) ) {
-		perror("fstat()");
-		return 0;
-	}
+static int begin_compound(void *priv, const char *name, size_t nlen)
+{
+	struct dump *d = priv;
+	dump_name(d, NBT_TAG_Compound, name, nlen);
+	printf(" {\n");
+	d->depth++;
+	return NBT_VISIT_OK;
+}
 
-	*begin = mmap(NULL, st.st_size, PROT_READ,
-			MAP_SHARED, fd, 0);
+static int begin_list(void *priv, const char *name, size_t nlen,
+			uint8_t type, int32_t len)
+{
+	struct dump *d = priv;
+	dump_name(d, NBT_TAG_List, name, nlen);
+	printf(" type = %s [%d] = {\n", nbt_type_name(type), len);
+	d->depth++;
+	return NBT_VISIT_OK;
+}
 
-	if ( *begin == MAP_FAILED ) {
-		return 0;
+static int end(void *priv)
+{
+	struct dump *d = priv;
+	d->depth--;
+	printf("%*c }\n", d->depth * 2, ' ');
+	return NBT_VISIT_OK;
+}
+
+static int scalar(void *priv, const char *name, size_t nlen,
+			uint8_t type, const union nbt_value *val)
+{
+	struct dump *d = priv;
+
+	dump_name(d, type, name, nlen);
+	switch(type) {
+	case NBT_TAG_Byte:
+		printf(" = %d\n", val->b);
+		break;
+	case NBT_TAG_Short:
+		printf(" = %d\n", val->s);
+		break;
+	case NBT_TAG_Int:
+		printf(" = %"PRId32"\n", val->i);
+		break;
+	case NBT_TAG_Long:
+		printf(" = %"PRId64"\n", val->l);
+		break;
+	case NBT_TAG_Float:
+		printf(" = %f\n", val->f);
+		break;
+	case NBT_TAG_Double:
+		printf(" = %F\n", val->d);
+		break;
+	default:
+		printf("\n");
+		break;
 	}
+	return NBT_VISIT_OK;
+}
 
-	*sz = st.st_size;
+static int array(void *priv, const char *name, size_t nlen,
+			uint8_t type, const void *data, int32_t len)
+{
+	struct dump *d = priv;
 
-	return 1;
+	dump_name(d, type, name, nlen);
+	switch(type) {
+	case NBT_TAG_Byte_Array:
+		printf(" = %d bytes\n", len);
+		break;
+	case NBT_TAG_Int_Array:
+		printf(" = %d ints\n", len);
+		break;
+	case NBT_TAG_Long_Array:
+		printf(" = %d longs\n", len);
+		break;
+	case NBT_TAG_String:
+		printf(" = '%.*s'\n", len, (const char *)data);
+		break;
+	default:
+		printf("\n");
+		break;
+	}
+	return NBT_VISIT_OK;
 }
 
+static const struct nbt_visitor dumper = {
+	.begin_compound = begin_compound,
+	.end_compound = end,
+	.begin_list = begin_list,
+	.end_list = end,
+	.scalar = scalar,
+	.array = array,
+};
+
+/* stdin is parsed as it's read, gzip'd input is inflated on the way */
 int main(int argc, char **argv)
 {
-	const uint8_t *map;
-	size_t sz;
-	nbt_t nbt;
+	struct dump d = { .depth = 0 };
+	uint8_t buf[32768];
+	nbt_parser_t p;
+	int ret, rc;
+	gzFile gz;
 
-	if ( !mapfile(STDIN_FILENO, &map, &sz) )
+	gz = gzdopen(STDIN_FILENO, "r");
+	if ( NULL == gz )
 		return EXIT_FAILURE;
 
-	nbt = nbt_decode(map, sz);
-	if ( NULL == nbt )
+	p = nbt_parser_new(&dumper, &d);
+	if ( NULL == p ) {
+		gzclose(gz);
 		return EXIT_FAILURE;
+	}
 
-	munmap((void *)map, sz);
+	do {
+		ret = gzread(gz, buf, sizeof(buf));
+		rc = (ret >= 0) && nbt_parser_feed(p, buf, ret);
+	}while( rc && ret > 0 );
 
-	nbt_dump(nbt);
-	nbt_free(nbt);
-	return EXIT_SUCCESS;
+	gzclose(gz);
+	rc = nbt_parser_finish(p) && rc;
+	return (rc) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
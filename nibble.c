@@ -0,0 +1,200 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ *
+ * Data, SkyLight and BlockLight are stored as 4 bit values two to a
+ * byte, the even block in the low half. chunk.c works on a byte per
+ * block, so sections are spread out when they're unpacked and squashed
+ * back together when they're written. Both directions are a mask and a
+ * shift plus an interleave or a narrowing, which the vector kernels do
+ * a register at a time.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <simd.h>
+#include <nibble.h>
+
+static void unpack_scalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i;
+
+	for(i = 0; i < n / 2; i++) {
+		dst[2 * i] = src[i] & 0x0f;
+		dst[2 * i + 1] = src[i] >> 4;
+	}
+}
+
+static void pack_scalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i;
+
+	for(i = 0; i < n / 2; i++)
+		dst[i] = (src[2 * i] & 0x0f) | (src[2 * i + 1] << 4);
+}
+
+#if defined(__SSE2__)
+static size_t unpack_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m128i lo = _mm_set1_epi8(0x0f);
+	size_t i;
+
+	for(i = 0; i + 32 <= n; i += 32) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i / 2));
+		__m128i ev = _mm_and_si128(x, lo);
+		__m128i od = _mm_and_si128(_mm_srli_epi16(x, 4), lo);
+		_mm_storeu_si128((__m128i *)(dst + i),
+				_mm_unpacklo_epi8(ev, od));
+		_mm_storeu_si128((__m128i *)(dst + i + 16),
+				_mm_unpackhi_epi8(ev, od));
+	}
+
+	return i;
+}
+
+/* each 16bit word holds an even nibble in its low byte and the odd one
+ * above it, squash them in to the low byte and then narrow
+ */
+static size_t pack_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m128i ev = _mm_set1_epi16(0x000f);
+	const __m128i od = _mm_set1_epi16(0x00f0);
+	size_t i;
+
+	for(i = 0; i + 32 <= n; i += 32) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+		a = _mm_or_si128(_mm_and_si128(a, ev),
+				_mm_and_si128(_mm_srli_epi16(a, 4), od));
+		b = _mm_or_si128(_mm_and_si128(b, ev),
+				_mm_and_si128(_mm_srli_epi16(b, 4), od));
+		_mm_storeu_si128((__m128i *)(dst + i / 2),
+				_mm_packus_epi16(a, b));
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t unpack_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m256i ev = _mm256_set1_epi16(0x000f);
+	const __m256i od = _mm256_set1_epi16(0x0f00);
+	size_t i;
+
+	for(i = 0; i + 32 <= n; i += 32) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i / 2));
+		__m256i w = _mm256_cvtepu8_epi16(x);
+		w = _mm256_or_si256(_mm256_and_si256(w, ev),
+				_mm256_and_si256(_mm256_slli_epi16(w, 4), od));
+		_mm256_storeu_si256((__m256i *)(dst + i), w);
+	}
+
+	return i;
+}
+
+/* packus works within 128bit lanes so the quadwords come out as
+ * a0 b0 a1 b1 and need putting back in order
+ */
+__attribute__((target("avx2")))
+static size_t pack_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m256i ev = _mm256_set1_epi16(0x000f);
+	const __m256i od = _mm256_set1_epi16(0x00f0);
+	size_t i;
+
+	for(i = 0; i + 64 <= n; i += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+		a = _mm256_or_si256(_mm256_and_si256(a, ev),
+				_mm256_and_si256(_mm256_srli_epi16(a, 4), od));
+		b = _mm256_or_si256(_mm256_and_si256(b, ev),
+				_mm256_and_si256(_mm256_srli_epi16(b, 4), od));
+		a = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b),
+				_MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i *)(dst + i / 2), a);
+	}
+
+	return i;
+}
+#elif defined(__ARM_NEON)
+static size_t unpack_neon(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const uint8x16_t lo = vdupq_n_u8(0x0f);
+	size_t i;
+
+	for(i = 0; i + 32 <= n; i += 32) {
+		uint8x16_t x = vld1q_u8(src + i / 2);
+		uint8x16x2_t y;
+
+		y.val[0] = vandq_u8(x, lo);
+		y.val[1] = vshrq_n_u8(x, 4);
+		vst2q_u8(dst + i, y);
+	}
+
+	return i;
+}
+
+static size_t pack_neon(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const uint8x16_t lo = vdupq_n_u8(0x0f);
+	size_t i;
+
+	for(i = 0; i + 32 <= n; i += 32) {
+		uint8x16x2_t x = vld2q_u8(src + i);
+
+		vst1q_u8(dst + i / 2, vorrq_u8(vandq_u8(x.val[0], lo),
+						vshlq_n_u8(x.val[1], 4)));
+	}
+
+	return i;
+}
+#endif
+
+#if defined(__SSE2__)
+static const struct simd_kernels kern_unpack = {
+	.sse2 = unpack_sse2,
+	.avx2 = unpack_avx2,
+};
+static const struct simd_kernels kern_pack = {
+	.sse2 = pack_sse2,
+	.avx2 = pack_avx2,
+};
+#elif defined(__ARM_NEON)
+static const struct simd_kernels kern_unpack = {
+	.neon = unpack_neon,
+};
+static const struct simd_kernels kern_pack = {
+	.neon = pack_neon,
+};
+#else
+static const struct simd_kernels kern_unpack, kern_pack;
+#endif
+
+/* kernels count in nibbles, so a whole vector of packed input is twice
+ * its width in nibbles and the scalar loops pick up at done / 2 bytes in
+ * the packed array
+ */
+void nibble_unpack(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t done;
+
+	done = simd_run(&kern_unpack, dst, src, n);
+	unpack_scalar(dst + done, src + done / 2, n - done);
+}
+
+void nibble_pack(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t done;
+
+	done = simd_run(&kern_pack, dst, src, n);
+	pack_scalar(dst + done / 2, src + done, n - done);
+}
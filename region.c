@@ -8,6 +8,7 @@
 #define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -19,6 +20,7 @@
 #include <libmc/schematic.h>
 #include <libmc/chunk.h>
 #include <libmc/region.h>
+#include <libmc/nbt.h>
 
 /* chunk data stored at 4KB granularity */
 #define INTERNAL_CHUNK_SHIFT	12
@@ -38,6 +40,8 @@ struct _region {
 	uint32_t locs[REGION_X * REGION_Z];
 	uint32_t ts[REGION_X * REGION_Z];
 	chunk_t chunks[REGION_X * REGION_Z];
+	/* nbt_hash_bytes() of what's on disk, 0 if we never looked */
+	uint64_t hash[REGION_X * REGION_Z];
 	char *path;
 	unsigned int ref;
 	int fd;
@@ -240,15 +244,16 @@ void region_set_timestamp(region_t r, uint8_t x, uint8_t z, uint32_t ts)
 	r->ts[x * REGION_X + z] = htobe32(ts);
 }
 
-chunk_t region_get_chunk(region_t r, uint8_t x, uint8_t z)
+/* read and inflate the on-disk copy of a chunk, NULL if there isn't one */
+static uint8_t *load_chunk(struct _region *r, uint8_t x, uint8_t z,
+				size_t *dlen)
 {
 	const struct rchunk_hdr *hdr;
-	size_t len, dlen;
 	uint8_t *buf, *ptr;
-	chunk_t c;
+	size_t len;
 
 	if ( !get_chunk(r, x, z, &buf, &len) )
-		return 0;
+		return NULL;
 
 	/* XXX: not allocated */
 	if ( buf == NULL ) {
@@ -278,22 +283,74 @@ chunk_t region_get_chunk(region_t r, uint8_t x, uint8_t z)
 		goto err_free;
 	}
 
-	ptr = region_decompress(ptr, len, &dlen);
+	ptr = region_decompress(ptr, len, dlen);
 	free(buf);
-	if ( NULL == ptr )
-		goto err;
+	return ptr;
+err_free:
+	free(buf);
+	return NULL;
+}
 
-	c = chunk_from_bytes(ptr, dlen);
-	free(ptr);
+chunk_t region_get_chunk(region_t r, uint8_t x, uint8_t z)
+{
+	uint8_t *ptr;
+	size_t dlen;
+	chunk_t c;
+
+	/* one we're editing is newer than what's on disk */
+	if ( x < REGION_X && z < REGION_Z && r->chunks[x * REGION_X + z] )
+		return chunk_get(r->chunks[x * REGION_X + z]);
+
+	ptr = load_chunk(r, x, z, &dlen);
+	if ( NULL == ptr )
+		return NULL;
 
 	/* don't increment refcount because we don't
 	 * keep a reference to it, this belongs to caller
 	 */
+	c = chunk_from_buffer(ptr, dlen);
+	if ( c )
+		r->hash[x * REGION_X + z] = chunk_hash(c);
 	return c;
-err_free:
+}
+
+/* Stream a chunk through nbt visitor callbacks, inflating as we go */
+int region_parse_chunk(region_t r, uint8_t x, uint8_t z,
+			const struct nbt_visitor *v, void *priv)
+{
+	const struct rchunk_hdr *hdr;
+	int format, rc = 0;
+	uint8_t *buf;
+	size_t len;
+
+	if ( !get_chunk(r, x, z, &buf, &len) )
+		return 0;
+
+	if ( buf == NULL )
+		return 0;
+
+	hdr = (struct rchunk_hdr *)buf;
+	len -= sizeof(*hdr);
+
+	if ( be32toh(hdr->c_len) > len )
+		goto out;
+	len = be32toh(hdr->c_len);
+
+	switch(hdr->c_encoding) {
+	case RCHUNK_GZIP:
+		format = LIBMC_DEFLATE_GZIP;
+		break;
+	case RCHUNK_ZLIB:
+		format = LIBMC_DEFLATE_ZLIB;
+		break;
+	default:
+		goto out;
+	}
+
+	rc = libmc_inflate_parse(format, buf + sizeof(*hdr), len, v, priv);
+out:
 	free(buf);
-err:
-	return NULL;
+	return rc;
 }
 
 int region_set_chunk(region_t r, uint8_t x, uint8_t z, chunk_t c)
@@ -307,9 +364,45 @@ int region_set_chunk(region_t r, uint8_t x, uint8_t z, chunk_t c)
 	return 1;
 }
 
+/* hashes only say a chunk is probably unchanged, check the tree */
+static int same_as_disk(struct _region *r, unsigned int i, chunk_t c)
+{
+	uint8_t *old;
+	size_t olen;
+	int ret;
+
+	old = load_chunk(r, i / REGION_X, i % REGION_X, &olen);
+	if ( NULL == old )
+		return 0;
+
+	ret = chunk_same(c, old, olen);
+	free(old);
+	return ret;
+}
+
+/* copy existing chunk i from the old file to page pgno of fd */
+static int copy_existing(struct _region *r, int fd, unsigned int i,
+			unsigned int *pgno)
+{
+	uint8_t *buf;
+	ssize_t ret;
+	size_t sz;
+
+	if ( !read_from_loc(r, i, &buf, &sz) )
+		return 0;
+
+	ret = pwrite(fd, buf, sz, *pgno << INTERNAL_CHUNK_SHIFT);
+	free(buf);
+	if ( ret < 0 || (size_t)ret != sz )
+		return 0;
+
+	r->locs[i] = htobe32(*pgno << 8 | (CSIZE_IN_PAGES(sz) & 0xff));
+	*pgno += CSIZE_IN_PAGES(sz);
+	return 1;
+}
+
 int region_save(region_t r)
 {
-	struct rchunk_hdr *hdr;
 	unsigned int i, pgno;
 	ssize_t ret;
 	char *path;
@@ -330,10 +423,12 @@ int region_save(region_t r)
 	/* write out chunk data */
 	for(i = 0, pgno = 2; i < REGION_X * REGION_Z; i++) {
 		if ( r->chunks[i] ) {
+			struct rchunk_hdr hdr;
+			struct iovec iov[2];
 			size_t clen, tlen;
 			const uint8_t *cbuf;
-			uint8_t *buf, *ptr;
 			int32_t x, z;
+			uint64_t h;
 
 			x = (r->x * REGION_X) + (i % REGION_X);
 			z = (r->z * REGION_Z) + (i / REGION_X);
@@ -341,30 +436,40 @@ int region_save(region_t r)
 			if ( !chunk_set_pos(r->chunks[i], x, z) )
 				goto out_close;
 
+			/* dirty but no different to what's on disk, so
+			 * don't bother compressing it again
+			 */
+			h = chunk_hash(r->chunks[i]);
+			if ( !h )
+				goto out_close;
+			if ( h == r->hash[i] && r->locs[i] &&
+					same_as_disk(r, i, r->chunks[i]) ) {
+				if ( !copy_existing(r, fd, i, &pgno) )
+					goto out_close;
+				chunk_put(r->chunks[i]);
+				r->chunks[i] = NULL;
+				continue;
+			}
+
 			/* get compressed chunk data */
 			cbuf = chunk_encode(r->chunks[i],
 						CHUNK_ENC_ZLIB, &clen);
 			if ( NULL == cbuf )
 				goto out_close;
 
-			/* wrap it up with header */
-			tlen = clen + sizeof(*hdr);
-			buf = malloc(tlen);
-			if ( NULL == buf ) {
-				goto out_close;
-			}
-
-			hdr = (struct rchunk_hdr *)buf;
-			hdr->c_len = htobe32(clen);
-			hdr->c_encoding = RCHUNK_ZLIB;
+			/* header and cached data go out together, no copy */
+			tlen = clen + sizeof(hdr);
+			hdr.c_len = htobe32(clen);
+			hdr.c_encoding = RCHUNK_ZLIB;
 
-			ptr = buf + sizeof(*hdr);
-			memcpy(ptr, cbuf, clen);
+			iov[0].iov_base = &hdr;
+			iov[0].iov_len = sizeof(hdr);
+			iov[1].iov_base = (void *)cbuf;
+			iov[1].iov_len = clen;
 
 			/* write it out */
-			ret = pwrite(fd, buf, tlen,
+			ret = pwritev(fd, iov, 2,
 					pgno << INTERNAL_CHUNK_SHIFT);
-			free(buf);
 			if ( ret < 0 || (size_t)ret != tlen )
 				goto out_close;
 
@@ -373,21 +478,12 @@ int region_save(region_t r)
 					(CSIZE_IN_PAGES(tlen) & 0xff));
 
 			pgno += CSIZE_IN_PAGES(tlen);
+			r->hash[i] = h;
 			chunk_put(r->chunks[i]);
 			r->chunks[i] = NULL;
 		}else if ( r->locs[i] ) {
-			uint8_t *buf;
-			size_t sz;
-
-			/* copy existing */
-			if ( !read_from_loc(r, i, &buf, &sz) )
+			if ( !copy_existing(r, fd, i, &pgno) )
 				goto out_close;
-			ret = pwrite(fd, buf, sz,
-					pgno << INTERNAL_CHUNK_SHIFT);
-			free(buf);
-			if ( ret < 0 || (size_t)ret != sz )
-				goto out_close;
-			pgno += CSIZE_IN_PAGES(sz);
 		}
 	}
 
@@ -497,13 +593,18 @@ int region_paste_schematic(region_t r, schematic_t s, int x, int y, int z)
 	for(tx = xmin; tx < xmax; tx++, x -= CHUNK_X) {
 		for(tz = zmin; tz < zmax; tz++, z -= CHUNK_Z) {
 			chunk_t c;
+			size_t len;
 			int ret;
 
-			if ( chunk_lookup(r, tx, tz, NULL, NULL) ) {
-				c = region_get_chunk(r, tx, tz);
-			}else{
+			if ( !chunk_lookup(r, tx, tz, NULL, &len) )
+				return 0;
+
+			/* a stored chunk we can't read is an error, rather
+			 * than being silently replaced with an empty one
+			 */
+			c = region_get_chunk(r, tx, tz);
+			if ( NULL == c && !len )
 				c = chunk_new();
-			}
 			if ( NULL == c )
 				return 0;
 			if ( !region_set_chunk(r, tx, tz, c) ) {
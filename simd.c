@@ -0,0 +1,40 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ *
+ * Run time choice between the vector kernels in bswap.c and nibble.c.
+ * SSE2 and NEON are known at build time, AVX2 has to be asked for.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <simd.h>
+
+static int have_avx2;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void probe(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	have_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+size_t simd_run(const struct simd_kernels *k, uint8_t *dst,
+		const uint8_t *src, size_t n)
+{
+	simd_kernel_t kern;
+
+	pthread_once(&once, probe);
+
+	kern = (have_avx2 && k->avx2) ? k->avx2 : k->sse2;
+	if ( NULL == kern )
+		kern = k->neon;
+	if ( NULL == kern )
+		return 0;
+
+	return (*kern)(dst, src, n);
+}
@@ -0,0 +1,206 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ *
+ * Each test is a program which reports the checks that failed and exits
+ * non-zero if there were any. The helpers build encoded NBT by hand so
+ * that tests don't depend on the encoder they're checking.
+ */
+#ifndef _CHECK_H
+#define _CHECK_H
+
+static unsigned int check_failed;
+
+#define check(expr) \
+	do { \
+		if ( !(expr) ) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", \
+				__FILE__, __LINE__, #expr); \
+			check_failed++; \
+		} \
+	} while(0)
+
+static inline int check_done(void)
+{
+	return (check_failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+struct out {
+	uint8_t buf[1U << 16];
+	size_t len;
+};
+
+static inline void out_u8(struct out *o, uint8_t v)
+{
+	assert(o->len < sizeof(o->buf));
+	o->buf[o->len++] = v;
+}
+
+static inline void out_be16(struct out *o, uint16_t v)
+{
+	out_u8(o, v >> 8);
+	out_u8(o, v);
+}
+
+static inline void out_be32(struct out *o, uint32_t v)
+{
+	out_be16(o, v >> 16);
+	out_be16(o, v);
+}
+
+static inline void out_be64(struct out *o, uint64_t v)
+{
+	out_be32(o, v >> 32);
+	out_be32(o, v);
+}
+
+static inline void out_str(struct out *o, const char *str)
+{
+	size_t len = strlen(str);
+
+	out_be16(o, len);
+	assert(o->len + len <= sizeof(o->buf));
+	memcpy(o->buf + o->len, str, len);
+	o->len += len;
+}
+
+/* header of a named tag, the payload follows */
+static inline void out_tag(struct out *o, uint8_t type, const char *name)
+{
+	out_u8(o, type);
+	out_str(o, name);
+}
+
+static inline void out_list(struct out *o, const char *name,
+				uint8_t type, int32_t len)
+{
+	if ( name )
+		out_tag(o, NBT_TAG_List, name);
+	out_u8(o, type);
+	out_be32(o, len);
+}
+
+/* A document with every tag type in it, including lists which are kept
+ * packed, lists of lists and compounds and an empty list.
+ */
+#define SAMPLE_INT	0x12345678
+#define SAMPLE_NEST	42
+static const int32_t sample_ints[] = {1, -2, 0x7fffffff, -0x7fffffff, 5};
+static const float sample_floats[] = {1.5f, -0.25f, 1e10f};
+
+static inline void out_sample(struct out *o)
+{
+	union {
+		float f;
+		uint32_t u;
+	} f;
+	union {
+		double d;
+		uint64_t u;
+	} d;
+	unsigned int i;
+
+	out_tag(o, NBT_TAG_Compound, "sample");
+
+	out_tag(o, NBT_TAG_Byte, "byte");
+	out_u8(o, 0x85);
+	out_tag(o, NBT_TAG_Short, "short");
+	out_be16(o, 0xfffe);
+	out_tag(o, NBT_TAG_Int, "int");
+	out_be32(o, SAMPLE_INT);
+	out_tag(o, NBT_TAG_Long, "long");
+	out_be64(o, 0x0123456789abcdefULL);
+	f.f = 3.25f;
+	out_tag(o, NBT_TAG_Float, "float");
+	out_be32(o, f.u);
+	d.d = -1.0 / 3.0;
+	out_tag(o, NBT_TAG_Double, "double");
+	out_be64(o, d.u);
+
+	out_tag(o, NBT_TAG_Byte_Array, "bytes");
+	out_be32(o, 5);
+	for(i = 0; i < 5; i++)
+		out_u8(o, i * 51);
+	out_tag(o, NBT_TAG_String, "string");
+	out_str(o, "hello, world");
+	out_tag(o, NBT_TAG_Int_Array, "intarray");
+	out_be32(o, 3);
+	for(i = 0; i < 3; i++)
+		out_be32(o, 0x01020304 * (i + 1));
+	out_tag(o, NBT_TAG_Long_Array, "longarray");
+	out_be32(o, 2);
+	out_be64(o, 0x8000000000000001ULL);
+	out_be64(o, 7);
+
+	out_list(o, "bytelist", NBT_TAG_Byte, 4);
+	for(i = 0; i < 4; i++)
+		out_u8(o, 0xf0 + i);
+	out_list(o, "shorts", NBT_TAG_Short, 3);
+	for(i = 0; i < 3; i++)
+		out_be16(o, 0x8000 + i);
+	out_list(o, "ints", NBT_TAG_Int, 5);
+	for(i = 0; i < 5; i++)
+		out_be32(o, sample_ints[i]);
+	out_list(o, "longs", NBT_TAG_Long, 2);
+	out_be64(o, 1);
+	out_be64(o, 0xfedcba9876543210ULL);
+	out_list(o, "floats", NBT_TAG_Float, 3);
+	for(i = 0; i < 3; i++) {
+		f.f = sample_floats[i];
+		out_be32(o, f.u);
+	}
+	out_list(o, "doubles", NBT_TAG_Double, 2);
+	for(i = 0; i < 2; i++) {
+		d.d = i + 0.5;
+		out_be64(o, d.u);
+	}
+
+	out_list(o, "strings", NBT_TAG_String, 2);
+	out_str(o, "a");
+	out_str(o, "");
+	out_list(o, "compounds", NBT_TAG_Compound, 2);
+	for(i = 0; i < 2; i++) {
+		out_tag(o, NBT_TAG_Int, "n");
+		out_be32(o, i);
+		out_tag(o, NBT_TAG_String, "s");
+		out_str(o, (i) ? "one" : "zero");
+		out_u8(o, NBT_TAG_End);
+	}
+	out_list(o, "lists", NBT_TAG_List, 2);
+	out_list(o, NULL, NBT_TAG_Int, 1);
+	out_be32(o, 9);
+	out_list(o, NULL, NBT_TAG_Byte, 0);
+	out_list(o, "empty", NBT_TAG_End, 0);
+
+	out_tag(o, NBT_TAG_Compound, "nest");
+	out_tag(o, NBT_TAG_Compound, "inner");
+	out_tag(o, NBT_TAG_Int, "v");
+	out_be32(o, SAMPLE_NEST);
+	out_u8(o, NBT_TAG_End);
+	out_u8(o, NBT_TAG_End);
+
+	out_u8(o, NBT_TAG_End);
+}
+
+/* encode a document and check it comes out the same as buf */
+static inline int same_bytes(nbt_t nbt, const uint8_t *buf, size_t len)
+{
+	uint8_t *enc;
+	int ret = 0;
+
+	if ( nbt_size_in_bytes(nbt) != len )
+		return 0;
+
+	enc = malloc(len);
+	if ( NULL == enc )
+		return 0;
+
+	if ( nbt_get_bytes(nbt, enc, len) && !memcmp(enc, buf, len) )
+		ret = 1;
+
+	free(enc);
+	return ret;
+}
+
+#endif /* _CHECK_H */
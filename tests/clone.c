@@ -0,0 +1,170 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ *
+ * Clones share their encoding with the original, but a change to any of
+ * them, however it's made, must only ever show up in that one.
+*/
+#include <libmc/minecraft.h>
+#include <libmc/schematic.h>
+#include <libmc/chunk.h>
+#include <libmc/nbt.h>
+
+#include "check.h"
+
+static struct out doc;
+
+static nbt_tag_t get(nbt_t nbt, const char *name)
+{
+	return nbt_compound_get(nbt_root_tag(nbt), name);
+}
+
+static void modify(nbt_t nbt, unsigned int how)
+{
+	nbt_tag_t t;
+	unsigned int num;
+	int32_t *ints;
+	uint8_t *bytes;
+	size_t sz;
+
+	switch(how) {
+	case 0:
+		check(nbt_int_set(get(nbt, "int"), 1));
+		break;
+	case 1:
+		check(nbt_string_set(get(nbt, "string"), "changed"));
+		break;
+	case 2:
+		/* writes through pointers from the getters */
+		check(nbt_bytearray_get(get(nbt, "bytes"), &bytes, &sz));
+		check(sz == 5);
+		bytes[0] ^= 0xff;
+		break;
+	case 3:
+		check(nbt_list_get_ints(get(nbt, "ints"), &ints, &num));
+		check(num == 5);
+		ints[4] = 0;
+		break;
+	case 4:
+		t = nbt_compound_get(get(nbt, "nest"), "inner");
+		check(nbt_int_set(nbt_compound_get(t, "v"), 0));
+		break;
+	case 5:
+		check(nbt_compound_delete(nbt_root_tag(nbt), "compounds"));
+		break;
+	case 6:
+		t = nbt_tag_new(nbt, NBT_TAG_Byte);
+		check(t && nbt_byte_set(t, 1));
+		check(nbt_list_append(get(nbt, "bytelist"), t));
+		break;
+	case 7:
+		t = nbt_list_get(get(nbt, "compounds"), 0);
+		check(nbt_string_set(nbt_compound_get(t, "s"), "nought"));
+		break;
+	}
+}
+
+#define NR_MODS 8
+
+static void documents(void)
+{
+	nbt_t orig, a, b, c;
+	unsigned int i;
+
+	for(i = 0; i < NR_MODS; i++) {
+		orig = nbt_decode(doc.buf, doc.len);
+		check(NULL != orig);
+		if ( NULL == orig )
+			return;
+
+		a = nbt_clone(orig);
+		b = nbt_clone(orig);
+		c = nbt_clone(a);
+		check(a && b && c);
+		if ( NULL == a || NULL == b || NULL == c )
+			return;
+		check(same_bytes(a, doc.buf, doc.len));
+		check(nbt_equal(a, orig));
+
+		/* a changed clone goes its own way */
+		modify(a, i);
+		check(!nbt_equal(a, orig));
+		check(same_bytes(orig, doc.buf, doc.len));
+		check(same_bytes(b, doc.buf, doc.len));
+		check(same_bytes(c, doc.buf, doc.len));
+
+		/* and so does a changed original */
+		modify(orig, i);
+		check(nbt_equal(orig, a));
+		check(same_bytes(b, doc.buf, doc.len));
+		check(same_bytes(c, doc.buf, doc.len));
+
+		/* clones of clones of the change see it */
+		nbt_free(c);
+		c = nbt_clone(a);
+		check(c && nbt_equal(c, a));
+
+		/* the shared encoding outlives whoever made it */
+		nbt_free(orig);
+		nbt_free(a);
+		check(same_bytes(b, doc.buf, doc.len));
+		modify(b, i);
+		check(nbt_equal(b, c));
+
+		nbt_free(b);
+		nbt_free(c);
+	}
+}
+
+static void chunks(void)
+{
+	chunk_t tmpl, a, b;
+	uint8_t id, data;
+	size_t sz;
+
+	tmpl = chunk_new();
+	check(NULL != tmpl);
+	if ( NULL == tmpl )
+		return;
+	check(chunk_set_block(tmpl, 1, 2, 3, 4, 5));
+
+	a = chunk_clone(tmpl);
+	b = chunk_clone(tmpl);
+	check(a && b);
+	if ( NULL == a || NULL == b )
+		return;
+
+	check(chunk_set_block(a, 1, 2, 3, 7, 0));
+	check(chunk_set_block(a, 15, 100, 15, 1, 0));
+	check(chunk_set_pos(b, 10, -10));
+
+	check(chunk_get_block(tmpl, 1, 2, 3, &id, &data));
+	check(id == 4 && data == 5);
+	check(chunk_get_block(tmpl, 15, 100, 15, &id, &data));
+	check(id == 0);
+	check(chunk_get_block(b, 1, 2, 3, &id, &data));
+	check(id == 4 && data == 5);
+	check(chunk_get_block(b, 15, 100, 15, &id, &data));
+	check(id == 0);
+	check(chunk_get_block(a, 1, 2, 3, &id, &data));
+	check(id == 7 && data == 0);
+
+	check(chunk_hash(a) != chunk_hash(tmpl));
+	check(chunk_hash(b) != chunk_hash(tmpl));
+	check(chunk_encode(tmpl, CHUNK_ENC_RAW, &sz));
+
+	chunk_put(tmpl);
+	check(chunk_get_block(b, 1, 2, 3, &id, &data));
+	check(id == 4 && data == 5);
+	chunk_put(a);
+	chunk_put(b);
+}
+
+int main(int argc, char **argv)
+{
+	out_sample(&doc);
+	documents();
+	chunks();
+	return check_done();
+}
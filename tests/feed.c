@@ -0,0 +1,194 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ *
+ * The resumable parser has to see the same document as nbt_parse() no
+ * matter where the pieces it's fed are split.
+*/
+#include <libmc/minecraft.h>
+#include <libmc/nbt.h>
+
+#include "check.h"
+
+static struct out doc;
+static struct out trace;
+
+static void put(const void *buf, size_t len)
+{
+	assert(trace.len + len <= sizeof(trace.buf));
+	memcpy(trace.buf + trace.len, buf, len);
+	trace.len += len;
+}
+
+static void put_name(uint8_t ev, const char *name, size_t nlen)
+{
+	put(&ev, sizeof(ev));
+	put(&nlen, sizeof(nlen));
+	if ( name )
+		put(name, nlen);
+}
+
+static int begin_compound(void *priv, const char *name, size_t nlen)
+{
+	put_name('C', name, nlen);
+	if ( priv && name && nlen == 4 && !memcmp(name, "nest", 4) )
+		return NBT_VISIT_SKIP;
+	return NBT_VISIT_OK;
+}
+
+static int end_compound(void *priv)
+{
+	put_name('c', NULL, 0);
+	return NBT_VISIT_OK;
+}
+
+static int begin_list(void *priv, const char *name, size_t nlen,
+			uint8_t type, int32_t len)
+{
+	put_name('L', name, nlen);
+	put(&type, sizeof(type));
+	put(&len, sizeof(len));
+	if ( priv && name && nlen == 9 && !memcmp(name, "compounds", 9) )
+		return NBT_VISIT_SKIP;
+	return NBT_VISIT_OK;
+}
+
+static int end_list(void *priv)
+{
+	put_name('l', NULL, 0);
+	return NBT_VISIT_OK;
+}
+
+static int scalar(void *priv, const char *name, size_t nlen,
+			uint8_t type, const union nbt_value *val)
+{
+	put_name('S', name, nlen);
+	put(&type, sizeof(type));
+	switch(type) {
+	case NBT_TAG_Byte:
+		put(&val->b, sizeof(val->b));
+		break;
+	case NBT_TAG_Short:
+		put(&val->s, sizeof(val->s));
+		break;
+	case NBT_TAG_Int:
+	case NBT_TAG_Float:
+		put(&val->i, sizeof(val->i));
+		break;
+	default:
+		put(&val->l, sizeof(val->l));
+		break;
+	}
+	return NBT_VISIT_OK;
+}
+
+static int array(void *priv, const char *name, size_t nlen,
+			uint8_t type, const void *data, int32_t len)
+{
+	size_t esz = 1;
+
+	if ( type == NBT_TAG_Int_Array )
+		esz = sizeof(int32_t);
+	else if ( type == NBT_TAG_Long_Array )
+		esz = sizeof(int64_t);
+
+	put_name('A', name, nlen);
+	put(&type, sizeof(type));
+	put(&len, sizeof(len));
+	put(data, len * esz);
+	return NBT_VISIT_OK;
+}
+
+static const struct nbt_visitor every = {
+	.begin_compound = begin_compound,
+	.end_compound = end_compound,
+	.begin_list = begin_list,
+	.end_list = end_list,
+	.scalar = scalar,
+	.array = array,
+};
+
+/* with priv set, skips some containers, and arrays are skipped too */
+static const struct nbt_visitor skipping = {
+	.begin_compound = begin_compound,
+	.end_compound = end_compound,
+	.begin_list = begin_list,
+	.end_list = end_list,
+	.scalar = scalar,
+};
+
+/* each piece is a copy which is trashed once it's been fed */
+static int feed(nbt_parser_t p, const uint8_t *buf, size_t len)
+{
+	uint8_t *piece;
+	int ret;
+
+	piece = malloc(len + 1);
+	assert(piece);
+	memcpy(piece, buf, len);
+	ret = nbt_parser_feed(p, piece, len);
+	memset(piece, 0xa5, len);
+	free(piece);
+	return ret;
+}
+
+static void splits(const struct nbt_visitor *v, void *priv)
+{
+	static struct out want;
+	nbt_parser_t p;
+	size_t i;
+
+	trace.len = 0;
+	check(nbt_parse(doc.buf, doc.len, v, priv));
+	want = trace;
+
+	/* in two, at every byte */
+	for(i = 0; i <= doc.len; i++) {
+		trace.len = 0;
+		p = nbt_parser_new(v, priv);
+		assert(p);
+		check(feed(p, doc.buf, i));
+		check(feed(p, doc.buf + i, doc.len - i));
+		check(nbt_parser_finish(p));
+		check(trace.len == want.len &&
+			!memcmp(trace.buf, want.buf, want.len));
+	}
+
+	/* a byte at a time */
+	trace.len = 0;
+	p = nbt_parser_new(v, priv);
+	assert(p);
+	for(i = 0; i < doc.len; i++)
+		check(feed(p, doc.buf + i, 1));
+	check(nbt_parser_finish(p));
+	check(trace.len == want.len && !memcmp(trace.buf, want.buf, want.len));
+
+	/* Prefixes go the same way as with nbt_parse(), which fails them
+	 * except where a compound would end with the buffer.
+	 */
+	for(i = 0; i < doc.len; i++) {
+		static struct out part;
+		int ok;
+
+		trace.len = 0;
+		ok = nbt_parse(doc.buf, i, v, priv);
+		part = trace;
+
+		trace.len = 0;
+		p = nbt_parser_new(v, priv);
+		assert(p);
+		feed(p, doc.buf, i);
+		check(nbt_parser_finish(p) == ok);
+		check(!ok || (trace.len == part.len &&
+				!memcmp(trace.buf, part.buf, part.len)));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	out_sample(&doc);
+	splits(&every, NULL);
+	splits(&skipping, &doc);
+	return check_done();
+}
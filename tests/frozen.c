@@ -0,0 +1,217 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ *
+ * A frozen document has to read back the same as the tree it came from,
+ * wherever the buffer ends up, and damaged buffers mustn't load in to
+ * anything which reads outside of them.
+*/
+#include <libmc/minecraft.h>
+#include <libmc/nbt.h>
+
+#include "check.h"
+
+static const char * const names[] = {
+	"byte", "short", "int", "long", "float", "double", "bytes",
+	"string", "intarray", "longarray", "bytelist", "shorts", "ints",
+	"longs", "floats", "doubles", "strings", "compounds", "lists",
+	"empty", "nest", "inner", "v", "n", "s", "missing",
+};
+
+static int same_list(nbt_tag_t a, nbt_tag_t b);
+
+static int same_tag(nbt_tag_t a, nbt_tag_t b)
+{
+	const void *pa, *pb;
+	unsigned int na, nb;
+	size_t la, lb, i;
+	int32_t ia, ib;
+	int64_t xa, xb;
+	int16_t sa, sb;
+	uint8_t ba, bb;
+
+	if ( NULL == a || NULL == b )
+		return a == b;
+	if ( nbt_tag_type(a) != nbt_tag_type(b) )
+		return 0;
+	if ( (NULL == nbt_tag_name(a)) != (NULL == nbt_tag_name(b)) )
+		return 0;
+	if ( nbt_tag_name(a) && strcmp(nbt_tag_name(a), nbt_tag_name(b)) )
+		return 0;
+
+	switch(nbt_tag_type(a)) {
+	case NBT_TAG_Byte:
+		return nbt_byte_get(a, &ba) && nbt_byte_get(b, &bb) && ba == bb;
+	case NBT_TAG_Short:
+		return nbt_short_get(a, &sa) && nbt_short_get(b, &sb) &&
+			sa == sb;
+	case NBT_TAG_Int:
+		return nbt_int_get(a, &ia) && nbt_int_get(b, &ib) && ia == ib;
+	case NBT_TAG_Long:
+		return nbt_long_get(a, &xa) && nbt_long_get(b, &xb) &&
+			xa == xb;
+	case NBT_TAG_Float:
+	case NBT_TAG_Double:
+		/* no getters, the round-trip test covers them */
+		return 1;
+	case NBT_TAG_Byte_Array:
+		if ( !nbt_bytearray_peek(a, (const uint8_t **)&pa, &la) ||
+				!nbt_bytearray_peek(b, (const uint8_t **)&pb,
+							&lb) )
+			return 0;
+		return la == lb && !memcmp(pa, pb, la);
+	case NBT_TAG_String:
+		if ( !nbt_string_peek(a, (const char **)&pa, &la) ||
+				!nbt_string_peek(b, (const char **)&pb, &lb) )
+			return 0;
+		return la == lb && !memcmp(pa, pb, la);
+	case NBT_TAG_Int_Array:
+		if ( !nbt_intarray_peek(a, (const int32_t **)&pa, &na) ||
+				!nbt_intarray_peek(b, (const int32_t **)&pb,
+							&nb) )
+			return 0;
+		return na == nb && !memcmp(pa, pb, na * sizeof(int32_t));
+	case NBT_TAG_Long_Array:
+		if ( !nbt_longarray_peek(a, (const int64_t **)&pa, &na) ||
+				!nbt_longarray_peek(b, (const int64_t **)&pb,
+							&nb) )
+			return 0;
+		return na == nb && !memcmp(pa, pb, na * sizeof(int64_t));
+	case NBT_TAG_List:
+		return same_list(a, b);
+	case NBT_TAG_Compound:
+		for(i = 0; i < sizeof(names) / sizeof(*names); i++) {
+			if ( !same_tag(nbt_compound_get(a, names[i]),
+					nbt_compound_get(b, names[i])) )
+				return 0;
+		}
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* numbers are only available as arrays from frozen lists */
+#define same_array(get, type) \
+	do { \
+		type *va, *vb; \
+		if ( get(a, &va, &na) ) \
+			return get(b, &vb, &nb) && na == nb && \
+				!memcmp(va, vb, na * sizeof(*va)); \
+	} while(0)
+
+static int same_list(nbt_tag_t a, nbt_tag_t b)
+{
+	unsigned int na, nb;
+	int i;
+
+	if ( nbt_list_get_size(a) != nbt_list_get_size(b) )
+		return 0;
+
+	same_array(nbt_list_get_bytes, uint8_t);
+	same_array(nbt_list_get_shorts, int16_t);
+	same_array(nbt_list_get_ints, int32_t);
+	same_array(nbt_list_get_longs, int64_t);
+	same_array(nbt_list_get_floats, float);
+	same_array(nbt_list_get_doubles, double);
+
+	for(i = 0; i < nbt_list_get_size(a); i++) {
+		if ( !same_tag(nbt_list_get(a, i), nbt_list_get(b, i)) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* a tag tree which loaded from damaged data must still be safe to read */
+static void read_all(nbt_tag_t t)
+{
+	size_t i;
+	int n;
+
+	if ( NULL == t )
+		return;
+
+	same_tag(t, t);
+	if ( nbt_tag_type(t) == NBT_TAG_List ) {
+		for(n = 0; n < nbt_list_get_size(t) && n < 64; n++)
+			read_all(nbt_list_get(t, n));
+	}else if ( nbt_tag_type(t) == NBT_TAG_Compound ) {
+		for(i = 0; i < sizeof(names) / sizeof(*names); i++)
+			read_all(nbt_compound_get(t, names[i]));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static struct out doc;
+	unsigned int seed = 1, i, k, n;
+	uint8_t *buf, *copy;
+	nbt_tag_t root, t;
+	size_t len, at;
+	nbt_t nbt;
+
+	out_sample(&doc);
+	nbt = nbt_decode(doc.buf, doc.len);
+	check(NULL != nbt);
+	if ( NULL == nbt )
+		return EXIT_FAILURE;
+
+	buf = nbt_freeze(nbt, &len);
+	check(NULL != buf);
+	if ( NULL == buf )
+		return EXIT_FAILURE;
+
+	root = nbt_frozen_root(buf, len);
+	check(NULL != root);
+	check(same_tag(root, nbt_root_tag(nbt)));
+
+	/* read-only */
+	t = nbt_compound_get(root, "int");
+	check(NULL != t && !nbt_int_set(t, 1));
+	check(!nbt_compound_delete(root, "int"));
+	check(NULL != nbt_compound_get(root, "int"));
+
+	/* it holds no pointers, so it works from anywhere */
+	copy = malloc(len);
+	assert(copy);
+	memcpy(copy, buf, len);
+	memset(buf, 0, len);
+	root = nbt_frozen_root(copy, len);
+	check(NULL != root);
+	check(same_tag(root, nbt_root_tag(nbt)));
+
+	/* which is a copy, later changes to the tree don't show */
+	t = nbt_compound_get(nbt_compound_get(nbt_compound_get(
+				nbt_root_tag(nbt), "nest"), "inner"), "v");
+	check(nbt_int_set(t, SAMPLE_NEST + 1));
+	check(!same_tag(root, nbt_root_tag(nbt)));
+	check(nbt_int_set(t, SAMPLE_NEST));
+
+	/* anything cut short is refused */
+	for(i = 0; i < len; i++)
+		check(NULL == nbt_frozen_root(copy, i));
+
+	/* and damage loads as something which only refers to itself */
+	for(i = 0; i < 2000; i++) {
+		memcpy(buf, copy, len);
+		n = 1 + rand_r(&seed) % 4;
+		for(k = 0; k < n; k++) {
+			at = rand_r(&seed) % len;
+			if ( rand_r(&seed) & 1 ) {
+				buf[at] = rand_r(&seed);
+			}else if ( (at & ~3UL) + 4 <= len ) {
+				uint32_t v = rand_r(&seed) % (len * 2);
+
+				memcpy(buf + (at & ~3UL), &v, sizeof(v));
+			}
+		}
+		read_all(nbt_frozen_root(buf, len));
+	}
+
+	free(copy);
+	free(buf);
+	nbt_free(nbt);
+	return check_done();
+}
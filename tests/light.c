@@ -0,0 +1,206 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ *
+ * Relighting a window of chunks after some edits has to come out the
+ * same as lighting the finished blocks from scratch, and mustn't touch
+ * chunks which the edits can't reach.
+*/
+#include <libmc/minecraft.h>
+#include <libmc/schematic.h>
+#include <libmc/chunk.h>
+#include <libmc/nbt.h>
+
+#include "check.h"
+
+#define W	5
+#define H	5
+#define MAX_Y	48
+
+/* air, glass, torches, grass, leaves, water, stone, glowstone, lava... */
+static const uint8_t ids[] = {
+	0, 0, 0, 0, 0, 0, 1, 1, 1, 20, 18, 8, 31, 50, 89, 11, 76,
+};
+
+static uint8_t blocks[MAX_Y][H * 16][W * 16];
+static unsigned int seed = 11;
+
+static void put(chunk_t *win, unsigned int x, unsigned int y,
+		unsigned int z, uint8_t id)
+{
+	check(chunk_set_block(win[(z / 16) * W + x / 16],
+				x % 16, y, z % 16, id, 0));
+	blocks[y][z][x] = id;
+}
+
+static uint8_t pick(void)
+{
+	return ids[rand_r(&seed) % sizeof(ids)];
+}
+
+/* block light of the bottom MAX_Y blocks of a chunk */
+static void get_light(chunk_t c, uint8_t light[MAX_Y][16][16])
+{
+	const uint8_t *enc, *bl;
+	nbt_tag_t secs, sec;
+	unsigned int x, y, z, idx;
+	uint8_t sy;
+	size_t sz;
+	nbt_t nbt;
+	int i;
+
+	memset(light, 0, MAX_Y * 16 * 16);
+
+	enc = chunk_encode(c, CHUNK_ENC_RAW, &sz);
+	check(NULL != enc);
+	if ( NULL == enc )
+		return;
+
+	nbt = nbt_decode(enc, sz);
+	check(NULL != nbt);
+	if ( NULL == nbt )
+		return;
+
+	secs = nbt_compound_get(nbt_compound_get(nbt_root_tag(nbt),
+					"Level"), "Sections");
+	/* chunks with no blocks yet have no sections */
+	for(i = 0; i < nbt_list_get_size(secs); i++) {
+		sec = nbt_list_get(secs, i);
+		if ( !nbt_byte_get(nbt_compound_get(sec, "Y"), &sy) ||
+				sy >= MAX_Y / 16 )
+			continue;
+		if ( !nbt_bytearray_peek(nbt_compound_get(sec, "BlockLight"),
+					&bl, &sz) || sz != 2048 )
+			continue;
+		for(y = 0; y < 16; y++) {
+			for(z = 0; z < 16; z++) {
+				for(x = 0; x < 16; x++) {
+					idx = (y * 16 + z) * 16 + x;
+					light[sy * 16 + y][z][x] =
+						(bl[idx / 2] >> ((idx & 1) * 4))
+							& 0xf;
+				}
+			}
+		}
+	}
+
+	nbt_free(nbt);
+}
+
+/* light the current blocks in a new window and compare */
+static void compare(chunk_t *win, const char *what)
+{
+	static uint8_t got[MAX_Y][16][16], want[MAX_Y][16][16];
+	chunk_t fresh[W * H];
+	unsigned int i, x, y, z;
+
+	for(i = 0; i < W * H; i++) {
+		fresh[i] = chunk_new();
+		assert(fresh[i]);
+	}
+
+	for(y = 0; y < MAX_Y; y++)
+		for(z = 0; z < H * 16; z++)
+			for(x = 0; x < W * 16; x++)
+				if ( blocks[y][z][x] )
+					put(fresh, x, y, z, blocks[y][z][x]);
+
+	check(chunk_light_window(fresh, W, H, NULL));
+
+	for(i = 0; i < W * H; i++) {
+		get_light(win[i], got);
+		get_light(fresh[i], want);
+		if ( memcmp(got, want, sizeof(got)) ) {
+			fprintf(stderr, "%s: chunk %u differs\n", what, i);
+			check_failed++;
+		}
+		chunk_put(fresh[i]);
+	}
+}
+
+/* edits inside the middle chunk can't reach the outer ring */
+static void reach(const uint8_t *changed)
+{
+	unsigned int x, z;
+
+	for(z = 0; z < H; z++) {
+		for(x = 0; x < W; x++) {
+			if ( x && z && x < W - 1 && z < H - 1 )
+				continue;
+			check(!changed[z * W + x]);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t before[MAX_Y][16][16], after[MAX_Y][16][16];
+	uint8_t changed[W * H];
+	chunk_t win[W * H];
+	unsigned int t, i, x, y, z;
+
+	for(t = 0; t < 3; t++) {
+		memset(blocks, 0, sizeof(blocks));
+		for(i = 0; i < W * H; i++) {
+			win[i] = chunk_new();
+			assert(win[i]);
+		}
+
+		for(i = 0; i < 40000; i++) {
+			put(win, rand_r(&seed) % (W * 16),
+				rand_r(&seed) % MAX_Y,
+				rand_r(&seed) % (H * 16), pick());
+		}
+		check(chunk_light_window(win, W, H, NULL));
+		compare(win, "initial");
+
+		/* a few edits in the middle chunk, then filling it in */
+		for(i = 0; i < 400; i++) {
+			put(win, 32 + rand_r(&seed) % 16,
+				rand_r(&seed) % MAX_Y,
+				32 + rand_r(&seed) % 16, pick());
+		}
+		check(chunk_light_window(win, W, H, changed));
+		reach(changed);
+		compare(win, "edited");
+
+		for(y = 0; y < MAX_Y; y++)
+			for(z = 32; z < 48; z++)
+				for(x = 32; x < 48; x++)
+					if ( blocks[y][z][x] != 1 )
+						put(win, x, y, z, 1);
+		check(chunk_light_window(win, W, H, changed));
+		reach(changed);
+		compare(win, "walled");
+
+		/* relighting with nothing to do changes nothing */
+		get_light(win[2 * W + 2], before);
+		check(chunk_light_window(win, W, H, changed));
+		for(i = 0; i < W * H; i++)
+			check(!changed[i]);
+		get_light(win[2 * W + 2], after);
+		check(!memcmp(before, after, sizeof(before)));
+
+		for(i = 0; i < W * H; i++)
+			chunk_put(win[i]);
+	}
+
+	/* and a lone torch in the open lights up like one */
+	for(i = 0; i < W * H; i++)
+		win[i] = chunk_new();
+	memset(blocks, 0, sizeof(blocks));
+	put(win, 40, 20, 40, 50);
+	check(chunk_light_window(win, W, H, NULL));
+	get_light(win[2 * W + 2], after);
+	check(after[20][8][8] == 14);
+	check(after[21][8][8] == 13);
+	check(after[20][8][15] == 7);
+	get_light(win[2 * W + 3], after);
+	check(after[20][8][0] == 6);
+	compare(win, "torch");
+	for(i = 0; i < W * H; i++)
+		chunk_put(win[i]);
+
+	return check_done();
+}
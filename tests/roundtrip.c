@@ -0,0 +1,174 @@
+/*
+ * This file is part of libmc
+ * Copyright (c) 2011 Gianni Tedesco
+ * Released under the terms of the GNU GPL version 2
+ *
+ * Every way of decoding a document has to encode back to the same bytes
+ * and compare equal to the others, before and after it's been poked at.
+*/
+#include <libmc/minecraft.h>
+#include <libmc/nbt.h>
+
+#include "check.h"
+
+static struct out doc;
+
+static nbt_tag_t get(nbt_t nbt, const char *name)
+{
+	return nbt_compound_get(nbt_root_tag(nbt), name);
+}
+
+/* read things which a lazy decode has to expand to find */
+static void look(nbt_t nbt)
+{
+	nbt_tag_t t;
+	int32_t i32;
+	char *str;
+
+	t = nbt_compound_get(get(nbt, "nest"), "inner");
+	check(nbt_int_get(nbt_compound_get(t, "v"), &i32));
+	check(i32 == SAMPLE_NEST);
+
+	t = nbt_list_get(get(nbt, "compounds"), 1);
+	check(nbt_string_get(nbt_compound_get(t, "s"), &str));
+	check(!strcmp(str, "one"));
+
+	check(nbt_list_get_size(get(nbt, "empty")) == 0);
+	check(nbt_list_get_size(nbt_list_get(get(nbt, "lists"), 0)) == 1);
+}
+
+static void decoded(nbt_t nbt, nbt_t ref, const char *how)
+{
+	nbt_tag_t t;
+	int32_t i32;
+
+	check(NULL != nbt);
+	if ( NULL == nbt ) {
+		fprintf(stderr, "%s: decode failed\n", how);
+		return;
+	}
+
+	check(same_bytes(nbt, doc.buf, doc.len));
+	check(nbt_equal(nbt, ref));
+	check(nbt_hash(nbt) == nbt_hash(ref));
+
+	look(nbt);
+	check(same_bytes(nbt, doc.buf, doc.len));
+
+	/* a change shows up in the encoding and goes away again */
+	t = get(nbt, "int");
+	check(nbt_int_set(t, 7));
+	check(!same_bytes(nbt, doc.buf, doc.len));
+	check(!nbt_equal(nbt, ref));
+	check(nbt_int_set(t, SAMPLE_INT));
+	check(nbt_int_get(t, &i32) && i32 == SAMPLE_INT);
+	check(same_bytes(nbt, doc.buf, doc.len));
+	check(nbt_equal(nbt, ref));
+	check(nbt_hash(nbt) == nbt_hash(ref));
+
+	nbt_free(nbt);
+}
+
+static void little_endian(nbt_t ref)
+{
+	size_t len = nbt_size_in_bytes(ref);
+	uint8_t *le, *le2;
+	nbt_t nbt;
+
+	le = malloc(len);
+	le2 = malloc(len);
+	assert(le && le2);
+
+	check(nbt_get_bytes_le(ref, le, len));
+	check(memcmp(le, doc.buf, len));
+
+	nbt = nbt_decode_le(le, len);
+	check(NULL != nbt);
+	if ( nbt ) {
+		check(same_bytes(nbt, doc.buf, doc.len));
+		check(nbt_get_bytes_le(nbt, le2, len));
+		check(!memcmp(le, le2, len));
+		check(nbt_equal(nbt, ref));
+		look(nbt);
+		nbt_free(nbt);
+	}
+
+	/* big-endian data isn't valid little-endian */
+	nbt = nbt_decode_le(doc.buf, doc.len);
+	check(NULL == nbt || !nbt_equal(nbt, ref));
+	if ( nbt )
+		nbt_free(nbt);
+
+	free(le2);
+	free(le);
+}
+
+/* lists of numbers go back and forth between packed and element tags */
+static void packed(nbt_t ref)
+{
+	static const int32_t other[] = {3, 4};
+	nbt_t nbt = nbt_decode(doc.buf, doc.len);
+	unsigned int num, i;
+	nbt_tag_t list, t;
+	int32_t *ints;
+	float *floats;
+	int32_t i32;
+
+	check(NULL != nbt);
+	if ( NULL == nbt )
+		return;
+
+	list = get(nbt, "ints");
+	check(nbt_list_get_ints(list, &ints, &num));
+	check(num == 5 && !memcmp(ints, sample_ints, sizeof(sample_ints)));
+	check(nbt_list_get_floats(get(nbt, "floats"), &floats, &num));
+	check(num == 3 && !memcmp(floats, sample_floats,
+					sizeof(sample_floats)));
+
+	/* per element access unpacks, changes survive packing again */
+	t = nbt_list_get(list, 2);
+	check(nbt_int_get(t, &i32) && i32 == sample_ints[2]);
+	check(nbt_int_set(t, -1));
+	check(nbt_list_get_ints(list, &ints, &num));
+	check(num == 5 && ints[2] == -1);
+	check(!nbt_equal(nbt, ref));
+
+	check(nbt_list_set_ints(list, sample_ints, 5));
+	check(same_bytes(nbt, doc.buf, doc.len));
+	check(nbt_equal(nbt, ref));
+
+	/* appended element tags encode the same as a packed array */
+	check(nbt_list_set_ints(list, other, 2));
+	check(nbt_list_set_size(list, 0));
+	for(i = 0; i < 5; i++) {
+		t = nbt_tag_new(nbt, NBT_TAG_Int);
+		check(t && nbt_int_set(t, sample_ints[i]));
+		check(nbt_list_append(list, t));
+	}
+	check(same_bytes(nbt, doc.buf, doc.len));
+	check(nbt_equal(nbt, ref));
+	check(nbt_hash(nbt) == nbt_hash(ref));
+
+	nbt_free(nbt);
+}
+
+int main(int argc, char **argv)
+{
+	nbt_t ref;
+
+	out_sample(&doc);
+
+	ref = nbt_decode(doc.buf, doc.len);
+	check(NULL != ref);
+	if ( NULL == ref )
+		return EXIT_FAILURE;
+
+	decoded(nbt_decode(doc.buf, doc.len), ref, "copy");
+	decoded(nbt_decode_borrowed(doc.buf, doc.len), ref, "borrowed");
+	decoded(nbt_decode_lazy(doc.buf, doc.len), ref, "lazy");
+	little_endian(ref);
+	packed(ref);
+
+	nbt_free(ref);
+	return check_done();
+}